@@ -0,0 +1,275 @@
+/*
+Fuzz target of the response head parser and the chunked decoder. The input is
+fed through ResponseHeadParser::parse() and the rest of it through
+ChunkedDecoder, once whole and once split at points the input picks, and the
+two results must agree. The head is also parsed keeping only KnownFields.
+With clang and libFuzzer, from the repository root:
+
+    clang++ -std=c++11 -g -O1 -fsanitize=fuzzer,address,undefined -Isrc \
+        fuzz/parser_fuzz.cpp -o parser_fuzz
+    ./parser_fuzz -max_len=4096
+
+Compilers without libFuzzer build the same target with a driver that runs the
+files given to it and then inputs generated from a fixed seed:
+
+    g++ -std=c++11 -g -O1 -fsanitize=address,undefined -DPARSER_FUZZ_DRIVER -Isrc \
+        fuzz/parser_fuzz.cpp -o parser_fuzz
+    ./parser_fuzz [files] [-runs=N]
+*/
+
+#include "http_parser.hpp"
+#include "header_table.hpp"
+#include "chunked_decoder.hpp"
+
+#include <boost/asio/buffers_iterator.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace {
+
+// Stops the run on a broken invariant, so that the fuzzer keeps the input
+void check(bool condition, const char* what)
+{
+    if (!condition) {
+        std::fprintf(stderr, "parser_fuzz: %s\n", what);
+        std::abort();
+    }
+}
+
+// --------------------------------------------------------------------------------
+// Splitter class: The sizes of the pieces the input arrives in, as reads from a
+// socket would return it. Drawn from a generator seeded by the input, each at
+// most the given maximum.
+// --------------------------------------------------------------------------------
+
+class Splitter
+{
+public:
+    Splitter(std::uint32_t seed, std::size_t max_piece) :
+        m_state(seed | 1),
+        m_max_piece(max_piece)
+    {}
+
+    std::size_t next(std::size_t left)
+    {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 17;
+        m_state ^= m_state << 5;
+        std::size_t piece = 1 + m_state % m_max_piece;
+        return piece < left ? piece : left;
+    }
+
+private:
+    std::uint32_t m_state;              // xorshift32
+    std::size_t m_max_piece;
+};
+
+bool is_within(boost::string_view span, const std::string& buffer)
+{
+    return span.empty() || (span.data() >= buffer.data()
+        && span.data() + span.size() <= buffer.data() + buffer.size());
+}
+
+// Parses the head whole and in pieces. Returns the result, and the size of the
+// head if it is complete.
+ResponseHeadParser::Result fuzz_head(const std::string& input, Splitter& splitter,
+    std::size_t& head_size)
+{
+    ResponseHeadParser whole;
+    ResponseHeadParser::Result whole_result = whole.parse(input.data(), input.size());
+
+    // The pieces are appended to a buffer that moves as it grows, as the
+    // receive buffer may, so spans kept from an earlier call would dangle
+    ResponseHeadParser parser;
+    ResponseHeadParser::Result result = ResponseHeadParser::Result::incomplete;
+    std::string buffer;
+    while (buffer.size() < input.size() && result == ResponseHeadParser::Result::incomplete) {
+        std::size_t piece = splitter.next(input.size() - buffer.size());
+        buffer.append(input, buffer.size(), piece);
+        result = parser.parse(buffer.data(), buffer.size());
+    }
+
+    // A head that is not complete within the limit is only invalid once that
+    // much has been buffered, which the pieces may reach before the whole does
+    if (input.size() <= HeadParser::MAX_HEAD_SIZE)
+        check(result == whole_result, "split and whole parse differ");
+    if (result != ResponseHeadParser::Result::complete)
+        return result;
+
+    check(whole_result == result, "split parse completes, whole does not");
+    head_size = parser.get_head_size();
+    check(head_size >= 4 && head_size <= buffer.size(), "head size out of range");
+    check(buffer.compare(head_size - 4, 4, "\r\n\r\n") == 0, "head does not end with CRLF CRLF");
+    check(head_size == whole.get_head_size(), "head sizes differ");
+    check(parser.get_status_code() == whole.get_status_code(), "status codes differ");
+    check(parser.get_status_code() <= 999, "status code out of range");
+    check(parser.get_version_minor() == whole.get_version_minor(), "versions differ");
+    check(parser.get_status_message() == whole.get_status_message(), "status messages differ");
+    check(is_within(parser.get_status_message(), buffer), "status message outside the buffer");
+    check(parser.get_status_message().find_first_of("\r\n") == boost::string_view::npos,
+        "status message with a line break");
+
+    const std::vector<HeaderField>& fields = parser.get_fields();
+    check(fields.size() == whole.get_fields().size(), "field counts differ");
+
+    HeaderTable headers;
+    for (std::size_t i = 0; i < fields.size(); ++i) {
+        const HeaderField& field = fields[i];
+        check(is_within(field.name, buffer) && is_within(field.value, buffer),
+            "field outside the buffer");
+        check(field.name == whole.get_fields()[i].name
+            && field.value == whole.get_fields()[i].value, "fields differ");
+        check(!field.name.empty(), "empty field name");
+        check(field.name.find_first_of(": \t\r\n") == boost::string_view::npos,
+            "field name with a separator");
+        check(field.value.find_first_of("\r\n") == boost::string_view::npos,
+            "field value with a line break");
+        check(field.value.empty() || (field.value.front() != ' ' && field.value.front() != '\t'
+            && field.value.back() != ' ' && field.value.back() != '\t'),
+            "field value not trimmed");
+        headers.add(field.name, field.value);
+
+        boost::string_view value;
+        check(headers.find(field.name, value), "field not found in the table");
+    }
+
+    // A parse that skips the unknown headers keeps the known ones in order
+    ResponseHeadParser known;
+    check(known.parse<KnownFields>(input.data(), input.size()) == whole_result,
+        "known fields parse differs");
+    std::size_t kept = 0;
+    for (const HeaderField& field : fields) {
+        if (HeaderTable::intern(field.name) == KnownHeader::unknown)
+            continue;
+        check(kept < known.get_fields().size() && known.get_fields()[kept].name == field.name
+            && known.get_fields()[kept].value == field.value, "known fields differ");
+        ++kept;
+    }
+    check(kept == known.get_fields().size(), "unknown field kept");
+
+    // The framing the client derives from the head
+    std::size_t content_length = 0;
+    bool is_valid = false;
+    if (headers.find_content_length(content_length, is_valid) && is_valid) {
+        boost::string_view value;
+        check(headers.find(KnownHeader::content_length, value), "Content-Length not interned");
+    }
+    return result;
+}
+
+std::string to_string(const boost::asio::streambuf& body)
+{
+    return std::string(boost::asio::buffers_begin(body.data()),
+        boost::asio::buffers_end(body.data()));
+}
+
+// Decodes the body whole and in pieces, the two must agree
+void fuzz_chunked(const char* data, std::size_t size, Splitter& splitter)
+{
+    ChunkedDecoder whole;
+    boost::asio::streambuf whole_body;
+    boost::system::error_code whole_ec;
+    std::size_t whole_used = whole.decode(data, size, whole_body, whole_ec);
+    check(whole_used <= size, "decoder used more than it was given");
+    check(whole_used == size || whole_ec || whole.is_done(), "decoder stopped early");
+
+    ChunkedDecoder decoder;
+    boost::asio::streambuf body;
+    boost::system::error_code ec;
+    std::size_t used = 0;
+    while (used < size && !ec && !decoder.is_done()) {
+        std::size_t piece = splitter.next(size - used);
+        std::size_t piece_used = decoder.decode(data + used, piece, body, ec);
+        check(piece_used <= piece, "decoder used more than it was given");
+        check(piece_used == piece || ec || decoder.is_done(), "decoder stopped early");
+        used += piece_used;
+    }
+
+    check(!ec == !whole_ec, "split and whole decode differ in error");
+    check(decoder.is_done() == whole.is_done(), "split and whole decode differ in end");
+    check(used == whole_used, "split and whole decode used different sizes");
+    check(to_string(body) == to_string(whole_body), "split and whole bodies differ");
+}
+
+}
+
+// The first two bytes seed the split points and bound the piece size, the
+// rest is the message
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size)
+{
+    if (size < 2)
+        return 0;
+
+    Splitter splitter(data[0] * 2654435761u, 1 + data[1]);
+    std::string input(reinterpret_cast<const char*>(data) + 2, size - 2);
+
+    std::size_t head_size = 0;
+    if (fuzz_head(input, splitter, head_size) == ResponseHeadParser::Result::complete)
+        fuzz_chunked(input.data() + head_size, input.size() - head_size, splitter);
+    else
+        fuzz_chunked(input.data(), input.size(), splitter);
+    return 0;
+}
+
+#if defined(PARSER_FUZZ_DRIVER)
+
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+// Runs the inputs in the files given, then inputs built from fragments of
+// messages and random bytes
+int main(int argc, char* argv[])
+{
+    unsigned long runs = 100000;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 6, "-runs=") == 0) {
+            runs = std::strtoul(arg.c_str() + 6, nullptr, 10);
+            continue;
+        }
+
+        std::ifstream file(arg, std::ios::binary);
+        std::ostringstream content;
+        content << file.rdbuf();
+        std::string input = content.str();
+        LLVMFuzzerTestOneInput(reinterpret_cast<const std::uint8_t*>(input.data()), input.size());
+    }
+
+    static const char* const fragments[] = {
+        "HTTP/1.1 200 OK\r\n", "HTTP/1.0 404 \r\n", "HTTP/1.1 999\r\n", "HTTP/2 200\r\n",
+        "Content-Length: 5\r\n", "Content-Length: 5, 5\r\n",
+        "content-length: 18446744073709551616\r\n", "Transfer-Encoding: chunked\r\n",
+        "Set-Cookie: a=b; Path=/\r\n", "X-A:\t v \t\r\n", "X-B: a\rb\r\n", ": empty\r\n",
+        "Bad Name: x\r\n", "\r\n", "\r", "\n", "\r\n\r\n",
+        "5\r\nhello\r\n", "0\r\n\r\n", "a;ext=1\r\n0123456789\r\n", "0\r\nTrailer: x\r\n\r\n",
+        "ffffffffffffffffff\r\n", "1\r\nx\n", " ", ":", "\t", "0", "f"
+    };
+    const std::size_t num_fragments = sizeof(fragments) / sizeof(fragments[0]);
+
+    std::mt19937 random(20261014);
+    for (unsigned long run = 0; run < runs; ++run) {
+        std::string input;
+        input += static_cast<char>(random());
+        input += static_cast<char>(random());
+        if (random() % 4 != 0)
+            input += fragments[random() % 4]; // mostly a status line first
+        std::size_t parts = 1 + random() % 24;
+        for (std::size_t part = 0; part < parts; ++part) {
+            if (random() % 8 == 0)
+                input += static_cast<char>(random());
+            else
+                input += fragments[random() % num_fragments];
+        }
+        LLVMFuzzerTestOneInput(reinterpret_cast<const std::uint8_t*>(input.data()), input.size());
+    }
+
+    std::cout << "parser_fuzz: " << runs << " generated inputs passed\n";
+    return 0;
+}
+
+#endif // PARSER_FUZZ_DRIVER
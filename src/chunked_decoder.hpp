@@ -0,0 +1,185 @@
+/*
+Incremental decoder for the chunked transfer coding.
+*/
+
+#ifndef CHUNKED_DECODER_HPP
+#define CHUNKED_DECODER_HPP
+
+#include "http_errors.hpp"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+
+// --------------------------------------------------------------------------------
+// ChunkedDecoder class: Incrementally decodes a body sent with the chunked 
+// transfer coding. Data can be fed in arbitrary pieces as it arrives from the
+// socket; decoding stops at the end of the message.
+// --------------------------------------------------------------------------------
+
+class ChunkedDecoder
+{
+public:
+    ChunkedDecoder() {
+        reset();
+    }
+
+    void reset() {
+        m_state = State::chunk_size;
+        m_chunk_remaining = 0;
+        m_has_size_digit = false;
+        m_line_empty = true;
+    }
+
+    bool is_done() const {
+        return m_state == State::done;
+    }
+
+    // Decodes up to size bytes, appending chunk data to body. Returns the number
+    // of bytes consumed, which is less than size only if the end of the message
+    // was reached. Sets ec if the data is not valid chunked encoding.
+    std::size_t decode(const char* data, std::size_t size, boost::asio::streambuf& body,
+        boost::system::error_code& ec) 
+    {
+        std::size_t pos = 0;
+
+        while (pos < size && m_state != State::done) 
+        {
+            char c = data[pos];
+
+            switch (m_state)
+            {
+            case State::chunk_size:
+                if (hex_value(c) >= 0) {
+                    if (m_chunk_remaining > (std::numeric_limits<std::size_t>::max() >> 4)) {
+                        ec = http_errors::invalid_response; // chunk size overflow
+                        return pos;
+                    }
+                    m_chunk_remaining = (m_chunk_remaining << 4) | hex_value(c);
+                    m_has_size_digit = true;
+                }
+                else if (!m_has_size_digit) {
+                    ec = http_errors::invalid_response;
+                    return pos;
+                }
+                else if (c == '\r') 
+                    m_state = State::chunk_size_lf;
+                else if (c == ';' || c == ' ' || c == '\t') 
+                    m_state = State::chunk_extension;
+                else {
+                    ec = http_errors::invalid_response;
+                    return pos;
+                }
+                ++pos;
+                break;
+
+            case State::chunk_extension:
+                // Chunk extensions are ignored
+                if (c == '\r') 
+                    m_state = State::chunk_size_lf;
+                ++pos;
+                break;
+
+            case State::chunk_size_lf:
+                if (c != '\n') {
+                    ec = http_errors::invalid_response;
+                    return pos;
+                }
+                ++pos;
+                m_line_empty = true;
+                m_state = (m_chunk_remaining == 0) ? State::trailer : State::chunk_data;
+                break;
+
+            case State::chunk_data: {
+                // Copy as much of the chunk as is available in one go
+                std::size_t n = std::min(m_chunk_remaining, size - pos);
+                boost::asio::buffer_copy(body.prepare(n), boost::asio::buffer(data + pos, n));
+                body.commit(n);
+                pos += n;
+                m_chunk_remaining -= n;
+                if (m_chunk_remaining == 0) 
+                    m_state = State::chunk_data_cr;
+                break;
+            }
+
+            case State::chunk_data_cr:
+            case State::chunk_data_lf:
+                if (c != (m_state == State::chunk_data_cr ? '\r' : '\n')) {
+                    ec = http_errors::invalid_response;
+                    return pos;
+                }
+                ++pos;
+                if (m_state == State::chunk_data_cr) {
+                    m_state = State::chunk_data_lf;
+                }
+                else {
+                    m_state = State::chunk_size;
+                    m_has_size_digit = false;
+                }
+                break;
+
+            case State::trailer:
+                // Trailer fields are skipped; the message ends at an empty line.
+                if (c == '\r') {
+                    m_state = State::trailer_lf;
+                }
+                else {
+                    m_line_empty = false;
+                }
+                ++pos;
+                break;
+
+            case State::trailer_lf:
+                if (c != '\n') {
+                    ec = http_errors::invalid_response;
+                    return pos;
+                }
+                ++pos;
+                if (m_line_empty) {
+                    m_state = State::done;
+                }
+                else {
+                    m_line_empty = true;
+                    m_state = State::trailer;
+                }
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        return pos;
+    }
+
+private:
+    enum class State 
+    {
+        chunk_size,
+        chunk_extension,
+        chunk_size_lf,
+        chunk_data,
+        chunk_data_cr,
+        chunk_data_lf,
+        trailer,
+        trailer_lf,
+        done
+    };
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+private:
+    State m_state;
+    std::size_t m_chunk_remaining;      // bytes left in the current chunk
+    bool m_has_size_digit;              // chunk size line has at least one digit
+    bool m_line_empty;                  // current trailer line has no fields
+};
+
+#endif // CHUNKED_DECODER_HPP
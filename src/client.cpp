@@ -19,485 +19,5360 @@ HTML Client for sending GET requests to a server.
 #endif
 #endif
 
+// Optional io_uring event loop, on Linux with Boost 1.78 or later. Define 
+// HTTP_WITH_IO_URING and link with -luring. Asio then queues the socket 
+// operations of each I/O thread on a ring, submitted together, instead of 
+// waiting for readiness on epoll and reading with a syscall per operation.
+#if defined(HTTP_WITH_IO_URING)
+#include <boost/version.hpp>
+#if !BOOST_OS_LINUX || BOOST_VERSION < 107800
+#error "HTTP_WITH_IO_URING needs Linux and Boost 1.78 or later"
+#endif
+#define BOOST_ASIO_HAS_IO_URING
+#define BOOST_ASIO_DISABLE_EPOLL
+#endif
+
+#include <utility> // before Asio, its awaitable.hpp uses std::exchange
 #include <boost/asio.hpp>
+#include <boost/utility/string_view.hpp>
+#if defined(HTTP_WITH_OPENSSL)
+#include <boost/asio/ssl.hpp>
+#endif
 #include <thread>
 #include <mutex>
 #include <memory>
 #include <iostream>
 #include <sstream>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <cstring>
+#include <cctype>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+#include <iomanip>
+#include <cstdlib>
+#include <new>
+
+#if BOOST_OS_LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "http_errors.hpp"
+#include "http_parser.hpp"
+#include "header_table.hpp"
+#include "chunked_decoder.hpp"
+#include "content_decoder.hpp"
+#include "file_sink.hpp"
+#include "request_scheduler.hpp"
+#include "retry_policy.hpp"
+#include "socket_options.hpp"
+#include "response_cache.hpp"
+#include "handler_alloc.hpp"
+#include "histogram.hpp"
+#include "timer_wheel.hpp"
+
+// HTTP/2 is negotiated with ALPN, so it needs TLS
+#if defined(HTTP_WITH_NGHTTP2)
+#if !defined(HTTP_WITH_OPENSSL)
+#error "HTTP_WITH_NGHTTP2 requires HTTP_WITH_OPENSSL"
+#endif
+#include "http2_session.hpp"
+#endif
 
 using namespace boost;
 
 // --------------------------------------------------------------------------------
-// Application error code definitions and registration with Boost
+// The callback type declarations
 // --------------------------------------------------------------------------------
 
-namespace http_errors
-{   
-    // Define error code integers for our custom error category.
-    enum http_error_codes
-    {
-        invalid_response = 1 // when client cannot parse response from server
-    };
+// Forward delcare HTTP classes.
+class HTTPClient;
+class HTTPRequest;
+class HTTPResponse;
+class RequestBatch;
+class RequestPool;
+
+// Invoked when the request completes. A function pointer, or a callable that 
+// carries state such as a lambda.
+typedef std::function<void(const HTTPRequest& request, 
+    const HTTPResponse& response, const system::error_code& ec)> Callback;
+
+// Receives the response body piece by piece as it arrives. The data is only 
+// valid during the call. Returning false pauses reading until resume().
+typedef std::function<bool(const HTTPRequest& request, 
+    const HTTPResponse& response, boost::string_view data)> DataCallback;
+
+// Invoked once all requests of a batch have finished
+typedef std::function<void(const RequestBatch& batch)> BatchCallback;
+
+// --------------------------------------------------------------------------------
+// HTTPResponse class: Represents a HTTP response message sent to the client as a
+// response to the request.
+// --------------------------------------------------------------------------------
+
+class HTTPResponse 
+{
+    friend class HTTPRequest;
+    
+    // Private constructor - only HTTPRequest can invokes it 
+    HTTPResponse() : m_status_code(0), m_response_stream(&m_response_buf)
+    {}
+
+public:
+    unsigned int get_status_code() const {
+        return m_status_code;
+    }
+
+    const std::string& get_status_message() const {
+        return m_status_message;
+    }
 
-    // Define custom error_category
-    class http_errors_category : public boost::system::error_category
+    const HeaderTable& get_headers() const {
+        return m_shared ? m_shared->headers : m_headers;
+    }
+
+    const std::istream& get_response() const {
+        return m_response_stream;
+    }
+
+private: // exposed only to HTTPRequest class 
+    // Reads a body held elsewhere in place. It is never written through.
+    class SharedBodyBuf : public std::streambuf
     {
     public:
-        // Must override pure virtual functions name() and message()
-        const char* name() const BOOST_SYSTEM_NOEXCEPT {
-            return "http_errors";
-        }
-
-        // Compare the error code integer and output a valid message
-        std::string message(int e) const {
-            switch (e) {
-            case invalid_response:
-                return "Server response cannot be parsed.";
-                break;
-            default:
-                return "Unknown error.";
-                break;
-            }
+        void set(const std::string& body) {
+            char* data = const_cast<char*>(body.data());
+            setg(data, data, data + body.size());
         }
     };
 
-    // Utility function that instantiates a single static error category and
-    // returns it as reference. 
-    const boost::system::error_category& get_http_errors_category() {
-        static http_errors_category cat;
-        return cat;
+    asio::streambuf& get_response_buf() {
+        return m_response_buf;
+    }
+
+    void set_status_code(unsigned int status_code) {
+        m_status_code = status_code;
     }
 
-    // Overload the global make_error_code() free function to support
-    // creating error_code objects based on our enum and category.
-    boost::system::error_code make_error_code(http_error_codes e) {
-        return boost::system::error_code(
-            static_cast<int>(e), get_http_errors_category());
+    void set_status_message(boost::string_view status_message) {
+        m_status_message.assign(status_message.data(), status_message.size());
     }
-}
 
-// Register our error codes enum with the Boost error code system.
-namespace boost
+    // Prepares a recycled response for the next request, keeping the memory
+    // of its buffers.
+    void reset() {
+        m_status_code = 0;
+        m_status_message.clear();
+        m_headers.clear();
+        m_response_buf.consume(m_response_buf.size());
+        m_shared.reset();
+        m_response_stream.rdbuf(&m_response_buf);
+    }
+
+    void add_header(boost::string_view name, boost::string_view value) {
+        m_headers.add(name, value);
+    }
+
+    // Copies the response of another request, into the buffers of this one
+    void assign(const HTTPResponse& other)
+    {
+        if (other.m_shared) {
+            share(other.m_shared);
+            return;
+        }
+
+        m_status_code = other.m_status_code;
+        m_status_message = other.m_status_message;
+        m_headers = other.m_headers;
+        m_response_buf.consume(m_response_buf.size());
+        std::size_t size = other.m_response_buf.size();
+        m_response_buf.commit(asio::buffer_copy(m_response_buf.prepare(size), 
+            other.m_response_buf.data()));
+        m_response_stream.clear();
+    }
+
+    // Refers to a response of the cache, or of the request this one waited 
+    // for. Its headers and body are read where they are, not copied.
+    void share(std::shared_ptr<const CachedResponse> shared)
+    {
+        m_status_code = shared->status_code;
+        m_status_message = shared->status_message;
+        m_headers.clear();
+        m_response_buf.consume(m_response_buf.size());
+        m_shared = std::move(shared);
+        m_shared_buf.set(m_shared->body);
+        m_response_stream.rdbuf(&m_shared_buf);
+    }
+
+    // Copies the response received into one that can be shared, and reads it 
+    // from there from now on. The body is copied once, however many share it.
+    std::shared_ptr<const CachedResponse> make_shared()
+    {
+        if (!m_shared) {
+            std::shared_ptr<CachedResponse> shared = std::make_shared<CachedResponse>();
+            store(*shared);
+            share(std::move(shared));
+        }
+        return m_shared;
+    }
+
+    void store(CachedResponse& cached) const
+    {
+        cached.status_code = m_status_code;
+        cached.status_message = m_status_message;
+        cached.headers = m_headers;
+        cached.body.assign(asio::buffers_begin(m_response_buf.data()), 
+            asio::buffers_end(m_response_buf.data()));
+
+        boost::string_view validator;
+        if (m_headers.find(KnownHeader::etag, validator))
+            cached.etag.assign(validator.data(), validator.size());
+        if (m_headers.find(KnownHeader::last_modified, validator))
+            cached.last_modified.assign(validator.data(), validator.size());
+    }
+
+private:
+    unsigned int m_status_code;         // HTTP status code
+    std::string m_status_message;       // HTTP status message
+
+    // Response headers
+    HeaderTable m_headers;
+    asio::streambuf m_response_buf;     // Will contain response data from server 
+    std::istream m_response_stream;     // For extracting data in response buffer
+
+    // A shared response, read in place of the above
+    std::shared_ptr<const CachedResponse> m_shared;
+    SharedBodyBuf m_shared_buf;
+};
+
+// --------------------------------------------------------------------------------
+// Connection: A socket to a server and the bytes received on it that have not 
+// been consumed yet. With pipelining several requests share one connection;
+// their messages are written in order and their responses read in the same 
+// order, so the request at the front of in_flight is the one reading. A secure
+// connection reads and writes through a TLS stream layered on the socket. On a
+// HTTP/2 connection the requests in flight are streams, answered in any order;
+// the connection reads for all of them.
+// --------------------------------------------------------------------------------
+
+struct Connection
 {
-    namespace system 
+    Connection(asio::io_service& ios, const std::string& key) :
+        sock(ios),
+        key(key),
+        is_connected(false),
+        is_writing(false),
+        is_closing(false),
+        is_closed(false)
+#if defined(HTTP_WITH_NGHTTP2)
+        , is_h2_offered(false),
+        is_flush_scheduled(false)
+#endif
+    {}
+
+    // Reads and writes, through TLS on a secure connection
+    template <typename MutableBuffers, typename Handler>
+    void async_read_some(const MutableBuffers& buffers, Handler&& handler) 
     {
-        template<>
-        struct is_error_code_enum <http_errors::http_error_codes> {
-            BOOST_STATIC_CONSTANT(bool, value = true);
-        };
+#if defined(HTTP_WITH_OPENSSL)
+        if (tls) {
+            tls->async_read_some(buffers, std::forward<Handler>(handler));
+            return;
+        }
+#endif
+        sock.async_read_some(buffers, std::forward<Handler>(handler));
     }
-}
+
+    template <typename CompletionCondition, typename Handler>
+    void async_read(asio::streambuf& buffer, CompletionCondition condition, Handler&& handler) 
+    {
+#if defined(HTTP_WITH_OPENSSL)
+        if (tls) {
+            asio::async_read(*tls, buffer, condition, std::forward<Handler>(handler));
+            return;
+        }
+#endif
+        asio::async_read(sock, buffer, condition, std::forward<Handler>(handler));
+    }
+
+    template <typename ConstBuffers, typename Handler>
+    void async_write(const ConstBuffers& buffers, Handler&& handler) 
+    {
+#if defined(HTTP_WITH_OPENSSL)
+        if (tls) {
+            asio::async_write(*tls, buffers, std::forward<Handler>(handler));
+            return;
+        }
+#endif
+        asio::async_write(sock, buffers, std::forward<Handler>(handler));
+    }
+
+    void close() 
+    {
+#if defined(HTTP_WITH_OPENSSL)
+        // No close_notify is sent, as is common for HTTP clients. OpenSSL 
+        // would then take the session as broken and not resume it.
+        if (tls)
+            SSL_set_shutdown(tls->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+#endif
+        boost::system::error_code ignored_ec;
+        sock.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+        sock.close(ignored_ec);
+    }
+
+    asio::ip::tcp::socket sock;
+#if defined(HTTP_WITH_OPENSSL)
+    // Declared after the socket it uses, so destroyed before it
+    std::unique_ptr<asio::ssl::stream<asio::ip::tcp::socket&>> tls;
+#endif
+    asio::streambuf recv_buf;               // received but not yet consumed
+    std::string key;                        // host:port, see ConnectionPool::make_key
+
+    bool is_connected;
+    bool is_writing;                        // a request message is being written
+    bool is_closing;                        // close after the current response
+    bool is_closed;
+
+    // Vectors rather than deques: they hold at most the pipeline depth and 
+    // keep their capacity, so queueing a request never allocates.
+    std::vector<HTTPRequest*> in_flight;    // requests in the order they are sent
+    std::vector<HTTPRequest*> write_queue;  // requests still to be written
+    std::chrono::steady_clock::time_point idle_since;
+    SocketOptions socket_options;           // the socket is set up with
+
+    HandlerMemory write_handler_memory;     // for the write in progress
+
+#if defined(HTTP_WITH_NGHTTP2)
+    bool is_h2_offered;                     // ALPN offers h2, requests may join until it is settled
+    std::unique_ptr<Http2Session> h2;       // once negotiated, for the streams
+    bool is_flush_scheduled;                // frames are written by a posted handler
+    HandlerMemory read_handler_memory;      // for the reads of the streams
+    HandlerMemory flush_handler_memory;
+#endif
+};
+
+// --------------------------------------------------------------------------------
+// ConnectionPool class: Keeps idle persistent HTTP/1.1 connections keyed by 
+// host:port so that subsequent requests to the same server can skip the resolve
+// and connect steps of the chain and reuse an established TCP connection. With
+// a pipeline depth above one it also hands out connections that are in use, 
+// until that many requests are in flight on them. A HTTP/2 connection is handed
+// out while the server allows another stream, and is never idle in the pool: it
+// stays shared until it has been unused for the idle timeout.
+// --------------------------------------------------------------------------------
+
+class ConnectionPool
+{
+    static const std::size_t DEFAULT_MAX_IDLE_PER_HOST = 8;
+    static const unsigned int DEFAULT_IDLE_TIMEOUT_SEC = 30;
+#if defined(HTTP_WITH_NGHTTP2)
+    static const std::size_t MAX_PENDING_STREAMS = 100;    // joining before ALPN, RFC 9113 section 6.5.2
+#endif
+
+public:
+    ConnectionPool(asio::io_service& ios) :
+        m_max_idle_per_host(DEFAULT_MAX_IDLE_PER_HOST),
+        m_idle_timeout(std::chrono::seconds(DEFAULT_IDLE_TIMEOUT_SEC)),
+        m_pipeline_depth(1),
+        m_is_closed(false),
+        m_ios(ios),
+        m_sweep_timer(ios)
+    {
+        schedule_sweep();
+    }
+
+    // Maximum number of idle connections kept for a single host:port.
+    void set_max_idle_per_host(std::size_t max_idle) {
+        std::lock_guard<std::mutex> lock(m_mux);
+        m_max_idle_per_host = max_idle;
+    }
+
+    // Idle connections older than this are closed instead of reused.
+    void set_idle_timeout(std::chrono::steady_clock::duration idle_timeout) {
+        std::lock_guard<std::mutex> lock(m_mux);
+        m_idle_timeout = idle_timeout;
+    }
+
+    // Maximum number of requests in flight on one connection. One disables
+    // pipelining.
+    void set_pipeline_depth(std::size_t depth) {
+        std::lock_guard<std::mutex> lock(m_mux);
+        m_pipeline_depth = std::max<std::size_t>(1, depth);
+    }
+
+    // How the sockets of new connections are set up, unless a request has
+    // options of its own
+    void set_socket_options(const SocketOptions& options) {
+        std::lock_guard<std::mutex> lock(m_mux);
+        m_socket_options = options;
+    }
+
+    // Identifies the connections to a server, secure ones apart from plain
+    static void make_key(const std::string& host, unsigned int port, std::string& key,
+        bool is_secure = false) 
+    {
+        key.assign(host);
+        key += ':';
+        key += std::to_string(port);
+        if (is_secure)
+            key += "/tls";
+    }
+
+    // Returns a connection to host:port that can take another request: a 
+    // pipelined or HTTP/2 connection with room, or an idle, still usable 
+    // connection. Returns null if a new connection must be made.
+    std::shared_ptr<Connection> acquire(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+
+        auto active = m_active.find(key);
+        if (active != m_active.end()) {
+            std::size_t max_pending = get_max_pending_streams(active->second);
+            for (auto& conn : active->second)
+                if (has_room(*conn, max_pending))
+                    return conn;
+        }
+
+        auto it = m_idle.find(key);
+        if (it == m_idle.end()) 
+            return nullptr;
+
+        std::deque<std::shared_ptr<Connection>>& idle = it->second;
+        auto now = std::chrono::steady_clock::now();
+
+        // Take the most recently used connection first, it is the least likely
+        // to have been closed by the server.
+        while (!idle.empty())
+        {
+            std::shared_ptr<Connection> conn = std::move(idle.back());
+            idle.pop_back();
+
+            if (now - conn->idle_since < m_idle_timeout && is_alive(conn->sock)) {
+                if (m_pipeline_depth > 1)
+                    m_active[key].push_back(conn);
+                return conn;
+            }
+
+            conn->close();
+        }
+
+        m_idle.erase(it);
+        return nullptr;
+    }
+
+    // Creates a connection that still has to be established. When pipelining,
+    // or when it may be multiplexed with HTTP/2, other requests may join it
+    // while it connects.
+    std::shared_ptr<Connection> create(const std::string& key, bool is_multiplexed = false)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        std::shared_ptr<Connection> conn(new Connection(m_ios, key));
+        conn->socket_options = m_socket_options;
+#if defined(HTTP_WITH_NGHTTP2)
+        conn->is_h2_offered = is_multiplexed;
+#else
+        (void)is_multiplexed;
+#endif
+
+        if (m_pipeline_depth > 1 || is_multiplexed)
+            m_active[conn->key].push_back(conn);
+        return conn;
+    }
+
+#if defined(HTTP_WITH_NGHTTP2)
+    // The server of a connection that offered h2 chose HTTP/1.1. Returns the
+    // number of requests that may stay on it, the pipeline depth.
+    std::size_t end_multiplexing(const std::shared_ptr<Connection>& conn)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        conn->is_h2_offered = false;
+        if (m_pipeline_depth == 1)
+            remove_active(conn);
+        return m_pipeline_depth;
+    }
+#endif
+
+    // Gives a connection back once no requests are in flight on it.
+    void release(const std::shared_ptr<Connection>& conn)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        remove_active(conn);
+
+        std::deque<std::shared_ptr<Connection>>& idle = m_idle[conn->key];
+
+        // Unread data means the connection is out of step with the protocol
+        if (m_is_closed || idle.size() >= m_max_idle_per_host || conn->recv_buf.size() > 0) {
+            conn->close();
+            return;
+        }
+
+        conn->idle_since = std::chrono::steady_clock::now();
+        idle.push_back(conn);
+    }
+
+    // Forgets a connection that is being closed.
+    void remove(const std::shared_ptr<Connection>& conn)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        remove_active(conn);
+    }
+
+    // Closes all idle connections and stops the sweep timer. Must be invoked
+    // from the I/O thread.
+    void close() 
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        m_is_closed = true;
+        m_sweep_timer.cancel();
+
+        for (auto& host : m_idle)
+            for (auto& conn : host.second)
+                conn->close();
+
+        m_idle.clear();
+
+#if defined(HTTP_WITH_NGHTTP2)
+        // HTTP/2 connections in use close after their last stream
+        for (auto& host : m_active) {
+            for (auto& conn : host.second) {
+                if (!conn->h2) continue;
+                conn->is_closing = true;
+                if (conn->in_flight.empty())
+                    conn->close();
+            }
+        }
+#endif
+    }
+
+private:
+    bool has_room(const Connection& conn, std::size_t max_pending) const
+    {
+        if (conn.is_closing || conn.is_closed)
+            return false;
+#if defined(HTTP_WITH_NGHTTP2)
+        if (conn.h2)
+            return conn.h2->has_room(conn.in_flight.size());
+
+        // Until ALPN settles it, the requests are to be streams
+        if (conn.is_h2_offered && !conn.is_connected)
+            return conn.in_flight.size() < max_pending;
+#else
+        (void)max_pending;
+#endif
+        return m_pipeline_depth > 1 && conn.in_flight.size() < m_pipeline_depth;
+    }
+
+    // How many requests may join a connection that is still connecting. A
+    // server that already limits the streams of another connection would
+    // refuse those over its limit.
+    static std::size_t get_max_pending_streams(const std::vector<std::shared_ptr<Connection>>& active)
+    {
+#if defined(HTTP_WITH_NGHTTP2)
+        std::size_t max_pending = MAX_PENDING_STREAMS;
+        for (auto& conn : active)
+            if (conn->h2)
+                max_pending = std::min(max_pending, conn->h2->get_max_streams());
+        return max_pending;
+#else
+        (void)active;
+        return 0;
+#endif
+    }
+
+    void remove_active(const std::shared_ptr<Connection>& conn)
+    {
+        auto it = m_active.find(conn->key);
+        if (it == m_active.end())
+            return;
+
+        std::vector<std::shared_ptr<Connection>>& active = it->second;
+        active.erase(std::remove(active.begin(), active.end(), conn), active.end());
+        if (active.empty())
+            m_active.erase(it);
+    }
+
+    // A pooled connection is stale if the server has closed it (read returns
+    // eof) or sent unsolicited data. A live idle socket has nothing to read.
+    static bool is_alive(asio::ip::tcp::socket& sock) 
+    {
+        boost::system::error_code ec;
+        char c;
+
+        sock.non_blocking(true, ec);
+        if (ec) return false;
+
+        sock.receive(asio::buffer(&c, 1), asio::socket_base::message_peek, ec);
+        bool alive = (ec == asio::error::would_block);
+
+        sock.non_blocking(false, ec);
+        return alive && !ec;
+    }
+
+    // Periodically closes connections that exceeded the idle timeout so they
+    // do not hold server resources while nobody is using them.
+    void schedule_sweep() 
+    {
+        m_sweep_timer.expires_from_now(m_idle_timeout);
+        m_sweep_timer.async_wait([this](const boost::system::error_code& ec) {
+            if (ec == asio::error::operation_aborted) return;
+            purge_expired();
+            schedule_sweep();
+        });
+    }
+
+    void purge_expired() 
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        auto now = std::chrono::steady_clock::now();
+
+        for (auto it = m_idle.begin(); it != m_idle.end(); ) 
+        {
+            std::deque<std::shared_ptr<Connection>>& idle = it->second;
+
+            // Connections are ordered oldest first.
+            while (!idle.empty() && now - idle.front()->idle_since >= m_idle_timeout) {
+                idle.front()->close();
+                idle.pop_front();
+            }
+
+            if (idle.empty()) 
+                it = m_idle.erase(it);
+            else 
+                ++it;
+        }
+
+#if defined(HTTP_WITH_NGHTTP2)
+        // Its reads fail once closed, and it leaves the pool then
+        for (auto& host : m_active) {
+            for (auto& conn : host.second) {
+                if (conn->h2 && conn->in_flight.empty() && !conn->is_closing
+                    && now - conn->idle_since >= m_idle_timeout) {
+                    conn->is_closing = true;
+                    conn->close();
+                }
+            }
+        }
+#endif
+    }
+
+private:
+    std::size_t m_max_idle_per_host;
+    std::chrono::steady_clock::duration m_idle_timeout;
+    std::size_t m_pipeline_depth;
+    SocketOptions m_socket_options;
+    bool m_is_closed;
+
+    // Idle connections, and connections in use that accept pipelined requests
+    std::map<std::string, std::deque<std::shared_ptr<Connection>>> m_idle;
+    std::map<std::string, std::vector<std::shared_ptr<Connection>>> m_active;
+    std::mutex m_mux;
+    asio::io_service& m_ios;
+    asio::steady_timer m_sweep_timer;   // triggers idle timeout sweeps
+};
+
+const unsigned int ConnectionPool::DEFAULT_IDLE_TIMEOUT_SEC;
+#if defined(HTTP_WITH_NGHTTP2)
+const std::size_t ConnectionPool::MAX_PENDING_STREAMS;
+#endif
 
 // --------------------------------------------------------------------------------
-// The callback function pointer type declaration
+// DNSCache class: Resolver results shared by all requests of a HTTPClient, keyed 
+// by host:port and kept for a configurable time to live. Concurrent lookups of 
+// the same name are coalesced into one, and entries that are used close to their
+// expiry are refreshed in the background so requests do not wait for DNS. It 
+// also remembers the endpoints that recently failed to connect, which are then
+// tried last. At most a configurable number of hosts is kept: a new host evicts 
+// those that have expired, or the one closest to expiry.
 // --------------------------------------------------------------------------------
 
-// Forward delcare HTTP classes.
-class HTTPClient;
-class HTTPRequest;
-class HTTPResponse;
+class DNSCache
+{
+    static const unsigned int DEFAULT_TTL_SEC = 60;
+    static const unsigned int FAILURE_PENALTY_SEC = 30;
+    static const std::size_t DEFAULT_MAX_ENTRIES = 4096;
+
+public:
+    typedef asio::ip::tcp::resolver::results_type Results;
+    typedef std::function<void(const boost::system::error_code&, const Results&)> Handler;
+
+    DNSCache() : 
+        m_ttl(std::chrono::seconds(DEFAULT_TTL_SEC)),
+        m_max_entries(DEFAULT_MAX_ENTRIES)
+    {}
+
+    void set_ttl(std::chrono::steady_clock::duration ttl) {
+        std::lock_guard<std::mutex> lock(m_mux);
+        m_ttl = ttl;
+    }
+
+    // Hosts kept at most, a lookup in flight is never evicted
+    void set_max_entries(std::size_t max_entries) {
+        std::lock_guard<std::mutex> lock(m_mux);
+        m_max_entries = std::max<std::size_t>(max_entries, 1);
+    }
+
+    std::size_t get_size() const {
+        std::lock_guard<std::mutex> lock(m_mux);
+        return m_entries.size();
+    }
+
+    // Resolves host:port and invokes the handler on ios. A cached result is 
+    // posted immediately, otherwise the handler waits for the lookup, which is 
+    // started on ios unless one for the same name is in flight already.
+    void resolve(asio::io_service& ios, const std::string& host, unsigned int port,
+        Handler handler)
+    {
+        std::string key = host + ":" + std::to_string(port);
+        auto now = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(m_mux);
+        Entry& entry = find_or_insert(key, now);
+
+        if (!entry.results.empty() && now < entry.expires) 
+        {
+            // Refresh ahead of expiry, once the entry has lived three quarters 
+            // of its time to live.
+            bool refresh = !entry.is_resolving && now >= entry.refresh_at;
+            if (refresh)
+                entry.is_resolving = true;
+
+            Results results = entry.results;
+            lock.unlock();
+
+            if (refresh)
+                start_lookup(ios, host, port, key);
+
+            ios.post([handler, results]() {
+                handler(boost::system::error_code(), results);
+            });
+            return;
+        }
+
+        entry.waiters.push_back(Waiter{ &ios, std::move(handler) });
+        if (entry.is_resolving)
+            return; // join the lookup in flight
+
+        entry.is_resolving = true;
+        lock.unlock();
+
+        start_lookup(ios, host, port, key);
+    }
+
+    // Orders the endpoints for connecting as RFC 8305 recommends, alternating
+    // between IPv6 and IPv4 starting with IPv6, and keeping the resolver's 
+    // order within each family. Endpoints that failed recently go last.
+    void order_endpoints(const std::string& host, unsigned int port, const Results& results,
+        std::vector<asio::ip::tcp::endpoint>& ordered)
+    {
+        std::vector<asio::ip::tcp::endpoint> v6, v4, failed_v6, failed_v4;
+        {
+            std::string key = host + ":" + std::to_string(port);
+            auto now = std::chrono::steady_clock::now();
+
+            std::lock_guard<std::mutex> lock(m_mux);
+            auto it = m_entries.find(key);
+            for (const auto& result : results) {
+                const asio::ip::tcp::endpoint& endpoint = result.endpoint();
+                bool is_failed = it != m_entries.end() && it->second.is_failed(endpoint, now);
+                bool is_v6 = endpoint.address().is_v6();
+                (is_failed ? (is_v6 ? failed_v6 : failed_v4) : (is_v6 ? v6 : v4))
+                    .push_back(endpoint);
+            }
+        }
+
+        ordered.clear();
+        interleave(v6, v4, ordered);
+        interleave(failed_v6, failed_v4, ordered);
+    }
+
+    // Remembers a failed connection attempt, or forgets it once connecting 
+    // succeeded.
+    void report_connect(const std::string& host, unsigned int port, 
+        const asio::ip::tcp::endpoint& endpoint, bool is_success)
+    {
+        std::string key = host + ":" + std::to_string(port);
+        auto now = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(m_mux);
+        if (is_success && m_entries.find(key) == m_entries.end())
+            return;
+
+        std::vector<Failure>& failures = find_or_insert(key, now).failures;
+        failures.erase(std::remove_if(failures.begin(), failures.end(), 
+            [&](const Failure& failure) { 
+                return failure.endpoint == endpoint || failure.until <= now; 
+            }), failures.end());
+
+        if (!is_success)
+            failures.push_back(Failure{ endpoint, now + std::chrono::seconds(FAILURE_PENALTY_SEC) });
+    }
+
+private:
+    struct Failure 
+    {
+        asio::ip::tcp::endpoint endpoint;
+        std::chrono::steady_clock::time_point until;    // tried last until then
+    };
+
+    struct Waiter 
+    {
+        asio::io_service* ios;      // where the handler must run
+        Handler handler;
+    };
+
+    struct Entry 
+    {
+        Entry() : is_resolving(false) 
+        {}
+
+        Results results;
+        std::chrono::steady_clock::time_point refresh_at;
+        std::chrono::steady_clock::time_point expires;
+        bool is_resolving;              // a lookup is in flight
+        std::vector<Waiter> waiters;    // requests waiting for the lookup
+        std::vector<Failure> failures;  // kept across refreshes
+
+        bool is_failed(const asio::ip::tcp::endpoint& endpoint,
+            std::chrono::steady_clock::time_point now) const 
+        {
+            for (const Failure& failure : failures)
+                if (failure.endpoint == endpoint && now < failure.until)
+                    return true;
+            return false;
+        }
+
+        // Holds nothing that is still of use
+        bool is_stale(std::chrono::steady_clock::time_point now) const
+        {
+            if (now < expires)
+                return false;
+            for (const Failure& failure : failures)
+                if (now < failure.until)
+                    return false;
+            return true;
+        }
+    };
+
+    // The entry of the key, made room for if it is new. m_mux must be held.
+    Entry& find_or_insert(const std::string& key, std::chrono::steady_clock::time_point now)
+    {
+        auto it = m_entries.find(key);
+        if (it != m_entries.end())
+            return it->second;
+
+        if (m_entries.size() >= m_max_entries)
+            evict(now);
+        return m_entries[key];
+    }
+
+    // Drops the stale entries, then those closest to expiry while still full
+    void evict(std::chrono::steady_clock::time_point now)
+    {
+        for (auto it = m_entries.begin(); it != m_entries.end();) {
+            if (is_evictable(it->second) && it->second.is_stale(now))
+                it = m_entries.erase(it);
+            else
+                ++it;
+        }
+
+        while (m_entries.size() >= m_max_entries) {
+            auto oldest = m_entries.end();
+            for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+                if (is_evictable(it->second) && 
+                    (oldest == m_entries.end() || it->second.expires < oldest->second.expires))
+                    oldest = it;
+            if (oldest == m_entries.end())
+                break; // every entry has a lookup in flight
+            m_entries.erase(oldest);
+        }
+    }
+
+    static bool is_evictable(const Entry& entry) {
+        return !entry.is_resolving && entry.waiters.empty();
+    }
+
+    static void interleave(const std::vector<asio::ip::tcp::endpoint>& first,
+        const std::vector<asio::ip::tcp::endpoint>& second,
+        std::vector<asio::ip::tcp::endpoint>& out)
+    {
+        for (std::size_t i = 0; i < std::max(first.size(), second.size()); ++i) {
+            if (i < first.size())
+                out.push_back(first[i]);
+            if (i < second.size())
+                out.push_back(second[i]);
+        }
+    }
+
+    void start_lookup(asio::io_service& ios, const std::string& host, unsigned int port,
+        const std::string& key)
+    {
+        // Prepare the resolve query
+        asio::ip::tcp::resolver::query resolver_query(
+            host, std::to_string(port),
+            asio::ip::tcp::resolver::query::numeric_service);
+
+        // The resolver lives as long as the lookup
+        std::shared_ptr<asio::ip::tcp::resolver> resolver(new asio::ip::tcp::resolver(ios));
+        resolver->async_resolve(resolver_query,
+            [this, resolver, key](const boost::system::error_code& ec, Results results) {
+                on_lookup_complete(key, ec, results);
+            });
+    }
+
+    void on_lookup_complete(const std::string& key, const boost::system::error_code& ec,
+        const Results& results)
+    {
+        std::vector<Waiter> waiters;
+        auto now = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(m_mux);
+        Entry& entry = m_entries[key];
+        entry.is_resolving = false;
+
+        // A failed refresh keeps the old results until they expire
+        if (!ec) {
+            entry.results = results;
+            entry.refresh_at = now + m_ttl * 3 / 4;
+            entry.expires = now + m_ttl;
+        }
+
+        waiters.swap(entry.waiters);
+        lock.unlock();
+
+        for (Waiter& waiter : waiters) {
+            Handler handler = std::move(waiter.handler);
+            waiter.ios->post([handler, ec, results]() {
+                handler(ec, results);
+            });
+        }
+    }
+
+private:
+    std::chrono::steady_clock::duration m_ttl;
+    std::size_t m_max_entries;
+    std::map<std::string, Entry> m_entries;
+    mutable std::mutex m_mux;
+};
+
+const unsigned int DNSCache::DEFAULT_TTL_SEC;
+const unsigned int DNSCache::FAILURE_PENALTY_SEC;
+const std::size_t DNSCache::DEFAULT_MAX_ENTRIES;
+
+// --------------------------------------------------------------------------------
+// ConnectRace class: Connects to the first of several endpoints to answer, as in
+// Happy Eyeballs (RFC 8305). Attempts start one after another, each a fixed delay
+// after the one before or as soon as it fails, and run in parallel. The first to
+// connect wins and the others are closed, so an unreachable address costs at most
+// the delay rather than the kernel's connect timeout. Runs on one I/O thread.
+// --------------------------------------------------------------------------------
+
+class ConnectRace : public std::enable_shared_from_this<ConnectRace>
+{
+public:
+    // Invoked with the connected socket, or the last error once all failed.
+    // Every failed endpoint is reported to on_failed first.
+    typedef std::function<void(const boost::system::error_code& ec, 
+        asio::ip::tcp::socket& sock, const asio::ip::tcp::endpoint& endpoint)> Handler;
+    typedef std::function<void(const asio::ip::tcp::endpoint& endpoint)> FailedHandler;
+
+    ConnectRace(asio::io_service& ios, std::vector<asio::ip::tcp::endpoint> endpoints,
+        std::chrono::steady_clock::duration attempt_delay, const SocketOptions& options) :
+        m_ios(ios),
+        m_endpoints(std::move(endpoints)),
+        m_attempt_delay(attempt_delay),
+        m_options(options),
+        m_next(0),
+        m_running(0),
+        m_is_finished(false),
+        m_timer(ios)
+    {
+        m_sockets.reserve(m_endpoints.size());
+    }
+
+    void start(Handler handler, FailedHandler on_failed)
+    {
+        m_handler = std::move(handler);
+        m_on_failed = std::move(on_failed);
+
+        if (m_endpoints.empty()) {
+            asio::ip::tcp::socket none(m_ios);
+            finish(asio::error::host_not_found, none, asio::ip::tcp::endpoint());
+            return;
+        }
+        start_attempt();
+    }
+
+    // Stops all attempts, the handler is invoked with operation_aborted
+    void cancel()
+    {
+        if (m_is_finished) return;
+
+        asio::ip::tcp::socket none(m_ios);
+        finish(asio::error::operation_aborted, none, asio::ip::tcp::endpoint());
+    }
+
+private:
+    void start_attempt()
+    {
+        std::size_t index = m_next++;
+        m_sockets.emplace_back(new asio::ip::tcp::socket(m_ios));
+        ++m_running;
+
+        // Opened here so that the options that go into the SYN can be set.
+        // Failing to open fails the attempt in async_connect.
+        boost::system::error_code ignored_ec;
+        m_sockets[index]->open(m_endpoints[index].protocol(), ignored_ec);
+        if (m_sockets[index]->is_open())
+            m_options.apply_unconnected(*m_sockets[index]);
+
+        std::shared_ptr<ConnectRace> self = shared_from_this();
+        m_sockets[index]->async_connect(m_endpoints[index],
+            [self, index](const boost::system::error_code& ec) {
+                self->on_attempt_done(index, ec);
+            });
+
+        if (m_next == m_endpoints.size()) return;
+
+        // The next attempt starts if this one has not connected in time
+        m_timer.expires_from_now(m_attempt_delay);
+        m_timer.async_wait([self, index](const boost::system::error_code& ec) {
+            if (ec || self->m_is_finished || self->m_next != index + 1) return;
+            self->start_attempt();
+        });
+    }
+
+    void on_attempt_done(std::size_t index, const boost::system::error_code& ec)
+    {
+        --m_running;
+        if (m_is_finished) return;
+
+        if (!ec) {
+            m_options.apply_connected(*m_sockets[index]);
+            finish(ec, *m_sockets[index], m_endpoints[index]);
+            return;
+        }
+
+        m_sockets[index]->close();
+        m_on_failed(m_endpoints[index]);
+
+        if (m_next < m_endpoints.size()) {
+            m_timer.cancel(); // no need to wait for the delay
+            start_attempt();
+        }
+        else if (m_running == 0) {
+            finish(ec, *m_sockets[index], m_endpoints[index]);
+        }
+    }
+
+    void finish(const boost::system::error_code& ec, asio::ip::tcp::socket& sock,
+        const asio::ip::tcp::endpoint& endpoint)
+    {
+        m_is_finished = true;
+        m_timer.cancel();
+
+        // The losers' handlers see operation_aborted
+        boost::system::error_code ignored_ec;
+        for (auto& other : m_sockets)
+            if (other.get() != &sock)
+                other->close(ignored_ec);
+
+        Handler handler = std::move(m_handler);
+        m_on_failed = nullptr;
+        handler(ec, sock, endpoint);
+    }
+
+private:
+    asio::io_service& m_ios;
+    std::vector<asio::ip::tcp::endpoint> m_endpoints;   // in the order tried
+    std::chrono::steady_clock::duration m_attempt_delay;
+    SocketOptions m_options;
+    std::vector<std::unique_ptr<asio::ip::tcp::socket>> m_sockets;  // one per attempt started
+    std::size_t m_next;                 // index of the next endpoint to try
+    std::size_t m_running;              // attempts in progress
+    bool m_is_finished;
+    asio::steady_timer m_timer;         // delays the next attempt
+    Handler m_handler;
+    FailedHandler m_on_failed;
+};
+
+// --------------------------------------------------------------------------------
+// TLSContext class: The ssl::context shared by the secure connections of a 
+// HTTPClient, and the last TLS session of each server, keyed by host:port. A 
+// new connection offers the server's session, so that the server can resume it
+// with an abbreviated handshake rather than a full one. OpenSSL hands over each
+// session, or TLS 1.3 ticket, as the server issues it. ALPN offers HTTP/1.1, and
+// with HTTP_WITH_NGHTTP2 also h2 to the servers it is enabled for, until one 
+// chooses HTTP/1.1. Without HTTP_WITH_OPENSSL the class is empty and secure 
+// requests fail with operation_not_supported.
+// --------------------------------------------------------------------------------
+
+class TLSContext
+{
+#if defined(HTTP_WITH_OPENSSL)
+public:
+    typedef asio::ssl::stream<asio::ip::tcp::socket&> Stream;
+
+    TLSContext() : 
+        m_context(asio::ssl::context::tls_client)
+#if defined(HTTP_WITH_NGHTTP2)
+        , m_has_http2(false)
+#endif
+    {
+        // Servers are verified against the system's trusted certificates
+        boost::system::error_code ignored_ec;
+        m_context.set_default_verify_paths(ignored_ec);
+        m_context.set_verify_mode(asio::ssl::verify_peer);
+        m_context.set_options(asio::ssl::context::default_workarounds 
+            | asio::ssl::context::no_sslv2 | asio::ssl::context::no_sslv3
+            | asio::ssl::context::no_tlsv1 | asio::ssl::context::no_tlsv1_1);
+
+        SSL_CTX* ctx = m_context.native_handle();
+        SSL_CTX_set_ex_data(ctx, get_self_index(), this);
+
+        // Sessions are kept here rather than in OpenSSL's internal cache, 
+        // which a client cannot look up by server.
+        SSL_CTX_set_session_cache_mode(ctx, 
+            SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, &TLSContext::on_new_session);
+
+        static const unsigned char alpn[] = "\x08http/1.1";
+        SSL_CTX_set_alpn_protos(ctx, alpn, sizeof(alpn) - 1);
+    }
+
+    ~TLSContext() {
+        for (auto& session : m_sessions)
+            SSL_SESSION_free(session.second);
+    }
+
+    TLSContext(const TLSContext&) = delete;
+    TLSContext& operator=(const TLSContext&) = delete;
+
+    // For loading trusted certificates or client certificates. Settings must
+    // not change once requests are being made.
+    asio::ssl::context& get_context() { return m_context; }
+
+    // Layers TLS on the connection, to be handshaken with host. The session 
+    // cached for the connection's server is offered for resumption.
+    void attach(Connection& conn, const std::string& host)
+    {
+        conn.tls.reset(new Stream(conn.sock, m_context));
+        SSL* ssl = conn.tls->native_handle();
+        SSL_set_ex_data(ssl, get_key_index(), &conn.key);
+
+        // Server Name Indication, and the certificate must be for the host
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+        conn.tls->set_verify_callback(asio::ssl::host_name_verification(host));
+
+#if defined(HTTP_WITH_NGHTTP2)
+        if (conn.is_h2_offered) {
+            static const unsigned char alpn[] = "\x02h2\x08http/1.1";
+            SSL_set_alpn_protos(ssl, alpn, sizeof(alpn) - 1);
+        }
+#endif
+
+        std::lock_guard<std::mutex> lock(m_mux);
+        auto it = m_sessions.find(conn.key);
+        if (it != m_sessions.end())
+            SSL_set_session(ssl, it->second);
+    }
+
+#if defined(HTTP_WITH_NGHTTP2)
+    // Offers h2 to the server of key, or stops offering it
+    void set_http2(const std::string& key, bool is_enabled)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        if (is_enabled)
+            m_http2_servers[key] = true;
+        else
+            m_http2_servers.erase(key);
+        m_has_http2.store(!m_http2_servers.empty(), std::memory_order_release);
+    }
+
+    // Whether new connections to the server of key offer h2. Until it is 
+    // enabled for a server this does not take the lock.
+    bool is_http2_offered(const std::string& key) const
+    {
+        if (!m_has_http2.load(std::memory_order_acquire)) return false;
+
+        std::lock_guard<std::mutex> lock(m_mux);
+        auto it = m_http2_servers.find(key);
+        return it != m_http2_servers.end() && it->second;
+    }
+
+    // The server chose HTTP/1.1, so requests no longer wait for its new 
+    // connections to settle ALPN
+    void decline_http2(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        auto it = m_http2_servers.find(key);
+        if (it != m_http2_servers.end())
+            it->second = false;
+    }
+#endif
+
+    // Drops the session of a server, once a handshake offering it failed
+    void forget_session(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        auto it = m_sessions.find(key);
+        if (it == m_sessions.end()) return;
+
+        SSL_SESSION_free(it->second);
+        m_sessions.erase(it);
+    }
+
+private:
+    // Asio keeps its verify callbacks in the app data of a SSL_CTX and a SSL,
+    // so this context and the key of a connection's server have indexes of
+    // their own.
+    static int get_self_index() {
+        static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    static int get_key_index() {
+        static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    // Invoked by OpenSSL when a server issues a session. Replaces the cached 
+    // one, which connections using it hold references to. Returning 1 takes 
+    // over the reference.
+    static int on_new_session(SSL* ssl, SSL_SESSION* session)
+    {
+        TLSContext* self = static_cast<TLSContext*>(
+            SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), get_self_index()));
+        const std::string* key = static_cast<const std::string*>(
+            SSL_get_ex_data(ssl, get_key_index()));
+        if (key == nullptr) return 0;
+
+        std::lock_guard<std::mutex> lock(self->m_mux);
+        SSL_SESSION*& cached = self->m_sessions[*key];
+        if (cached)
+            SSL_SESSION_free(cached);
+        cached = session;
+        return 1;
+    }
+
+private:
+    asio::ssl::context m_context;
+    std::map<std::string, SSL_SESSION*> m_sessions;
+#if defined(HTTP_WITH_NGHTTP2)
+    std::map<std::string, bool> m_http2_servers;    // false once one chose HTTP/1.1
+    std::atomic<bool> m_has_http2;
+#endif
+    mutable std::mutex m_mux;
+#endif
+};
+
+// --------------------------------------------------------------------------------
+// RequestTemplate class: The part of the request message that is the same for 
+// every request to one endpoint. The Host header and any fixed headers are 
+// rendered once; requests made from the template send the rendered block as is.
+// --------------------------------------------------------------------------------
+
+class RequestTemplate
+{
+public:
+    RequestTemplate(const std::string& host, unsigned int port = 80) :
+        m_host(host),
+        m_port(port)
+    {
+        m_headers.assign("Host: ");
+        m_headers += host;
+        m_headers += "\r\n";
+    }
+
+    // Adds a header sent with every request made from the template
+    void add_header(boost::string_view name, boost::string_view value) {
+        m_headers.append(name.data(), name.size());
+        m_headers += ": ";
+        m_headers.append(value.data(), value.size());
+        m_headers += "\r\n";
+    }
+
+    const std::string& get_host() const { return m_host; }
+    unsigned int get_port() const { return m_port; }
+
+    // The rendered header lines, each ending with CRLF
+    const std::string& get_headers() const { return m_headers; }
+
+private:
+    std::string m_host;
+    unsigned int m_port;
+    std::string m_headers;
+};
+
+// --------------------------------------------------------------------------------
+// ClientMetrics class: Counts the requests of one I/O thread, by outcome and 
+// status class, and keeps a latency histogram of each phase. Only that thread 
+// records, so nothing is locked or allocated per request and the counters are 
+// bumped without a locked instruction. Any thread may read them. HTTPClient 
+// adds up the metrics of its threads when exporting in the Prometheus text 
+// format.
+// --------------------------------------------------------------------------------
+
+class ClientMetrics
+{
+public:
+    enum Phase 
+    { 
+        queue,              // waiting to be admitted by the scheduler
+        resolve,            // host name lookup
+        connect,            // TCP handshake
+        tls,                // TLS handshake
+        send,               // until the request message is written
+        wait,               // request written to first response byte
+        head,               // status line and headers
+        body,               // response body
+        total,              // execute() to callback
+        PHASE_COUNT 
+    };
+
+    enum Outcome { success, failure, cancelled, OUTCOME_COUNT };
+
+    // Requests that could be answered from the response cache
+    enum CacheResult { cache_hit, cache_revalidated, cache_miss, CACHE_RESULT_COUNT };
+
+    static const unsigned int STATUS_CLASS_COUNT = 5;     // 1xx to 5xx
+    static const std::uint64_t MIN_RECENT_WAITS = 20;     // before hedging delays are known
+
+    ClientMetrics() : m_connections_opened(0), m_retries(0), m_coalesced(0)
+    {
+        for (auto& count : m_outcomes)
+            count.store(0, std::memory_order_relaxed);
+        for (auto& count : m_status_classes)
+            count.store(0, std::memory_order_relaxed);
+        for (auto& count : m_tls_handshakes)
+            count.store(0, std::memory_order_relaxed);
+        for (auto& count : m_hedges)
+            count.store(0, std::memory_order_relaxed);
+        for (auto& count : m_cache_results)
+            count.store(0, std::memory_order_relaxed);
+    }
+
+    ClientMetrics(const ClientMetrics&) = delete;
+    ClientMetrics& operator=(const ClientMetrics&) = delete;
+
+    void record_phase(Phase phase, std::chrono::steady_clock::duration duration) 
+    {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+        std::uint64_t value = us > 0 ? static_cast<std::uint64_t>(us) : 0;
+        m_phases[phase].record(value);
+        if (phase == wait)
+            m_recent_waits.record(value);
+    }
+
+    void record_outcome(Outcome outcome) {
+        increment(m_outcomes[outcome]);
+    }
+
+    void record_status(unsigned int status_code) {
+        if (status_code >= 100 && status_code < 600)
+            increment(m_status_classes[status_code / 100 - 1]);
+    }
+
+    void record_connection_opened() {
+        increment(m_connections_opened);
+    }
+
+    void record_tls_handshake(bool is_resumed) {
+        increment(m_tls_handshakes[is_resumed ? 1 : 0]);
+    }
+
+    void record_retry() {
+        increment(m_retries);
+    }
+
+    void record_hedge(bool is_won) {
+        increment(m_hedges[is_won ? 1 : 0]);
+    }
+
+    void record_cache_result(CacheResult result) {
+        increment(m_cache_results[result]);
+    }
+
+    void record_coalesced() {
+        increment(m_coalesced);
+    }
+
+    // The given percentile of the latest waits for a first byte. False while 
+    // too few have been recorded for it to mean much. Only for the owning 
+    // thread.
+    bool get_recent_wait(double percentile, std::chrono::steady_clock::duration& wait)
+    {
+        if (m_recent_waits.get_count() < MIN_RECENT_WAITS)
+            return false;
+        wait = std::chrono::microseconds(m_recent_waits.value_at_percentile(percentile));
+        return true;
+    }
+
+    // Writes the sum of the metrics in the Prometheus text exposition format.
+    // Histogram bucket bounds are exact to the histogram resolution, 0.1%.
+    static void write_prometheus(std::ostream& os, 
+        const std::vector<const ClientMetrics*>& metrics)
+    {
+        static const char* const outcome_names[OUTCOME_COUNT] = { 
+            "success", "failure", "cancelled" 
+        };
+        static const char* const phase_names[PHASE_COUNT] = { 
+            "queue", "resolve", "connect", "tls", "send", "wait", "head", "body", "total" 
+        };
+        static const char* const cache_result_names[CACHE_RESULT_COUNT] = { 
+            "hit", "revalidated", "miss" 
+        };
+        static const struct { std::uint64_t us; const char* label; } buckets[] = {
+            { 100, "0.0001" }, { 250, "0.00025" }, { 500, "0.0005" }, 
+            { 1000, "0.001" }, { 2500, "0.0025" }, { 5000, "0.005" },
+            { 10000, "0.01" }, { 25000, "0.025" }, { 50000, "0.05" },
+            { 100000, "0.1" }, { 250000, "0.25" }, { 500000, "0.5" },
+            { 1000000, "1" }, { 2500000, "2.5" }, { 5000000, "5" }, 
+            { 10000000, "10" }
+        };
+
+        os << "# HELP http_client_requests_total Requests finished, by outcome.\n"
+            "# TYPE http_client_requests_total counter\n";
+        for (unsigned int i = 0; i < OUTCOME_COUNT; ++i) {
+            os << "http_client_requests_total{outcome=\"" << outcome_names[i] << "\"} "
+                << sum(metrics, [i](const ClientMetrics& m) { return load(m.m_outcomes[i]); })
+                << '\n';
+        }
+
+        os << "# HELP http_client_responses_total Responses received, by status class.\n"
+            "# TYPE http_client_responses_total counter\n";
+        for (unsigned int i = 0; i < STATUS_CLASS_COUNT; ++i) {
+            os << "http_client_responses_total{code=\"" << i + 1 << "xx\"} "
+                << sum(metrics, [i](const ClientMetrics& m) { return load(m.m_status_classes[i]); })
+                << '\n';
+        }
+
+        os << "# HELP http_client_connections_opened_total Connections established.\n"
+            "# TYPE http_client_connections_opened_total counter\n"
+            "http_client_connections_opened_total "
+            << sum(metrics, [](const ClientMetrics& m) { return load(m.m_connections_opened); })
+            << '\n';
+
+        os << "# HELP http_client_retries_total Requests issued again after a failure.\n"
+            "# TYPE http_client_retries_total counter\n"
+            "http_client_retries_total "
+            << sum(metrics, [](const ClientMetrics& m) { return load(m.m_retries); })
+            << '\n';
+
+        os << "# HELP http_client_hedges_total Duplicate requests sent for slow responses, by "
+            "whether their response was used.\n"
+            "# TYPE http_client_hedges_total counter\n";
+        for (unsigned int i = 0; i < 2; ++i) {
+            os << "http_client_hedges_total{won=\"" << (i ? "true" : "false") << "\"} "
+                << sum(metrics, [i](const ClientMetrics& m) { return load(m.m_hedges[i]); })
+                << '\n';
+        }
+
+        os << "# HELP http_client_cache_requests_total Requests the response cache could "
+            "answer, by whether it did, after revalidation, or not.\n"
+            "# TYPE http_client_cache_requests_total counter\n";
+        for (unsigned int i = 0; i < CACHE_RESULT_COUNT; ++i) {
+            os << "http_client_cache_requests_total{result=\"" << cache_result_names[i] << "\"} "
+                << sum(metrics, [i](const ClientMetrics& m) { return load(m.m_cache_results[i]); })
+                << '\n';
+        }
+
+        os << "# HELP http_client_coalesced_requests_total Requests that waited for an "
+            "identical one in flight instead of being sent.\n"
+            "# TYPE http_client_coalesced_requests_total counter\n"
+            "http_client_coalesced_requests_total "
+            << sum(metrics, [](const ClientMetrics& m) { return load(m.m_coalesced); })
+            << '\n';
+
+        os << "# HELP http_client_tls_handshakes_total TLS handshakes completed, by "
+            "whether a session was resumed.\n"
+            "# TYPE http_client_tls_handshakes_total counter\n";
+        for (unsigned int i = 0; i < 2; ++i) {
+            os << "http_client_tls_handshakes_total{resumed=\"" << (i ? "true" : "false") 
+                << "\"} " 
+                << sum(metrics, [i](const ClientMetrics& m) { return load(m.m_tls_handshakes[i]); })
+                << '\n';
+        }
+
+        os << "# HELP http_client_request_phase_seconds Time spent in each phase of "
+            "a request.\n"
+            "# TYPE http_client_request_phase_seconds histogram\n";
+        for (unsigned int i = 0; i < PHASE_COUNT; ++i) {
+            for (const auto& bucket : buckets) {
+                os << "http_client_request_phase_seconds_bucket{phase=\"" << phase_names[i]
+                    << "\",le=\"" << bucket.label << "\"} " 
+                    << sum(metrics, [i, &bucket](const ClientMetrics& m) { 
+                        return m.m_phases[i].count_at_or_below(bucket.us); 
+                    })
+                    << '\n';
+            }
+
+            // The count is taken from the buckets as well, so that it is not 
+            // below the last bucket when requests finish meanwhile.
+            std::uint64_t count = sum(metrics, [i](const ClientMetrics& m) {
+                return m.m_phases[i].count_at_or_below(std::numeric_limits<std::uint64_t>::max());
+            });
+            std::uint64_t sum_us = sum(metrics, [i](const ClientMetrics& m) { 
+                return m.m_phases[i].get_sum(); 
+            });
+
+            os << "http_client_request_phase_seconds_bucket{phase=\"" << phase_names[i]
+                << "\",le=\"+Inf\"} " << count << '\n'
+                << "http_client_request_phase_seconds_sum{phase=\"" << phase_names[i]
+                << "\"} " << sum_us / 1000000 << '.' << std::setw(6) << std::setfill('0') 
+                << sum_us % 1000000 << std::setfill(' ') << '\n'
+                << "http_client_request_phase_seconds_count{phase=\"" << phase_names[i]
+                << "\"} " << count << '\n';
+        }
+    }
+
+private:
+    // Single writer, so a plain load and store is enough
+    static void increment(std::atomic<std::uint64_t>& count) {
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static std::uint64_t load(const std::atomic<std::uint64_t>& count) {
+        return count.load(std::memory_order_relaxed);
+    }
+
+    template <typename Get>
+    static std::uint64_t sum(const std::vector<const ClientMetrics*>& metrics, Get get) {
+        std::uint64_t total = 0;
+        for (const ClientMetrics* m : metrics)
+            total += get(*m);
+        return total;
+    }
+
+private:
+    std::atomic<std::uint64_t> m_outcomes[OUTCOME_COUNT];
+    std::atomic<std::uint64_t> m_status_classes[STATUS_CLASS_COUNT];
+    std::atomic<std::uint64_t> m_connections_opened;
+    std::atomic<std::uint64_t> m_tls_handshakes[2];     // full, resumed
+    std::atomic<std::uint64_t> m_retries;
+    std::atomic<std::uint64_t> m_hedges[2];             // lost, won
+    std::atomic<std::uint64_t> m_cache_results[CACHE_RESULT_COUNT];
+    std::atomic<std::uint64_t> m_coalesced;
+    LatencyHistogram m_phases[PHASE_COUNT];
+    LatencyWindow m_recent_waits;                       // for the hedging delays
+};
+
+// --------------------------------------------------------------------------------
+// RequestDeadlines class: The deadlines of the requests of one I/O thread. They 
+// are kept in a TimerWheel with millisecond ticks, driven by a single steady_timer
+// that sleeps until the wheel's next occupied tick. Many requests in flight thus
+// cost one timer, and setting or clearing a deadline does not touch the timer 
+// heap. Must only be used on the thread's I/O thread.
+// --------------------------------------------------------------------------------
+
+class RequestDeadlines
+{
+public:
+    typedef std::chrono::milliseconds Tick;
+
+    explicit RequestDeadlines(asio::io_service& ios) :
+        m_timer(ios),
+        m_epoch(std::chrono::steady_clock::now()),
+        m_is_armed(false),
+        m_armed_tick(0),
+        m_is_closed(false)
+    {}
+
+    // Expires the entry at the deadline, or within one tick after it
+    void schedule(TimerWheel::Entry& entry, std::chrono::steady_clock::time_point deadline)
+    {
+        // Rounded up, so that entries never expire early
+        std::chrono::steady_clock::duration since_epoch = deadline - m_epoch;
+        std::uint64_t tick = since_epoch.count() > 0 
+            ? static_cast<std::uint64_t>((since_epoch + Tick(1) - std::chrono::nanoseconds(1)) / Tick(1))
+            : 0;
+
+        m_wheel.schedule(entry, tick);
+        arm();
+    }
+
+    // The timer is left running, it stops once the wheel is empty.
+    void cancel(TimerWheel::Entry& entry) {
+        m_wheel.cancel(entry);
+    }
+
+    void close() {
+        m_is_closed = true;
+        m_timer.cancel();
+    }
+
+private:
+    // Sleeps until the next tick the wheel has to process, unless the timer 
+    // is set for an earlier one already.
+    void arm()
+    {
+        if (m_wheel.is_empty() || m_is_closed) return;
+
+        std::uint64_t tick = m_wheel.get_next_tick();
+        if (m_is_armed && m_armed_tick <= tick) return;
+
+        m_is_armed = true;
+        m_armed_tick = tick;
+        m_timer.expires_at(m_epoch + Tick(tick));
+        m_timer.async_wait([this](const boost::system::error_code& ec) {
+            if (ec == asio::error::operation_aborted) return; // set again
+            on_tick();
+        });
+    }
+
+    void on_tick()
+    {
+        m_is_armed = false;
+
+        std::chrono::steady_clock::duration since_epoch = 
+            std::chrono::steady_clock::now() - m_epoch;
+        m_wheel.advance(static_cast<std::uint64_t>(since_epoch / Tick(1)));
+        arm();
+    }
+
+private:
+    TimerWheel m_wheel;
+    asio::steady_timer m_timer;
+    std::chrono::steady_clock::time_point m_epoch;  // time of tick 0
+    bool m_is_armed;
+    std::uint64_t m_armed_tick;         // the tick the timer is set for
+    bool m_is_closed;
+};
+
+// --------------------------------------------------------------------------------
+// RequestCoalescer class: The GET requests of a HTTPClient in flight, keyed by 
+// everything that makes up their message. A request identical to one in flight
+// is not sent; it waits for that request, the leader, and shares its response.
+// The flight lands when the leader finishes, handing over the requests that 
+// waited to be completed on their own I/O threads. Shared by the I/O threads.
+// Disabled by default.
+// --------------------------------------------------------------------------------
+
+class RequestCoalescer
+{
+public:
+    typedef std::vector<std::shared_ptr<HTTPRequest>> Followers;
+
+    RequestCoalescer() : m_is_enabled(false)
+    {}
+
+    RequestCoalescer(const RequestCoalescer&) = delete;
+    RequestCoalescer& operator=(const RequestCoalescer&) = delete;
+
+    void set_enabled(bool is_enabled) {
+        m_is_enabled.store(is_enabled, std::memory_order_relaxed);
+    }
+
+    bool is_enabled() const { return m_is_enabled.load(std::memory_order_relaxed); }
+
+    // Adds the request to the flight of the key if there is one, and returns
+    // true. Otherwise starts a flight that the request leads.
+    bool join(const std::string& key, const std::shared_ptr<HTTPRequest>& request)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        auto it = m_flights.find(key);
+        if (it == m_flights.end()) {
+            m_flights.emplace(key, Followers());
+            return false;
+        }
+        it->second.push_back(request);
+        return true;
+    }
+
+    // Takes a waiting request off the flight. False if the flight has landed
+    // and the request's completion is on its way.
+    bool leave(const std::string& key, const HTTPRequest* request)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        auto it = m_flights.find(key);
+        if (it == m_flights.end()) 
+            return false;
+
+        Followers& followers = it->second;
+        for (auto follower = followers.begin(); follower != followers.end(); ++follower) {
+            if (follower->get() == request) {
+                followers.erase(follower);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Ends the leader's flight, moving out the requests that waited for it
+    void land(const std::string& key, Followers& followers)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        auto it = m_flights.find(key);
+        if (it == m_flights.end()) return;
+
+        followers = std::move(it->second);
+        m_flights.erase(it);
+    }
+
+private:
+    std::atomic<bool> m_is_enabled;
+    std::unordered_map<std::string, Followers> m_flights;
+    std::mutex m_mux;
+};
+
+// --------------------------------------------------------------------------------
+// HTTPRequest class: Represents a HTTP GET request that constructs the HTTP
+// request message based on information provided by the class users, sends it to
+// the server, and then receives and parses the HTTP response message.
+// --------------------------------------------------------------------------------
+
+class HTTPRequest
+{
+    friend class HTTPClient;
+    friend class RequestPool;
+    friend class RequestBatch;
+
+    static const unsigned int DEFAULT_PORT = 80;
+    static const std::size_t RECV_CHUNK_SIZE = 16384;
+    static const unsigned int MAX_RESTARTS = 3;
+    static const unsigned int CONNECTION_ATTEMPT_DELAY_MS = 250;   // RFC 8305 section 5
+    static const unsigned int MAX_SPLICES_PER_WAIT = 16;           // before yielding to other requests
+    static const std::size_t DEFAULT_HIGH_WATER_MARK = 65536;
+
+    // The buffers of a request message. The write operation keeps a copy of 
+    // the sequence, so it is a fixed array rather than a vector.
+    class RequestBuffers 
+    {
+    public:
+        typedef asio::const_buffer value_type;
+        typedef const asio::const_buffer* const_iterator;
+
+        RequestBuffers() : m_count(0)
+        {}
+
+        void push_back(asio::const_buffer buffer) {
+            assert(m_count < MAX_BUFFERS);
+            m_buffers[m_count++] = buffer;
+        }
+
+        void clear() { m_count = 0; }
+
+        const_iterator begin() const { return m_buffers.data(); }
+        const_iterator end() const { return m_buffers.data() + m_count; }
+
+    private:
+        static const std::size_t MAX_BUFFERS = 10;
+
+        std::array<asio::const_buffer, MAX_BUFFERS> m_buffers;
+        std::size_t m_count;
+    };
+
+public:
+    // When each phase of the request ended. Phases that were skipped, e.g. 
+    // resolving and connecting when a pooled connection is reused, are left 
+    // at the epoch.
+    struct Timings 
+    {
+        std::chrono::steady_clock::time_point started;      // execute() called
+        std::chrono::steady_clock::time_point admitted;     // left the scheduler's queue
+        std::chrono::steady_clock::time_point resolved;     // host name resolved
+        std::chrono::steady_clock::time_point connected;    // connection established
+        std::chrono::steady_clock::time_point secured;      // TLS handshake done
+        std::chrono::steady_clock::time_point sent;         // request message written
+        std::chrono::steady_clock::time_point first_byte;   // response head started
+        std::chrono::steady_clock::time_point head_received;// status line and headers parsed
+        std::chrono::steady_clock::time_point finished;     // callback about to run
+    };
+
+private:
+    // How the end of the response body is determined
+    enum class BodyFraming 
+    {
+        no_body,            // status code implies an empty body
+        content_length,     // body is exactly Content-Length bytes
+        chunked,            // Transfer-Encoding: chunked
+        until_eof           // body ends when the server closes the connection
+    };
+
+    // Private constructor - only HTTPClient can invokes it 
+    HTTPRequest(asio::io_service& ios, unsigned int id, ConnectionPool& pool,
+        DNSCache& dns_cache, TLSContext& tls, RequestScheduler& scheduler, 
+        ResponseCache& response_cache, RequestCoalescer& coalescer, ClientMetrics& metrics, 
+        RequestDeadlines& deadlines, RetryBudget& retry_budget, RequestPool& requests) :
+        m_port(DEFAULT_PORT),
+        m_is_secure(false),
+        m_id(id),
+        m_callback(nullptr),
+        m_is_known_headers_only(false),
+        m_content_length(0),
+        m_body_framing(BodyFraming::no_body),
+        m_is_keep_alive(false),
+        m_was_cancelled(false),
+        m_is_resolving(false),
+        m_is_request_sent(false),
+        m_restarts(0),
+        m_is_conn_reused(false),
+        m_has_socket_options(false),
+        m_high_water_mark(DEFAULT_HIGH_WATER_MARK),
+        m_body_remaining(0),
+        m_is_paused(false),
+        m_is_accept_encoding(false),
+        m_is_flight_leader(false),
+        m_is_coalesced(false),
+        m_connect_timeout(std::chrono::steady_clock::duration::zero()),
+        m_first_byte_timeout(std::chrono::steady_clock::duration::zero()),
+        m_timeout(std::chrono::steady_clock::duration::zero()),
+        m_deadline_entry([this]() { on_deadline(); }),
+        m_schedule_entry([this]() { on_admitted(); }),
+        m_is_admitted(false),
+        m_retries(0),
+        m_retry_entry([this]() { start(); }),
+        m_hedge_entry([this]() { on_hedge_due(); }),
+        m_hedged(nullptr),
+        m_is_hedge(false),
+        m_is_outrun(false),
+        m_is_waiting_for_hedge(false),
+        m_is_hedge_done(false),
+#if defined(HTTP_WITH_NGHTTP2)
+        m_h2_stream_id(0),
+        m_h2_unconsumed(0),
+        m_is_h2_stream_closed(false),
+#endif
+        m_ios(ios),
+        m_pool(pool),
+        m_dns_cache(dns_cache),
+        m_tls(tls),
+        m_scheduler(scheduler),
+        m_response_cache(response_cache),
+        m_coalescer(coalescer),
+        m_metrics(metrics),
+        m_deadlines(deadlines),
+        m_retry_budget(retry_budget),
+        m_requests(requests)
+    {}
+
+    // Prepares a recycled request for reuse. The strings and buffers keep 
+    // their memory, so a recycled request seldom allocates.
+    void reset(unsigned int id) 
+    {
+        m_port = DEFAULT_PORT;
+        m_is_secure = false;
+        m_id = id;
+        m_callback = nullptr;
+        m_template.reset();
+        m_headers.clear();
+        m_request_bufs.clear();
+        m_response.reset();
+        m_head_parser.reset();
+        m_content_length = 0;
+        m_body_framing = BodyFraming::no_body;
+        m_chunked_decoder.reset();
+        m_is_keep_alive = false;
+        m_was_cancelled.store(false, std::memory_order_relaxed);
+        m_timings = Timings();
+        m_is_resolving = false;
+        m_conn.reset();
+        m_connect_race.reset();
+        m_is_request_sent = false;
+        m_restarts = 0;
+        m_data_callback = nullptr;
+        m_high_water_mark = DEFAULT_HIGH_WATER_MARK;
+        m_body_remaining = 0;
+        m_is_paused = false;
+        m_is_accept_encoding = false;
+        m_is_known_headers_only = false;
+        m_content_decoder.reset(ContentDecoder::Coding::identity);
+        m_encoded_buf.consume(m_encoded_buf.size());
+        m_body_file.clear();
+        m_cache_key.clear();
+        m_cached.reset();
+        m_conditional_headers.clear();
+        m_flight_key.clear();
+        m_is_flight_leader = false;
+        m_is_coalesced = false;
+        m_connect_timeout = std::chrono::steady_clock::duration::zero();
+        m_first_byte_timeout = std::chrono::steady_clock::duration::zero();
+        m_timeout = std::chrono::steady_clock::duration::zero();
+        m_connect_deadline = std::chrono::steady_clock::time_point();
+        m_first_byte_deadline = std::chrono::steady_clock::time_point();
+        m_timeout_error.clear();
+        m_schedule_entry.set_priority(RequestPriority::normal);
+        m_is_admitted = false;
+        m_is_conn_reused = false;
+        m_has_socket_options = false;
+        m_retry_policy = RetryPolicy();
+        m_retries = 0;
+        m_hedge_policy = HedgePolicy();
+        m_hedge.reset();
+        m_hedged = nullptr;
+        m_is_hedge = false;
+        m_is_outrun = false;
+        m_is_waiting_for_hedge = false;
+        m_is_hedge_done = false;
+        m_attempt_error.clear();
+        m_hedge_error.clear();
+        m_avoided_endpoint = asio::ip::tcp::endpoint();
+#if defined(HTTP_WITH_NGHTTP2)
+        m_h2_stream_id = 0;
+        m_h2_unconsumed = 0;
+        m_is_h2_stream_closed = false;
+#endif
+    }
+
+public:
+    // Setters
+    void set_host(const std::string& host) { m_host = host; }
+    void set_port(unsigned int port) { m_port = port; }
+    void set_uri(const std::string& uri) { m_uri = uri; }
+    void set_callback(Callback callback) { m_callback = callback; }
+
+    // Requests of a higher priority are admitted first when the client 
+    // limits the requests in flight, see HTTPClient::set_max_in_flight().
+    void set_priority(RequestPriority priority) { m_schedule_entry.set_priority(priority); }
+
+    // Sends the request over TLS (HTTPS). The port is not changed, HTTPS is 
+    // usually on 443. Needs HTTP_WITH_OPENSSL.
+    void set_secure(bool is_secure) { m_is_secure = is_secure; }
+
+    // Streams the response body to the callback instead of buffering it, the
+    // response passed to the final callback then has an empty body.
+    void set_data_callback(DataCallback data_callback) { 
+        m_data_callback = std::move(data_callback); 
+    }
+
+    // Most body bytes buffered at once while streaming
+    void set_high_water_mark(std::size_t high_water_mark) {
+        assert(high_water_mark > 0);
+        m_high_water_mark = high_water_mark;
+    }
+
+    // Writes the response body to the file at path, created or truncated
+    // once the head is received, instead of buffering it. The file is closed
+    // before the final callback, whose response then has an empty body, and 
+    // the data callback is not called. An empty path buffers the body again.
+    void set_body_file(const std::string& path) { m_body_file = path; }
+
+    // Asks for a compressed response with the codings compiled in, see 
+    // ContentDecoder. The body is decompressed as it arrives, the callbacks 
+    // see the decoded body while the headers are left as received.
+    void set_accept_encoding(bool is_accept_encoding) {
+        m_is_accept_encoding = is_accept_encoding;
+    }
+
+    // Keeps only the response headers of KnownHeader, for servers with a 
+    // fixed response schema. The others are validated but skipped as the 
+    // head is parsed, see KnownFields. Such a response is neither served 
+    // from nor stored in the cache, nor shared with identical requests.
+    void set_known_headers_only(bool is_known_headers_only) {
+        m_is_known_headers_only = is_known_headers_only;
+    }
+
+    // Deadlines, zero for none. Connecting is limited from the start of the
+    // request until a new connection is established, waiting for the 
+    // response from the request being written until its first byte, and the
+    // whole request from execute() until the callback. An expired request 
+    // finishes with connect_timeout, first_byte_timeout or request_timeout.
+    void set_connect_timeout(std::chrono::steady_clock::duration timeout) { 
+        m_connect_timeout = timeout; 
+    }
+    void set_first_byte_timeout(std::chrono::steady_clock::duration timeout) { 
+        m_first_byte_timeout = timeout; 
+    }
+    void set_timeout(std::chrono::steady_clock::duration timeout) { 
+        m_timeout = timeout; 
+    }
+
+    // Issues the request again when it fails before its response, as often 
+    // and as late as the policy says and the client's retry budget allows, 
+    // see RetryPolicy. A request whose pooled connection turns out to be 
+    // closed by the server is retried at once in any case.
+    void set_retry_policy(const RetryPolicy& policy) { m_retry_policy = policy; }
+
+    // Sends a duplicate of the request to another endpoint when its response
+    // is slower to start than most, and uses whichever response comes first,
+    // see HedgePolicy. Only for a body that is buffered, not streamed or 
+    // written to a file.
+    void set_hedge_policy(const HedgePolicy& policy) { m_hedge_policy = policy; }
+
+    // Sets up the socket of a new connection made for this request instead 
+    // of with the client's options, see SocketOptions. A pooled connection 
+    // keeps the options it was made with.
+    void set_socket_options(const SocketOptions& options) {
+        m_socket_options = options;
+        m_has_socket_options = true;
+    }
+
+    // Sends the template's headers, to the template's host and port
+    void set_template(const std::shared_ptr<const RequestTemplate>& request_template) {
+        m_template = request_template;
+        m_host = request_template->get_host();
+        m_port = request_template->get_port();
+    }
+
+    // Adds a header sent with this request only
+    void add_header(boost::string_view name, boost::string_view value) {
+        m_headers.append(name.data(), name.size());
+        m_headers += ": ";
+        m_headers.append(value.data(), value.size());
+        m_headers += "\r\n";
+    }
+
+    // Getters
+    std::string get_host() const { return m_host; }
+    unsigned int get_port() const { return m_port; }
+    bool is_secure() const { return m_is_secure; }
+    const std::string& get_uri() const { return m_uri; }
+    unsigned int get_id() const { return m_id; }
+    const Timings& get_timings() const { return m_timings; }
+    unsigned int get_retries() const { return m_retries; }
+
+    // Gathers the HTTP/1.1 request message as it would be sent and returns
+    // its size in bytes. Not while the request is in flight.
+    std::size_t gather_message() {
+        gather_request();
+        return asio::buffer_size(m_request_bufs);
+    }
+
+    // Complete once the request has finished
+    const HTTPResponse& get_response() const { return m_response; }
+
+    // Initiates an asynchronous GET request
+    void execute() 
+    {
+        prepare();
+
+        // Connections are shared by the requests of an I/O thread, so the chain
+        // starts on that thread.
+        m_ios.post(make_alloc_handler(m_handler_memory, [this]() {
+            begin();
+        }));
+    }
+
+    // Continues reading a body paused by the data callback. May be called 
+    // from any thread.
+    void resume()
+    {
+        std::shared_ptr<HTTPRequest> self = m_weak_self.lock();
+        m_ios.post([self]() {
+            if (!self->m_is_paused) return;
+            self->m_is_paused = false;
+
+            if (self->check_if_request_cancelled()) return;
+
+            // Decoded data may be left over from the pause
+            if (!self->deliver_response_body()) return;
+
+#if defined(HTTP_WITH_NGHTTP2)
+            if (self->m_conn->h2) {
+                self->resume_http2_stream();
+                return;
+            }
+#endif
+            if (self->m_body_framing == BodyFraming::chunked)
+                self->decode_chunked_body();
+            else
+                self->stream_response_body();
+        });
+    }
+
+    // Cancels the GET request, stops asynchronous callback chain. May be 
+    // called from any thread.
+    void cancel() 
+    {
+        // Handlers check the flag between steps. It is only a hint for them,
+        // the request is finished by the handler posted below.
+        m_was_cancelled.store(true, std::memory_order_release);
+
+        // The request's state and socket are not thread safe, so they are 
+        // cancelled on the I/O thread that runs this request's handlers. The 
+        // socket is therefore never cancelled while a handler is using it.
+        // The handler holds a reference, as the request may finish and be 
+        // released before it runs.
+        std::shared_ptr<HTTPRequest> self = m_weak_self.lock();
+        m_ios.post([self]() {
+            self->abort();
+        });
+    }
+
+private:
+    // Finishes the request with operation_aborted, on the I/O thread
+    void abort()
+    {
+        // Waiting for an identical request, unless its response is on the way
+        if (m_is_coalesced) {
+            if (m_coalescer.leave(m_flight_key, this)) {
+                m_is_coalesced = false;
+                m_ios.get_executor().on_work_finished();
+                on_finish(boost::system::error_code(asio::error::operation_aborted));
+            }
+            return;
+        }
+
+        // Waiting to be tried again
+        if (m_retry_entry.is_scheduled()) {
+            m_deadlines.cancel(m_retry_entry);
+            on_finish(boost::system::error_code(asio::error::operation_aborted));
+            return;
+        }
+
+        // Finished but for the hedge, which then finishes the request
+        if (m_is_waiting_for_hedge) {
+            m_hedge->cancel();
+            return;
+        }
+
+        // Waiting to be admitted, nothing of the request is outstanding
+        if (!m_is_admitted && m_scheduler.is_enabled() && m_scheduler.remove(m_schedule_entry)) {
+            m_ios.get_executor().on_work_finished();
+            on_finish(boost::system::error_code(asio::error::operation_aborted));
+            return;
+        }
+
+        // A lookup may be shared with other requests, so it is not stopped.
+        // The request stops waiting for it instead.
+        if (m_is_resolving) {
+            m_is_resolving = false;
+            on_finish(boost::system::error_code(asio::error::operation_aborted));
+            return;
+        }
+
+        if (!m_conn) return; // not started or already finished
+
+        if (m_connect_race) {
+            m_connect_race->cancel();
+            return;
+        }
+
+#if defined(HTTP_WITH_NGHTTP2)
+        // The stream is reset, the other streams of the connection carry on
+        if (m_conn->h2) {
+            m_is_paused = false;
+            on_finish(boost::system::error_code(asio::error::operation_aborted));
+            return;
+        }
+#endif
+
+        // No read is outstanding while the body is paused
+        if (m_is_paused) {
+            m_is_paused = false;
+            on_finish(boost::system::error_code(asio::error::operation_aborted));
+            return;
+        }
+
+        // Finish all outstanding asynchronous operations immediately on socket.
+        // Will pass handlers operation_abort_error error code.
+        if (m_conn->in_flight.front() == this) {
+            if (m_conn->sock.is_open()) {
+                m_conn->sock.cancel();
+            }
+            return;
+        }
+
+        // Pipelined behind other requests. The socket is still used by 
+        // them, so the request leaves the connection instead. A message 
+        // being written finishes the request when the write completes.
+        std::vector<HTTPRequest*>& write_queue = m_conn->write_queue;
+        if (m_conn->is_writing && write_queue.front() == this) return;
+
+        bool is_written = std::find(write_queue.begin(), write_queue.end(), this) 
+            == write_queue.end();
+        leave_pipeline(is_written);
+        on_finish(boost::system::error_code(asio::error::operation_aborted));
+    }
+
+    void prepare()
+    {
+        // Ensure that preconditions hold
+        assert(m_port > 0);
+        assert(m_host.length() > 0);
+        assert(m_uri.length() > 0);
+        assert(m_callback != nullptr);
+
+        m_timings.started = std::chrono::steady_clock::now();
+
+        // Kept alive until finished, the caller may release it meanwhile
+        m_self = m_weak_self.lock();
+        assert(m_self);
+    }
+
+    // The first step on the request's I/O thread: a fresh response in the
+    // client's cache completes the request at once, a stale one makes it 
+    // conditional. A request identical to one in flight waits for that one.
+    void begin()
+    {
+        // Only a buffered response with all its headers is cached or shared
+        if (m_is_hedge || m_data_callback || !m_body_file.empty() || m_is_known_headers_only) {
+            start();
+            return;
+        }
+
+        if (m_response_cache.is_enabled() && !is_private() && serve_from_cache()) return;
+        if (m_coalescer.is_enabled() && join_flight()) return;
+        start();
+    }
+
+    // The message the request sends but for its conditional headers: the
+    // host:port, URI and header lines
+    void make_message_key(std::string& key) const
+    {
+        ConnectionPool::make_key(m_host, m_port, key, m_is_secure);
+        key.append(m_uri).append("\n");
+        if (m_template)
+            key += m_template->get_headers();
+        key += m_headers;
+    }
+
+    // Whether the request sends credentials, its response is then neither
+    // served from nor stored in the cache shared by all requests
+    bool is_private() const
+    {
+        return (m_template && ResponseCache::has_credentials(m_template->get_headers()))
+            || ResponseCache::has_credentials(m_headers);
+    }
+
+    // Returns true if the request was answered from the cache
+    bool serve_from_cache()
+    {
+        make_message_key(m_cache_key);
+
+        std::chrono::steady_clock::time_point expires;
+        m_cached = m_response_cache.find(m_cache_key, expires);
+        if (m_cached && std::chrono::steady_clock::now() < expires && !is_cancelled()) {
+            m_response.share(m_cached);
+            m_metrics.record_cache_result(ClientMetrics::cache_hit);
+            m_cache_key.clear();
+            on_finish(boost::system::error_code());
+            return true;
+        }
+
+        static const char IF_NONE_MATCH[] = "If-None-Match: ";
+        static const char IF_MODIFIED_SINCE[] = "If-Modified-Since: ";
+        static const char CRLF[] = "\r\n";
+        if (m_cached && !m_cached->etag.empty())
+            m_conditional_headers.append(IF_NONE_MATCH).append(m_cached->etag).append(CRLF);
+        if (m_cached && !m_cached->last_modified.empty())
+            m_conditional_headers.append(IF_MODIFIED_SINCE).append(m_cached->last_modified)
+                .append(CRLF);
+        return false;
+    }
+
+    // Returns true if the request waits for an identical one in flight, 
+    // otherwise it leads the flight. The conditional headers are left out of
+    // the key, a leader's 304 is completed from the cache before it is shared.
+    bool join_flight()
+    {
+        if (is_cancelled()) return false;
+
+        make_message_key(m_flight_key);
+        m_flight_key += m_is_accept_encoding ? '1' : '0';
+
+        if (!m_coalescer.join(m_flight_key, m_self)) {
+            m_is_flight_leader = true;
+            return false;
+        }
+
+        // Nothing of the request is outstanding but its deadline, the I/O 
+        // thread is kept running until the leader's response is handed over
+        m_is_coalesced = true;
+        m_ios.get_executor().on_work_started();
+        m_metrics.record_coalesced();
+        if (m_timeout > std::chrono::steady_clock::duration::zero())
+            update_deadline();
+        return true;
+    }
+
+    // Hands the leader's response to the requests that waited for it, on 
+    // their own I/O threads. When the leader was cancelled or ran out of its
+    // own time, they form a new flight instead.
+    void land_flight(const boost::system::error_code& ec)
+    {
+        m_is_flight_leader = false;
+        RequestCoalescer::Followers followers;
+        m_coalescer.land(m_flight_key, followers);
+        if (followers.empty()) return;
+
+        bool is_leader_failure = ec == asio::error::operation_aborted 
+            || ec == http_errors::request_timeout;
+        std::shared_ptr<const CachedResponse> shared;
+        if (!ec)
+            shared = m_response.make_shared();
+
+        for (std::shared_ptr<HTTPRequest>& follower : followers) {
+            HTTPRequest* request = follower.get();
+            request->m_ios.post([follower, shared, ec, is_leader_failure]() {
+                follower->on_flight_landed(shared, is_leader_failure 
+                    ? boost::system::error_code() : ec, is_leader_failure);
+            });
+        }
+    }
+
+    // The response of the leader arrived, on this request's I/O thread. It 
+    // may still be retried on its own, as if it had failed itself.
+    void on_flight_landed(const std::shared_ptr<const CachedResponse>& shared,
+        boost::system::error_code ec, bool is_leader_failure)
+    {
+        m_is_coalesced = false;
+        m_ios.get_executor().on_work_finished();
+
+        if (is_leader_failure) {
+            if (!join_flight())
+                start();
+            return;
+        }
+
+        if (is_cancelled()) {
+            ec = asio::error::operation_aborted;
+        }
+        else if (!ec) {
+            m_response.share(shared);
+            m_cache_key.clear();
+        }
+        on_finish(ec);
+    }
+
+    // Serves the cached response if the server did not modify it, or stores
+    // the response received
+    void update_cache()
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        bool is_no_store = false;
+
+        if (m_response.get_status_code() == 304 && m_cached) {
+            // The 304 may give a new lifetime, otherwise the stored one holds
+            const HeaderTable& headers = m_response.get_headers().contains(KnownHeader::cache_control)
+                ? m_response.get_headers() : m_cached->headers;
+            std::chrono::steady_clock::duration lifetime = 
+                ResponseCache::get_lifetime(headers, is_no_store);
+            m_response_cache.refresh(m_cache_key, m_cached, now + lifetime);
+
+            m_response.share(m_cached);
+            m_metrics.record_cache_result(ClientMetrics::cache_revalidated);
+            return;
+        }
+
+        m_metrics.record_cache_result(ClientMetrics::cache_miss);
+
+        std::chrono::steady_clock::duration lifetime;
+        if (!ResponseCache::is_storable(m_response.get_status_code(), m_response.get_headers(), 
+            lifetime))
+            return;
+
+        m_response_cache.store(m_cache_key, m_response.make_shared(), now + lifetime);
+    }
+
+    // Must run on the request's I/O thread
+    void start()
+    {
+        // Check if request was cancelled
+        if (check_if_request_cancelled()) return;
+
+        // Reuse an idle persistent connection to the server, or join one that 
+        // pipelines requests, skipping the resolve and connect steps.
+        if (m_timeout > std::chrono::steady_clock::duration::zero())
+            update_deadline();
+
+#if !defined(HTTP_WITH_OPENSSL)
+        if (m_is_secure) {
+            on_finish(boost::system::error_code(asio::error::operation_not_supported));
+            return;
+        }
+#endif
+
+        ConnectionPool::make_key(m_host, m_port, m_conn_key, m_is_secure);
+
+        // Over the client's limits the request waits in the scheduler's queue,
+        // keeping its I/O thread running, and starts again once admitted. A 
+        // hedge is not held back, it is of use only at once.
+        if (!m_is_admitted && m_scheduler.is_enabled() && !m_is_hedge) {
+            if (!m_scheduler.admit(m_schedule_entry, m_conn_key)) {
+                m_ios.get_executor().on_work_started();
+                return;
+            }
+            m_is_admitted = true;
+        }
+
+        // A hedge makes a connection of its own, to another endpoint
+        if (!m_is_hedge)
+            m_conn = m_pool.acquire(m_conn_key);
+        if (m_conn) {
+            m_is_conn_reused = m_conn->idle_since != std::chrono::steady_clock::time_point();
+            m_conn->in_flight.push_back(this);
+            send_request();
+            return;
+        }
+        m_is_conn_reused = false;
+
+        // The message is queued now so that pipelined requests joining the 
+        // connection while it connects are written after it. Requests to a 
+        // server offered h2 join it as well, to be its streams.
+        bool is_multiplexed = false;
+#if defined(HTTP_WITH_NGHTTP2)
+        is_multiplexed = m_is_secure && m_tls.is_http2_offered(m_conn_key);
+#endif
+        m_conn = m_pool.create(m_conn_key, is_multiplexed);
+        if (m_has_socket_options)
+            m_conn->socket_options = m_socket_options;
+#if defined(HTTP_WITH_OPENSSL)
+        if (m_is_secure)
+            m_tls.attach(*m_conn, m_host);
+#endif
+        if (m_connect_timeout > std::chrono::steady_clock::duration::zero()) {
+            m_connect_deadline = std::chrono::steady_clock::now() + m_connect_timeout;
+            update_deadline();
+        }
+        m_conn->in_flight.push_back(this);
+        send_request();
+
+        // Resolve the host name (starts asynchronous callback chain). A cached
+        // result goes straight to on_host_name_resolved.
+        m_is_resolving = true;
+        // The lookup may outlive a cancelled request, so it holds a reference
+        std::shared_ptr<HTTPRequest> self = m_self;
+        m_dns_cache.resolve(m_ios, m_host, m_port, 
+            [self](const boost::system::error_code& ec, const DNSCache::Results& results) {
+                // The request may have been cancelled while waiting
+                if (!self->m_is_resolving) return;
+                self->m_is_resolving = false;
+
+                self->on_host_name_resolved(ec, results);
+            });
+    }
+
+    // Invoked by the scheduler once the queued request may start, on the 
+    // thread of the request that made room
+    void on_admitted()
+    {
+        m_ios.post(make_alloc_handler(m_handler_memory, [this]() {
+            m_ios.get_executor().on_work_finished();
+            m_is_admitted = true;
+            m_timings.admitted = std::chrono::steady_clock::now();
+            start();
+        }));
+    }
+
+    // Issues the request again on another connection. Used for pipelined 
+    // requests that did not get a response before their connection closed.
+    // GET requests are idempotent so this is safe.
+    void restart()
+    {
+        reset_attempt();
+        update_deadline();
+
+        if (++m_restarts > MAX_RESTARTS) {
+            m_ios.post([this]() {
+                on_finish(boost::system::error_code(asio::error::connection_aborted));
+            });
+            return;
+        }
+
+        m_ios.post(make_alloc_handler(m_handler_memory, [this]() {
+            start();
+        }));
+    }
+
+    // Clears what an attempt that got no response left behind, for the next.
+    // The phases start again after admission.
+    void reset_attempt()
+    {
+        m_conn.reset();
+        m_is_request_sent = false;
+#if defined(HTTP_WITH_NGHTTP2)
+        m_h2_stream_id = 0;
+        m_h2_unconsumed = 0;
+        m_is_h2_stream_closed = false;
+#endif
+
+        Timings timings;
+        timings.started = m_timings.started;
+        timings.admitted = m_timings.admitted;
+        m_timings = timings;
+        m_response.reset();
+        m_head_parser.reset();
+        m_connect_deadline = std::chrono::steady_clock::time_point();
+        m_first_byte_deadline = std::chrono::steady_clock::time_point();
+    }
+
+    void on_host_name_resolved(const boost::system::error_code& ec, 
+        const DNSCache::Results& results)
+    {
+        // Handle any error codes
+        if (check_if_error_occurred(ec)) return;
+
+        m_timings.resolved = std::chrono::steady_clock::now();
+
+        // Check if request was cancelled
+        if (check_if_request_cancelled()) return;
+
+        // Race connections to the endpoints, the cache orders them. A hedge
+        // tries the endpoint of the request it duplicates last.
+        std::vector<asio::ip::tcp::endpoint> endpoints;
+        m_dns_cache.order_endpoints(m_host, m_port, results, endpoints);
+        if (m_is_hedge) {
+            const asio::ip::tcp::endpoint avoided = m_avoided_endpoint;
+            std::stable_partition(endpoints.begin(), endpoints.end(),
+                [&avoided](const asio::ip::tcp::endpoint& endpoint) { return endpoint != avoided; });
+        }
+
+        m_connect_race = std::make_shared<ConnectRace>(m_ios, std::move(endpoints),
+            std::chrono::milliseconds(CONNECTION_ATTEMPT_DELAY_MS), m_conn->socket_options);
+        m_connect_race->start(
+            [this](const boost::system::error_code& ec, asio::ip::tcp::socket& sock,
+                const asio::ip::tcp::endpoint& endpoint) {
+                m_connect_race.reset();
+                if (!ec) {
+                    m_dns_cache.report_connect(m_host, m_port, endpoint, true);
+                    m_conn->sock = std::move(sock);
+                }
+                on_connection_established(ec);
+            },
+            [this](const asio::ip::tcp::endpoint& endpoint) {
+                m_dns_cache.report_connect(m_host, m_port, endpoint, false);
+            });
+    }
+
+    void on_connection_established(const boost::system::error_code& ec)
+    {
+        // Handle any errors
+        if (check_if_error_occurred(ec)) return;
+
+        m_timings.connected = std::chrono::steady_clock::now();
+
+#if defined(HTTP_WITH_OPENSSL)
+        if (m_conn->tls) {
+            // Check if request was cancelled
+            if (check_if_request_cancelled()) return;
+
+            m_conn->tls->async_handshake(asio::ssl::stream_base::client,
+                make_alloc_handler(m_handler_memory, [this](const boost::system::error_code& ec) {
+                    on_handshake_done(ec);
+                }));
+            return;
+        }
+#endif
+
+        on_connection_ready();
+    }
+
+#if defined(HTTP_WITH_OPENSSL)
+    void on_handshake_done(const boost::system::error_code& ec)
+    {
+        if (ec) {
+            // The session offered may be what the server rejected
+            m_tls.forget_session(m_conn_key);
+            on_finish(ec);
+            return;
+        }
+
+        m_timings.secured = std::chrono::steady_clock::now();
+        SSL* ssl = m_conn->tls->native_handle();
+        m_metrics.record_tls_handshake(SSL_session_reused(ssl) == 1);
+
+        // The server may only select a protocol that was offered, HTTP/1.1 
+        // or h2. None selected means it does not support ALPN.
+        const unsigned char* protocol = nullptr;
+        unsigned int length = 0;
+        SSL_get0_alpn_selected(ssl, &protocol, &length);
+        boost::string_view selected(reinterpret_cast<const char*>(protocol), length);
+
+#if defined(HTTP_WITH_NGHTTP2)
+        if (m_conn->is_h2_offered) {
+            if (selected == "h2") {
+                m_conn->h2.reset(new Http2Session(get_http2_callbacks()));
+                on_connection_ready();
+                return;
+            }
+            fall_back_to_http1();
+        }
+#endif
+
+        if (length > 0 && selected != "http/1.1") {
+            on_finish(http_errors::invalid_response);
+            return;
+        }
+
+        on_connection_ready();
+    }
+
+#if defined(HTTP_WITH_NGHTTP2)
+    // The server chose HTTP/1.1 over h2. The requests that joined the 
+    // connection beyond what may be pipelined go to connections of their own.
+    void fall_back_to_http1()
+    {
+        m_tls.decline_http2(m_conn_key);
+        std::size_t depth = m_pool.end_multiplexing(m_conn);
+
+        std::vector<HTTPRequest*>& in_flight = m_conn->in_flight;
+        while (in_flight.size() > depth) {
+            HTTPRequest* request = in_flight.back();
+            request->leave_pipeline(false);
+            request->restart();
+        }
+    }
+#endif
+#endif
+
+    // The connection is established, and secured if it is secure
+    void on_connection_ready()
+    {
+        if (m_connect_deadline != std::chrono::steady_clock::time_point()) {
+            m_connect_deadline = std::chrono::steady_clock::time_point();
+            update_deadline();
+        }
+
+        // Write this request and any pipelined behind it
+        m_conn->is_connected = true;
+#if defined(HTTP_WITH_NGHTTP2)
+        if (m_conn->h2) {
+            start_http2();
+            return;
+        }
+#endif
+        write_next(m_conn);
+    }
+
+    void send_request()
+    {
+#if defined(HTTP_WITH_NGHTTP2)
+        if (m_conn->h2) {
+            if (submit_http2_request())
+                schedule_http2_flush(m_conn);
+            return;
+        }
+#endif
+
+        gather_request();
+
+        // Send the request message once the messages before it are written
+        m_conn->write_queue.push_back(this);
+        write_next(m_conn);
+    }
+
+    // The request message is gathered from constant fragments and spans of
+    // the request's own strings, which live until the message is written.
+    void gather_request()
+    {
+        static const char REQUEST_METHOD[] = "GET ";
+        static const char REQUEST_VERSION[] = " HTTP/1.1\r\n";
+        static const char HOST_HEADER[] = "Host: ";
+        static const char CRLF[] = "\r\n";
+
+        m_request_bufs.clear();
+        m_request_bufs.push_back(asio::buffer(REQUEST_METHOD, sizeof(REQUEST_METHOD) - 1));
+        m_request_bufs.push_back(asio::buffer(m_uri));
+        m_request_bufs.push_back(asio::buffer(REQUEST_VERSION, sizeof(REQUEST_VERSION) - 1));
+        // Add mandatory header
+        if (m_template) {
+            m_request_bufs.push_back(asio::buffer(m_template->get_headers()));
+        } else {
+            m_request_bufs.push_back(asio::buffer(HOST_HEADER, sizeof(HOST_HEADER) - 1));
+            m_request_bufs.push_back(asio::buffer(m_host));
+            m_request_bufs.push_back(asio::buffer(CRLF, sizeof(CRLF) - 1));
+        }
+        if (!m_headers.empty())
+            m_request_bufs.push_back(asio::buffer(m_headers));
+        if (!m_conditional_headers.empty())
+            m_request_bufs.push_back(asio::buffer(m_conditional_headers));
+        boost::string_view accept_encoding = ContentDecoder::get_accept_encoding();
+        if (m_is_accept_encoding && !accept_encoding.empty())
+            m_request_bufs.push_back(asio::buffer(accept_encoding.data(), accept_encoding.size()));
+        // Add final return
+        m_request_bufs.push_back(asio::buffer(CRLF, sizeof(CRLF) - 1));
+    }
+
+    // Writes the queued request messages of a connection one after another.
+    static void write_next(const std::shared_ptr<Connection>& conn)
+    {
+        if (conn->is_writing || !conn->is_connected || conn->write_queue.empty())
+            return;
+
+        conn->is_writing = true;
+        HTTPRequest* request = conn->write_queue.front();
+
+        conn->async_write(request->m_request_bufs, 
+            make_alloc_handler(conn->write_handler_memory,
+            [conn](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                conn->is_writing = false;
+                if (conn->is_closed) return; // its requests were issued again
+
+                HTTPRequest* request = conn->write_queue.front();
+                conn->write_queue.erase(conn->write_queue.begin());
+
+                if (ec && request != conn->in_flight.front()) {
+                    // The requests behind the one being read cannot be sent.
+                    // They are issued again once the current response is read.
+                    conn->is_closing = true;
+                    return;
+                }
+
+                request->on_request_sent(ec, bytes_transferred);
+                if (!conn->is_closed)
+                    write_next(conn);
+            }));
+    }
+
+    void on_request_sent(const boost::system::error_code& ec, std::size_t bytes_transferred)
+    {
+        // Handle any errors
+        if (check_if_error_occurred(ec)) return;
+
+        // The socket is left open in both directions so that the connection
+        // can be reused once the response has been read.
+        on_request_written();
+
+        if (m_conn->in_flight.front() != this) {
+            // Pipelined, the response is read once those before it have been
+            if (is_cancelled()) {
+                leave_pipeline(true);
+                on_finish(boost::system::error_code(asio::error::operation_aborted));
+            }
+            return;
+        }
+
+        // Check if request was cancelled
+        if (check_if_request_cancelled()) return;
+
+        read_response();
+    }
+
+    // Start reading response from server, the status line and headers. Part 
+    // of a pipelined response may have been received with the previous one.
+    void read_response()
+    {
+        if (m_conn->recv_buf.size() > 0)
+            on_response_head_received(boost::system::error_code(), 0);
+        else
+            read_response_head();
+    }
+
+    // Reads from the socket until the parser has seen the complete status line
+    // and header block. According to HTTP protocol, the response headers block 
+    // ends with "\r\n\r\n" delimiter.
+    void read_response_head()
+    {
+        m_conn->async_read_some(m_conn->recv_buf.prepare(RECV_CHUNK_SIZE),
+            make_alloc_handler(m_handler_memory,
+            [this](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                on_response_head_received(ec, bytes_transferred);
+            }));
+    }
+
+    void on_response_head_received(const boost::system::error_code& ec,
+        std::size_t bytes_transferred)
+    {
+        // Handle any errors
+        if (check_if_error_occurred(ec)) return;
+
+        asio::streambuf& recv_buf = m_conn->recv_buf;
+        recv_buf.commit(bytes_transferred);
+        on_first_byte();
+
+        // Parse the status line and headers in place in the receive buffer
+        const char* data = static_cast<const char*>(recv_buf.data().data());
+        ResponseHeadParser::Result result = m_is_known_headers_only
+            ? m_head_parser.parse<KnownFields>(data, recv_buf.size())
+            : m_head_parser.parse<AllFields>(data, recv_buf.size());
+
+        if (result == ResponseHeadParser::Result::incomplete) {
+            // Check if request was cancelled
+            if (check_if_request_cancelled()) return;
+
+            read_response_head();
+            return;
+        }
+
+        if (result == ResponseHeadParser::Result::invalid 
+            || m_head_parser.get_version_minor() != 1) {
+            on_finish(http_errors::invalid_response); // response is incorrect
+            return;
+        }
+
+        // Skip interim responses, e.g. 100 Continue, the final one follows
+        unsigned int status_code = m_head_parser.get_status_code();
+        if (status_code / 100 == 1 && status_code != 101) {
+            recv_buf.consume(m_head_parser.get_head_size());
+            m_head_parser.reset();
+            read_response();
+            return;
+        }
+
+        if (check_if_hedge_lost()) return;
+        m_timings.head_received = std::chrono::steady_clock::now();
+
+        m_response.set_status_code(m_head_parser.get_status_code());
+        m_response.set_status_message(m_head_parser.get_status_message());
+
+        // Headers example:
+        // "Date: Wed, 06 May 2020 01:32:00 GMT"
+        // "Server: Apache/2.4.43 (FreeBSD) OpenSSL/1.1.1d-freebsd PHP/7.4.5"
+        // "Location: https://distrowatch.com/"
+        // "Content-Length: 208"
+        // "Content-Type: text/html; charset=iso-8859-1"
+        for (const HeaderField& field : m_head_parser.get_fields())
+            m_response.add_header(field.name, field.value);
+
+        // The head spans are no longer needed, what is left is the body.
+        recv_buf.consume(m_head_parser.get_head_size());
+        m_head_parser.reset();
+
+        // Check if request was cancelled
+        if (check_if_request_cancelled()) return;
+
+        // Work out where the response body ends.
+        if (!frame_response_body()) {
+            on_finish(http_errors::invalid_response);
+            return;
+        }
+        start_content_decoding();
+        if (!start_body_file()) return;
+
+        // Part of the body may have been read along with the headers.
+        if (m_body_framing == BodyFraming::chunked) {
+            decode_chunked_body();
+            return;
+        }
+
+        // A body stored as received skips the buffers
+        if (m_body_sink.is_open() && !m_content_decoder.is_active()
+            && m_body_framing != BodyFraming::no_body) {
+            m_body_remaining = m_content_length;
+#if BOOST_OS_LINUX
+            if (!m_is_secure) {
+                splice_response_body();
+                return;
+            }
+#endif
+            if (m_body_framing == BodyFraming::content_length) {
+                map_response_body();
+                return;
+            }
+        }
+
+        if (is_streaming() && m_body_framing != BodyFraming::no_body) {
+            m_body_remaining = m_content_length;
+            stream_response_body();
+            return;
+        }
+
+        // Anything after the body belongs to the next pipelined response
+        std::size_t buffered = recv_buf.size();
+        if (m_body_framing == BodyFraming::no_body)
+            buffered = 0;
+        else if (m_body_framing == BodyFraming::content_length && buffered > m_content_length)
+            buffered = m_content_length;
+        move_to_response_buf(buffered);
+
+        switch (m_body_framing)
+        {
+        case BodyFraming::no_body:
+            on_response_body_received(boost::system::error_code(), 0);
+            break;
+
+        case BodyFraming::content_length:
+            // Read exactly the remaining body bytes, finishing as soon as the
+            // last one arrives.
+            m_conn->async_read(m_response.get_response_buf(),
+                asio::transfer_exactly(m_content_length - buffered),
+                make_alloc_handler(m_handler_memory,
+                [this](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                    on_response_body_received(ec, bytes_transferred);
+                }));
+            break;
+
+        default:
+            // The body ends when the server closes the connection.
+            m_conn->async_read(m_response.get_response_buf(), asio::transfer_all(),
+                make_alloc_handler(m_handler_memory,
+                [this](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                    on_response_body_received(ec, bytes_transferred);
+                }));
+            break;
+        }
+    }
+
+    // The request message is out, the wait for the response starts
+    void on_request_written()
+    {
+        m_conn->socket_options.apply_quick_ack(m_conn->sock);
+        m_is_request_sent = true;
+        m_timings.sent = std::chrono::steady_clock::now();
+        if (m_first_byte_timeout > std::chrono::steady_clock::duration::zero()) {
+            m_first_byte_deadline = m_timings.sent + m_first_byte_timeout;
+            update_deadline();
+        }
+
+        // A slow response is hedged once it is late by the recent waits
+        std::chrono::steady_clock::duration delay;
+        if (m_hedge_policy.is_enabled() && !m_is_hedge && !m_hedge && !m_data_callback 
+            && m_body_file.empty() && m_metrics.get_recent_wait(m_hedge_policy.percentile, delay))
+            m_deadlines.schedule(m_hedge_entry, 
+                m_timings.sent + std::max(delay, m_hedge_policy.min_delay));
+    }
+
+    // The response has started arriving
+    void on_first_byte()
+    {
+        if (m_timings.first_byte == std::chrono::steady_clock::time_point())
+            m_timings.first_byte = std::chrono::steady_clock::now();
+        if (m_first_byte_deadline != std::chrono::steady_clock::time_point()) {
+            m_first_byte_deadline = std::chrono::steady_clock::time_point();
+            update_deadline();
+        }
+        m_deadlines.cancel(m_hedge_entry);
+    }
+
+    // Decodes the chunked body in the receive buffer, reading more data from
+    // the socket until the last chunk and trailers have been received.
+    void decode_chunked_body()
+    {
+        asio::streambuf& recv_buf = m_conn->recv_buf;
+
+        // While streaming, at most the high-water mark is decoded at a time
+        // and handed to the data callback.
+        do {
+            boost::system::error_code ec;
+            const char* data = static_cast<const char*>(recv_buf.data().data());
+            std::size_t size = recv_buf.size();
+            if (is_streaming())
+                size = std::min(size, m_high_water_mark);
+
+            std::size_t consumed = m_chunked_decoder.decode(data, size,
+                get_body_input_buf(), ec);
+            recv_buf.consume(consumed);
+
+            if (check_if_error_occurred(ec)) return;
+
+            if (is_streaming() && !deliver_response_body()) return;
+
+            if (m_chunked_decoder.is_done()) {
+                on_response_body_received(boost::system::error_code(), 0);
+                return;
+            }
+        } while (recv_buf.size() > 0);
+
+        // Check if request was cancelled
+        if (check_if_request_cancelled()) return;
+
+        m_conn->async_read_some(recv_buf.prepare(RECV_CHUNK_SIZE),
+            make_alloc_handler(m_handler_memory,
+            [this](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                if (ec == asio::error::eof) {
+                    // Server closed the connection before the last chunk.
+                    on_finish(http_errors::invalid_response);
+                    return;
+                }
+                if (check_if_error_occurred(ec)) return;
+
+                m_conn->recv_buf.commit(bytes_transferred);
+                decode_chunked_body();
+            }));
+    }
+
+    // Delivers a Content-Length or close-delimited body to the data callback
+    // or the decoder as it arrives. Reads go straight into the body buffer and
+    // are no larger than the high-water mark.
+    void stream_response_body()
+    {
+        asio::streambuf& recv_buf = m_conn->recv_buf;
+        bool is_delimited = m_body_framing == BodyFraming::content_length;
+
+        // Body bytes read along with the head come first
+        for (;;) {
+            std::size_t buffered = std::min(recv_buf.size(), m_high_water_mark);
+            if (is_delimited)
+                buffered = std::min(buffered, m_body_remaining);
+            if (buffered == 0) break;
+
+            move_to_response_buf(buffered);
+            if (is_delimited)
+                m_body_remaining -= buffered;
+
+            if (!deliver_response_body()) return;
+        }
+
+        if (is_delimited && m_body_remaining == 0) {
+            on_response_body_received(boost::system::error_code(), 0);
+            return;
+        }
+
+        // Check if request was cancelled
+        if (check_if_request_cancelled()) return;
+
+        std::size_t size = m_high_water_mark;
+        if (is_delimited)
+            size = std::min(size, m_body_remaining);
+
+        m_conn->async_read_some(get_body_input_buf().prepare(size),
+            make_alloc_handler(m_handler_memory,
+            [this](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                if (ec) {
+                    on_response_body_received(ec, 0);
+                    return;
+                }
+
+                get_body_input_buf().commit(bytes_transferred);
+                if (m_body_framing == BodyFraming::content_length)
+                    m_body_remaining -= bytes_transferred;
+
+                if (!deliver_response_body()) return;
+                stream_response_body();
+            }));
+    }
+
+    // Hands the body buffered so far to the data callback, decoding it first
+    // if it is compressed. Returns false if the consumer paused reading or 
+    // the request finished with an error.
+    bool deliver_response_body()
+    {
+        if (!m_content_decoder.is_active())
+            return deliver_decoded_body();
+
+        // Decoded at most the high-water mark at a time, however well the 
+        // body compresses. Without a data callback or file the decoded body 
+        // collects in the response buffer for the final callback.
+        asio::streambuf& body = m_response.get_response_buf();
+        while (m_encoded_buf.size() > 0 || m_content_decoder.has_pending_output())
+        {
+            boost::system::error_code ec;
+            const char* data = static_cast<const char*>(m_encoded_buf.data().data());
+            std::size_t decoded = body.size();
+
+            std::size_t consumed = m_content_decoder.decode(data, m_encoded_buf.size(),
+                body, m_high_water_mark, ec);
+            m_encoded_buf.consume(consumed);
+
+            if (check_if_error_occurred(ec)) return false;
+
+            bool is_progress = consumed > 0 || body.size() > decoded;
+            if ((m_data_callback || m_body_sink.is_open()) && !deliver_decoded_body()) 
+                return false;
+            if (!is_progress) break; // needs more input
+        }
+        return true;
+    }
+
+    bool deliver_decoded_body()
+    {
+        asio::streambuf& body = m_response.get_response_buf();
+        if (m_body_sink.is_open()) {
+            boost::system::error_code ec;
+            m_body_sink.write(static_cast<const char*>(body.data().data()), body.size(), ec);
+            body.consume(body.size());
+            return !check_if_error_occurred(ec);
+        }
+
+        if (!m_data_callback || body.size() == 0) return true;
+
+        boost::string_view data(static_cast<const char*>(body.data().data()), body.size());
+        bool is_reading = m_data_callback(*this, m_response, data);
+        body.consume(body.size());
+
+        if (!is_reading)
+            m_is_paused = true;
+        return is_reading;
+    }
+
+    void on_response_body_received(const boost::system::error_code& ec,
+        std::size_t bytes_transferred)
+    {
+        if (m_body_framing == BodyFraming::until_eof) {
+            if (ec == asio::error::eof)
+                finish_response_body(); // response body in streambuf
+            else
+                on_finish(ec);
+            return;
+        }
+
+        if (check_if_error_occurred(ec)) return;
+
+        finish_response_body();
+    }
+
+    void finish_response_body()
+    {
+        // A compressed body is complete only with the end of its stream
+        if (m_content_decoder.is_active() && !m_content_decoder.is_done()) {
+            on_finish(http_errors::invalid_content_encoding);
+            return;
+        }
+
+        on_finish(boost::system::error_code());
+    }
+
+    // Writes a Content-Length body straight into the file's memory map, the
+    // bytes read along with the head first. For TLS, and where there is no 
+    // splice().
+    void map_response_body()
+    {
+        if (!write_buffered_body()) return;
+
+        if (m_body_remaining == 0) {
+            on_response_body_received(boost::system::error_code(), 0);
+            return;
+        }
+
+        // Check if request was cancelled
+        if (check_if_request_cancelled()) return;
+
+        boost::system::error_code ec;
+        asio::mutable_buffer out = m_body_sink.prepare(m_body_remaining, ec);
+        if (check_if_error_occurred(ec)) return;
+
+        m_conn->async_read_some(out,
+            make_alloc_handler(m_handler_memory,
+            [this](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                if (ec) {
+                    on_response_body_received(ec, 0);
+                    return;
+                }
+
+                m_body_sink.commit(bytes_transferred);
+                m_body_remaining -= bytes_transferred;
+                map_response_body();
+            }));
+    }
+
+    // Writes the body bytes read along with the head to the file. Returns 
+    // false if the request finished with an error.
+    bool write_buffered_body()
+    {
+        asio::streambuf& recv_buf = m_conn->recv_buf;
+        std::size_t buffered = recv_buf.size();
+        if (m_body_framing == BodyFraming::content_length)
+            buffered = std::min(buffered, m_body_remaining);
+        if (buffered == 0) return true;
+
+        boost::system::error_code ec;
+        const char* data = static_cast<const char*>(recv_buf.data().data());
+        m_body_sink.write(data, buffered, ec);
+        recv_buf.consume(buffered);
+        if (m_body_framing == BodyFraming::content_length)
+            m_body_remaining -= buffered;
+
+        return !check_if_error_occurred(ec);
+    }
+
+#if BOOST_OS_LINUX
+    // Moves a Content-Length or close-delimited body from the socket to the
+    // file with splice(), so it never enters user space. The socket is 
+    // waited on until readable, then drained until it would block.
+    void splice_response_body()
+    {
+        if (!write_buffered_body()) return;
+
+        // Bounded so that a fast transfer does not hold up the other 
+        // requests of the I/O thread.
+        boost::system::error_code ec;
+        bool is_delimited = m_body_framing == BodyFraming::content_length;
+        m_conn->sock.native_non_blocking(true, ec);
+        for (unsigned int i = 0; ; ++i) {
+            if (is_delimited && m_body_remaining == 0) {
+                on_response_body_received(boost::system::error_code(), 0);
+                return;
+            }
+            if (ec || i == MAX_SPLICES_PER_WAIT) break;
+
+            std::size_t size = is_delimited ? m_body_remaining : std::numeric_limits<std::size_t>::max();
+            std::size_t moved = m_body_sink.splice_from(m_conn->sock.native_handle(), size, ec);
+            if (is_delimited)
+                m_body_remaining -= moved;
+        }
+
+        if (ec && ec != asio::error::would_block) {
+            on_response_body_received(ec, 0);
+            return;
+        }
+
+        // Check if request was cancelled
+        if (check_if_request_cancelled()) return;
+
+        m_conn->sock.async_wait(asio::ip::tcp::socket::wait_read,
+            make_alloc_handler(m_handler_memory,
+            [this](const boost::system::error_code& ec) {
+                if (ec) {
+                    on_response_body_received(ec, 0);
+                    return;
+                }
+                splice_response_body();
+            }));
+    }
+#endif
+
+    // The body is streamed when a consumer, the decoder or a file takes it in 
+    // pieces
+    bool is_streaming() const {
+        return m_data_callback || m_content_decoder.is_active() || m_body_sink.is_open();
+    }
+
+    // Where body bytes from the connection go, the response buffer or, when
+    // the body is compressed, the buffer the decoder reads from.
+    asio::streambuf& get_body_input_buf() {
+        return m_content_decoder.is_active() ? m_encoded_buf : m_response.get_response_buf();
+    }
+
+    // Decodes the body if it was sent with a coding asked for and compiled 
+    // in. Anything else is passed on as received.
+    void start_content_decoding()
+    {
+        m_content_decoder.reset(ContentDecoder::Coding::identity);
+        m_encoded_buf.consume(m_encoded_buf.size());
+
+        boost::string_view content_encoding;
+        if (!m_is_accept_encoding || m_body_framing == BodyFraming::no_body
+            || !m_response.get_headers().find(KnownHeader::content_encoding, content_encoding))
+            return;
+
+        ContentDecoder::Coding coding = ContentDecoder::parse_coding(content_encoding);
+        if (ContentDecoder::is_supported(coding))
+            m_content_decoder.reset(coding);
+    }
+
+    // Opens the file the body is written to, if one was set. A body stored 
+    // as received has its size allocated up front. Returns false if the 
+    // request finished as the file could not be opened.
+    bool start_body_file()
+    {
+        if (m_body_file.empty()) return true;
+
+        std::uint64_t size = 0;
+        if (m_body_framing == BodyFraming::content_length && !m_content_decoder.is_active())
+            size = m_content_length;
+
+        boost::system::error_code ec;
+        m_body_sink.open(m_body_file, size, ec);
+        return !check_if_error_occurred(ec);
+    }
+
+    // Moves bytes received with the headers into the body buffer.
+    void move_to_response_buf(std::size_t size)
+    {
+        asio::streambuf& body = get_body_input_buf();
+        asio::buffer_copy(body.prepare(size), m_conn->recv_buf.data(), size);
+        body.commit(size);
+        m_conn->recv_buf.consume(size);
+    }
+
+    // Determines how the response body is delimited from the status code and 
+    // headers (RFC 7230 section 3.3.3). Returns false if the headers are 
+    // invalid.
+    bool frame_response_body()
+    {
+        const HeaderTable& headers = m_response.get_headers();
+        unsigned int status_code = m_response.get_status_code();
+
+        boost::string_view connection;
+        m_is_keep_alive = !(headers.find(KnownHeader::connection, connection) 
+            && HeaderTable::iequals_trimmed(connection, "close"));
+
+        // Informational, 204 (no content) and 304 (not modified) responses 
+        // never carry a body.
+        if (status_code / 100 == 1 || status_code == 204 || status_code == 304) {
+            m_body_framing = BodyFraming::no_body;
+            return true;
+        }
+
+        // Transfer-Encoding overrides Content-Length. The codings of several
+        // headers are applied in order, so the final coding is the last one of
+        // the last header. If it is not chunked the body can only be delimited
+        // by closing the connection.
+        boost::string_view transfer_encoding;
+        std::size_t transfer_encodings = 0;
+        if (headers.find_transfer_encoding(transfer_encoding, transfer_encodings)) {
+            if (HeaderTable::is_chunked(transfer_encoding)) {
+                m_body_framing = BodyFraming::chunked;
+                m_chunked_decoder.reset();
+            }
+            else {
+                m_body_framing = BodyFraming::until_eof;
+            }
+
+            // A response with both headers, or with several Transfer-Encoding
+            // headers, may be a smuggling attempt, do not reuse the connection.
+            if (headers.contains(KnownHeader::content_length) || transfer_encodings > 1
+                || m_body_framing == BodyFraming::until_eof)
+                m_is_keep_alive = false;
+            return true;
+        }
+
+        // Several Content-Length headers must agree, otherwise the response 
+        // may be split differently by a proxy
+        bool is_valid = false;
+        if (!headers.find_content_length(m_content_length, is_valid)) {
+            m_body_framing = BodyFraming::until_eof;
+            m_is_keep_alive = false;
+            return true;
+        }
+
+        if (!is_valid)
+            return false;
+
+        m_body_framing = m_content_length > 0 ? BodyFraming::content_length 
+            : BodyFraming::no_body;
+        return true;
+    }
+
+    // Leaves the connection once the response has been read, or on error. 
+    // The connection goes back to the pool, or to the next pipelined request,
+    // if it is still in step with the server. Otherwise it is closed.
+    void release_connection(bool is_reusable)
+    {
+        std::shared_ptr<Connection> conn = std::move(m_conn);
+#if defined(HTTP_WITH_NGHTTP2)
+        if (conn->h2) {
+            release_stream(conn);
+            return;
+        }
+#endif
+
+        std::vector<HTTPRequest*>& in_flight = conn->in_flight;
+        in_flight.erase(std::find(in_flight.begin(), in_flight.end(), this));
+        std::vector<HTTPRequest*>& write_queue = conn->write_queue;
+        write_queue.erase(std::remove(write_queue.begin(), write_queue.end(), this), 
+            write_queue.end());
+
+        if (!is_reusable || conn->is_closing) {
+            close_connection(conn);
+            return;
+        }
+
+        if (in_flight.empty()) {
+            m_pool.release(conn);
+            return;
+        }
+
+        // The next pipelined response follows on the connection
+        HTTPRequest* next = in_flight.front();
+        if (next->m_is_request_sent) {
+            m_ios.post(make_alloc_handler(next->m_handler_memory, [next, conn]() {
+                // The connection may have been closed in the meantime
+                if (next->m_conn != conn) return;
+
+                if (next->check_if_request_cancelled()) return;
+                next->read_response();
+            }));
+        }
+    }
+
+    // Closes a connection. Requests pipelined on it are issued again.
+    void close_connection(const std::shared_ptr<Connection>& conn)
+    {
+        conn->is_closed = true;
+        m_pool.remove(conn);
+        conn->close();
+
+        std::vector<HTTPRequest*> pending;
+        pending.swap(conn->in_flight);
+        conn->write_queue.clear();
+
+        for (HTTPRequest* request : pending)
+            request->restart();
+    }
+
+    // Removes a pipelined request that is not being read from its connection.
+    // If its message has been sent, the server's response to it would be read
+    // by nobody, so the connection closes after the current response.
+    void leave_pipeline(bool is_written)
+    {
+        std::vector<HTTPRequest*>& in_flight = m_conn->in_flight;
+        in_flight.erase(std::find(in_flight.begin(), in_flight.end(), this));
+        std::vector<HTTPRequest*>& write_queue = m_conn->write_queue;
+        write_queue.erase(std::remove(write_queue.begin(), write_queue.end(), this), 
+            write_queue.end());
+
+        if (is_written)
+            m_conn->is_closing = true;
+
+        m_conn.reset();
+    }
+
+#if defined(HTTP_WITH_NGHTTP2)
+    static const std::size_t AUTHORITY_FIELD = 2;   // index of :authority in the fields
+
+    // The callbacks of the HTTP/2 sessions, shared by all threads. They find
+    // a stream's request in its user data, which is cleared once the request
+    // leaves the stream.
+    static const Http2Session::Callbacks& get_http2_callbacks()
+    {
+        static const Http2Session::Callbacks callbacks([](nghttp2_session_callbacks* c) {
+            nghttp2_session_callbacks_set_on_begin_headers_callback(c, &HTTPRequest::on_http2_begin_headers);
+            nghttp2_session_callbacks_set_on_header_callback(c, &HTTPRequest::on_http2_header);
+            nghttp2_session_callbacks_set_on_frame_recv_callback(c, &HTTPRequest::on_http2_frame_recv);
+            nghttp2_session_callbacks_set_on_data_chunk_recv_callback(c, &HTTPRequest::on_http2_data);
+            nghttp2_session_callbacks_set_on_stream_close_callback(c, &HTTPRequest::on_http2_stream_close);
+            nghttp2_session_callbacks_set_on_frame_send_callback(c, &HTTPRequest::on_http2_frame_send);
+        });
+        return callbacks;
+    }
+
+    static HTTPRequest* get_stream_request(nghttp2_session* session, std::int32_t stream_id) {
+        return static_cast<HTTPRequest*>(nghttp2_session_get_stream_user_data(session, stream_id));
+    }
+
+    static int on_http2_begin_headers(nghttp2_session* session, const nghttp2_frame* frame, void*)
+    {
+        HTTPRequest* request = get_stream_request(session, frame->hd.stream_id);
+        if (request && frame->hd.type == NGHTTP2_HEADERS)
+            request->on_first_byte();
+        return 0;
+    }
+
+    static int on_http2_header(nghttp2_session* session, const nghttp2_frame* frame,
+        const std::uint8_t* name, std::size_t name_length, const std::uint8_t* value, 
+        std::size_t value_length, std::uint8_t, void*)
+    {
+        HTTPRequest* request = get_stream_request(session, frame->hd.stream_id);
+        if (request && frame->hd.type == NGHTTP2_HEADERS) {
+            request->on_http2_header(
+                boost::string_view(reinterpret_cast<const char*>(name), name_length),
+                boost::string_view(reinterpret_cast<const char*>(value), value_length));
+        }
+        return 0;
+    }
+
+    static int on_http2_frame_recv(nghttp2_session* session, const nghttp2_frame* frame, void*)
+    {
+        HTTPRequest* request = get_stream_request(session, frame->hd.stream_id);
+        if (request && frame->hd.type == NGHTTP2_HEADERS 
+            && (frame->hd.flags & NGHTTP2_FLAG_END_HEADERS))
+            request->on_http2_head_received();
+        return 0;
+    }
+
+    static int on_http2_data(nghttp2_session* session, std::uint8_t, std::int32_t stream_id,
+        const std::uint8_t* data, std::size_t size, void*)
+    {
+        HTTPRequest* request = get_stream_request(session, stream_id);
+        if (request)
+            request->on_http2_data(reinterpret_cast<const char*>(data), size);
+        else
+            nghttp2_session_consume(session, stream_id, size); // of a stream being reset
+        return 0;
+    }
+
+    static int on_http2_stream_close(nghttp2_session* session, std::int32_t stream_id, 
+        std::uint32_t error_code, void*)
+    {
+        HTTPRequest* request = get_stream_request(session, stream_id);
+        if (request)
+            request->on_http2_stream_closed(error_code);
+        return 0;
+    }
+
+    static int on_http2_frame_send(nghttp2_session* session, const nghttp2_frame* frame, void*)
+    {
+        HTTPRequest* request = get_stream_request(session, frame->hd.stream_id);
+        if (request && frame->hd.type == NGHTTP2_HEADERS)
+            request->on_http2_request_sent();
+        return 0;
+    }
+
+    // The connection speaks HTTP/2, the requests that joined it become its 
+    // streams. Its reads go on while it is open.
+    void start_http2()
+    {
+        std::shared_ptr<Connection> conn = m_conn;
+        ConnectionPool& pool = m_pool;
+        conn->write_queue.clear();
+
+        // A request that cannot be submitted finishes, leaving in_flight
+        std::vector<HTTPRequest*>& in_flight = conn->in_flight;
+        for (std::size_t i = 0; i < in_flight.size(); ) {
+            if (in_flight[i]->submit_http2_request())
+                ++i;
+        }
+
+        read_http2(conn, pool);
+        flush_http2(conn, pool);
+    }
+
+    // Opens the request's stream. The header fields are those of the 
+    // HTTP/1.1 message with lowercase names, the Host header becoming 
+    // :authority, and without the fields that only apply to a connection (RFC
+    // 9113 section 8.2.2). Returns false if the request finished instead.
+    bool submit_http2_request()
+    {
+        boost::string_view accept_encoding;
+        if (m_is_accept_encoding)
+            accept_encoding = ContentDecoder::get_accept_encoding();
+        boost::string_view template_headers;
+        if (m_template)
+            template_headers = m_template->get_headers();
+
+        // Reserved for all names up front, so the fields' pointers stay valid
+        m_h2_names.clear();
+        m_h2_names.reserve(template_headers.size() + m_headers.size() 
+            + m_conditional_headers.size() + accept_encoding.size());
+        m_h2_fields.clear();
+
+        add_http2_field(":method", "GET");
+        add_http2_field(":scheme", "https");
+        add_http2_field(":authority", m_host);
+        add_http2_field(":path", m_uri);
+        add_http2_fields(template_headers);
+        add_http2_fields(m_headers);
+        add_http2_fields(m_conditional_headers);
+        add_http2_fields(accept_encoding);
+
+        boost::system::error_code ec;
+        m_h2_stream_id = m_conn->h2->submit_request(m_h2_fields.data(), m_h2_fields.size(),
+            get_http2_weight(m_schedule_entry.get_priority()), this, ec);
+        return !check_if_error_occurred(ec);
+    }
+
+    void add_http2_field(boost::string_view name, boost::string_view value)
+    {
+        nghttp2_nv field;
+        field.name = reinterpret_cast<std::uint8_t*>(const_cast<char*>(name.data()));
+        field.namelen = name.size();
+        field.value = reinterpret_cast<std::uint8_t*>(const_cast<char*>(value.data()));
+        field.valuelen = value.size();
+        field.flags = NGHTTP2_NV_FLAG_NONE;
+        m_h2_fields.push_back(field);
+    }
+
+    // Adds the fields of rendered header lines
+    void add_http2_fields(boost::string_view lines)
+    {
+        while (!lines.empty()) 
+        {
+            std::size_t end = std::min(lines.find("\r\n"), lines.size());
+            boost::string_view line = lines.substr(0, end);
+            lines.remove_prefix(std::min(end + 2, lines.size()));
+
+            std::size_t colon = line.find(':');
+            if (colon == boost::string_view::npos) continue;
+
+            boost::string_view value = line.substr(colon + 1);
+            while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+                value.remove_prefix(1);
+
+            std::size_t offset = m_h2_names.size();
+            for (char c : line.substr(0, colon))
+                m_h2_names += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            boost::string_view name(m_h2_names.data() + offset, colon);
+
+            if (name == "host") {
+                m_h2_fields[AUTHORITY_FIELD].value = 
+                    reinterpret_cast<std::uint8_t*>(const_cast<char*>(value.data()));
+                m_h2_fields[AUTHORITY_FIELD].valuelen = value.size();
+                continue;
+            }
+            if (name == "connection" || name == "keep-alive" || name == "proxy-connection"
+                || name == "transfer-encoding" || name == "upgrade" || name == "te")
+                continue;
+
+            add_http2_field(name, value);
+        }
+    }
+
+    // Stream weights by priority class, so the server favours the streams 
+    // of higher priority when it has to choose
+    static std::int32_t get_http2_weight(RequestPriority priority)
+    {
+        switch (priority) {
+        case RequestPriority::high:
+            return NGHTTP2_MAX_WEIGHT;
+        case RequestPriority::low:
+            return NGHTTP2_MIN_WEIGHT;
+        default:
+            return NGHTTP2_DEFAULT_WEIGHT;
+        }
+    }
+
+    void on_http2_request_sent() {
+        on_request_written();
+    }
+
+    void on_http2_header(boost::string_view name, boost::string_view value)
+    {
+        // Trailers are ignored, as they are after a chunked body
+        if (m_timings.head_received != std::chrono::steady_clock::time_point()) return;
+
+        // nghttp2 has checked that the status is three digits
+        if (name == ":status") {
+            unsigned int status_code = 0;
+            for (char c : value)
+                status_code = status_code * 10 + static_cast<unsigned int>(c - '0');
+            m_response.set_status_code(status_code);
+        }
+        else if ((name.empty() || name.front() != ':') 
+            && (!m_is_known_headers_only || KnownFields::is_kept(name))) {
+            m_response.add_header(name, value);
+        }
+    }
+
+    // A header block has been received
+    void on_http2_head_received()
+    {
+        if (m_timings.head_received != std::chrono::steady_clock::time_point()) return;
+
+        // Skip interim responses, the final one follows on the stream
+        if (m_response.get_status_code() / 100 == 1) {
+            m_response.reset();
+            return;
+        }
+
+        if (check_if_hedge_lost()) return;
+        m_timings.head_received = std::chrono::steady_clock::now();
+
+        // Check if request was cancelled
+        if (check_if_request_cancelled()) return;
+
+        // The body ends with the stream, the headers only tell whether there 
+        // is one and what size a file may be allocated.
+        if (!frame_response_body()) {
+            on_finish(http_errors::invalid_response);
+            return;
+        }
+        start_content_decoding();
+        start_body_file();
+    }
+
+    // Body data of the stream, valid during the call. It is acknowledged to
+    // the server once delivered, so a paused body stops the stream only.
+    void on_http2_data(const char* data, std::size_t size)
+    {
+        m_h2_unconsumed += size;
+
+        asio::streambuf& body = get_body_input_buf();
+        asio::buffer_copy(body.prepare(size), asio::buffer(data, size));
+        body.commit(size);
+
+        if (m_is_paused) return;
+        if (is_streaming() && !deliver_response_body()) return;
+
+        m_conn->h2->consume(m_h2_stream_id, m_h2_unconsumed);
+        m_h2_unconsumed = 0;
+    }
+
+    void on_http2_stream_closed(std::uint32_t error_code)
+    {
+        const std::chrono::steady_clock::time_point none;
+        m_is_h2_stream_closed = true;
+
+        // Not processed by the server, e.g. beyond the last stream of GOAWAY
+        if (error_code == NGHTTP2_REFUSED_STREAM && m_timings.head_received == none) {
+            release_connection(true);
+            m_response.reset();
+            restart();
+            return;
+        }
+
+        if (error_code != NGHTTP2_NO_ERROR || m_timings.head_received == none) {
+            m_is_paused = false;
+            on_finish(error_code != NGHTTP2_NO_ERROR ? http_errors::stream_reset 
+                : http_errors::invalid_response);
+            return;
+        }
+
+        // A paused body finishes once the rest of it has been delivered
+        if (m_is_paused) return;
+        finish_response_body();
+    }
+
+    // The data held back by the pause has been delivered
+    void resume_http2_stream()
+    {
+        m_conn->h2->consume(m_h2_stream_id, m_h2_unconsumed);
+        m_h2_unconsumed = 0;
+
+        if (m_is_h2_stream_closed) {
+            finish_response_body();
+            return;
+        }
+        schedule_http2_flush(m_conn);
+    }
+
+    // Leaves a HTTP/2 connection, resetting the stream if it is still open.
+    // The connection stays shared for the other streams and those to come.
+    void release_stream(const std::shared_ptr<Connection>& conn)
+    {
+        std::vector<HTTPRequest*>& in_flight = conn->in_flight;
+        in_flight.erase(std::find(in_flight.begin(), in_flight.end(), this));
+
+        Http2Session& h2 = *conn->h2;
+        if (m_h2_stream_id > 0) {
+            if (!m_is_h2_stream_closed)
+                h2.reset_stream(m_h2_stream_id);
+
+            // Data held back still counts against the connection's window
+            h2.consume(m_h2_stream_id, m_h2_unconsumed);
+            m_h2_unconsumed = 0;
+        }
+
+        if (in_flight.empty()) {
+            conn->idle_since = std::chrono::steady_clock::now();
+            if (conn->is_closing) {
+                close_http2(conn, m_pool, boost::system::error_code());
+                return;
+            }
+        }
+        schedule_http2_flush(conn);
+    }
+
+    // Frames submitted outside of the reads are written by a posted handler,
+    // so those of one turn of the I/O thread go out in one write.
+    void schedule_http2_flush(const std::shared_ptr<Connection>& conn)
+    {
+        if (conn->is_flush_scheduled || conn->is_closed) return;
+
+        conn->is_flush_scheduled = true;
+        ConnectionPool& pool = m_pool;
+        m_ios.post(make_alloc_handler(conn->flush_handler_memory, [conn, &pool]() {
+            conn->is_flush_scheduled = false;
+            flush_http2(conn, pool);
+        }));
+    }
+
+    // Reads for all streams of a HTTP/2 connection until it closes. The 
+    // callbacks run for the frames received, then the frames they caused are
+    // written.
+    static void read_http2(const std::shared_ptr<Connection>& conn, ConnectionPool& pool)
+    {
+        conn->async_read_some(conn->recv_buf.prepare(RECV_CHUNK_SIZE),
+            make_alloc_handler(conn->read_handler_memory,
+            [conn, &pool](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                if (conn->is_closed) return;
+                if (ec) {
+                    close_http2(conn, pool, ec);
+                    return;
+                }
+
+                boost::system::error_code receive_ec;
+                asio::streambuf& recv_buf = conn->recv_buf;
+                recv_buf.commit(bytes_transferred);
+                conn->h2->receive(static_cast<const char*>(recv_buf.data().data()), 
+                    recv_buf.size(), receive_ec);
+                recv_buf.consume(recv_buf.size());
+
+                if (conn->is_closed) return; // the last stream of a closing connection ended
+                if (receive_ec) {
+                    close_http2(conn, pool, receive_ec);
+                    return;
+                }
+
+                flush_http2(conn, pool);
+                if (conn->is_closed) return;
+
+                // After GOAWAY, once the last stream has ended
+                if (conn->h2->is_done()) {
+                    close_http2(conn, pool, boost::system::error_code());
+                    return;
+                }
+                read_http2(conn, pool);
+            }));
+    }
+
+    // Writes the frames that are ready, one write at a time
+    static void flush_http2(const std::shared_ptr<Connection>& conn, ConnectionPool& pool)
+    {
+        if (conn->is_writing || conn->is_closed) return;
+
+        boost::system::error_code ec;
+        Http2Session& h2 = *conn->h2;
+        h2.collect_output(ec);
+        if (conn->is_closed) return;
+        if (ec) {
+            close_http2(conn, pool, ec);
+            return;
+        }
+        if (h2.get_output().size() == 0) return;
+
+        conn->is_writing = true;
+        conn->async_write(h2.get_output().data(),
+            make_alloc_handler(conn->write_handler_memory,
+            [conn, &pool](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                conn->is_writing = false;
+                if (conn->is_closed) return;
+
+                conn->h2->get_output().consume(bytes_transferred);
+                if (ec) {
+                    close_http2(conn, pool, ec);
+                    return;
+                }
+                flush_http2(conn, pool);
+            }));
+    }
+
+    // Closes a HTTP/2 connection. Its requests that have no response yet are
+    // issued again on another connection, the others fail with ec.
+    static void close_http2(const std::shared_ptr<Connection>& conn, ConnectionPool& pool,
+        boost::system::error_code ec)
+    {
+        if (conn->is_closed) return;
+        conn->is_closed = true;
+        pool.remove(conn);
+        conn->close();
+
+        if (!ec)
+            ec = asio::error::connection_aborted;
+
+        std::vector<HTTPRequest*> streams;
+        streams.swap(conn->in_flight);
+        for (HTTPRequest* request : streams)
+        {
+            request->m_conn.reset();
+            request->m_is_paused = false;
+            if (request->m_timings.head_received == std::chrono::steady_clock::time_point()) {
+                request->m_response.reset();
+                request->restart();
+            }
+            else {
+                request->on_finish(ec);
+            }
+        }
+    }
+#endif
+
+    // Invokes when request completes (either successfully or not)
+    void on_finish(boost::system::error_code ec) 
+    {
+        // A request aborted by a deadline reports which one expired
+        m_deadlines.cancel(m_deadline_entry);
+        m_deadlines.cancel(m_hedge_entry);
+        if (ec && m_timeout_error)
+            ec = m_timeout_error;
+
+        if (m_conn)
+            release_connection(!ec && m_is_keep_alive);
+        if (m_is_admitted) {
+            m_is_admitted = false;
+            m_scheduler.release(m_schedule_entry);
+        }
+
+        // A hedge reports to the request it duplicates, which may release it
+        if (m_hedged) {
+            std::shared_ptr<HTTPRequest> self = m_weak_self.lock();
+            HTTPRequest* hedged = m_hedged;
+            m_hedged = nullptr;
+            hedged->on_hedge_finished(ec);
+        }
+        else if (m_hedge) {
+            if (wait_for_hedge(ec)) return;
+        }
+        else if (ec && retry(ec)) {
+            return;
+        }
+
+        if (!m_is_hedge)
+            m_retry_budget.record_request();
+        complete(ec);
+    }
+
+    // Ends the request with the callback
+    void complete(boost::system::error_code ec)
+    {
+        // The file is complete before the callback sees it
+        if (m_body_sink.is_open()) {
+            boost::system::error_code close_ec;
+            m_body_sink.close(close_ec);
+            if (!ec)
+                ec = close_ec;
+        }
+
+        if (!ec && !m_cache_key.empty())
+            update_cache();
+        if (m_is_flight_leader)
+            land_flight(ec);
+
+        // Handle error code (can be done in callback)
+        if (ec.value() != 0 && !m_is_hedge) {
+            std::cout << "Error occured.\nError code: " << ec.value() 
+                << "\nMessage: " << ec.message() << std::endl;
+        }
+
+        // A hedge's phases are recorded by the request it duplicates
+        m_timings.finished = std::chrono::steady_clock::now();
+        if (!m_is_hedge)
+            record_metrics(ec);
+
+        // Invoke callback. It is invoked through a copy, and the reference 
+        // held while in flight is dropped after it, as releasing the last 
+        // reference returns the request to the pool, where it can be reused by
+        // another thread.
+        std::shared_ptr<HTTPRequest> self = std::move(m_self);
+        Callback callback = m_callback;
+        callback(*this, m_response, ec);
+
+        return;
+    }
+
+    // Issues a request that failed before its response again, at once on a
+    // new connection if a pooled one was closed by the server, or after a
+    // backoff if the policy and the budget allow. Returns false if the 
+    // request is finished.
+    bool retry(const boost::system::error_code& ec)
+    {
+        const std::chrono::steady_clock::time_point none;
+
+        if (m_timings.head_received != none || m_is_hedge || !RetryPolicy::is_retryable(ec))
+            return false;
+
+        // The request is not counted, idle connections close at any time
+        if (m_is_conn_reused && m_timings.first_byte == none && RetryPolicy::is_dropped(ec)
+            && m_restarts < MAX_RESTARTS) {
+            m_timeout_error.clear();
+            m_was_cancelled.store(false, std::memory_order_relaxed);
+            restart();
+            return true;
+        }
+
+        if (m_retries >= m_retry_policy.max_retries || !m_retry_budget.try_spend())
+            return false;
+
+        std::chrono::steady_clock::duration backoff = m_retry_budget.draw_backoff(
+            m_retry_policy.get_backoff_limit(m_retries));
+        ++m_retries;
+        m_metrics.record_retry();
+
+        // A deadline of the last attempt is not one of the next
+        reset_attempt();
+        m_restarts = 0;
+        m_timeout_error.clear();
+        m_was_cancelled.store(false, std::memory_order_relaxed);
+
+        m_deadlines.schedule(m_retry_entry, std::chrono::steady_clock::now() + backoff);
+        update_deadline();
+        return true;
+    }
+
+    // The request failed or finished while its hedge is out. Keeps waiting
+    // for the hedge and returns true if the hedge may still win.
+    bool wait_for_hedge(const boost::system::error_code& ec)
+    {
+        if (!m_is_outrun && (!ec || ec == asio::error::operation_aborted 
+            || ec == http_errors::request_timeout)) {
+            drop_hedge();
+            return false;
+        }
+
+        m_attempt_error = ec;
+        m_is_waiting_for_hedge = true;
+        if (m_is_hedge_done) {
+            complete_with_hedge();
+        }
+        else {
+            // Only the request's own deadline applies while waiting
+            m_connect_deadline = std::chrono::steady_clock::time_point();
+            m_first_byte_deadline = std::chrono::steady_clock::time_point();
+            update_deadline();
+        }
+        return true;
+    }
+
+    // Finishes the request once both it and its hedge have, with the 
+    // response of the hedge if that came first
+    void complete_with_hedge()
+    {
+        std::shared_ptr<HTTPRequest> hedge = std::move(m_hedge);
+        m_is_waiting_for_hedge = false;
+        m_deadlines.cancel(m_deadline_entry);
+
+        boost::system::error_code ec = m_attempt_error;
+        if (m_is_outrun) {
+            m_response.assign(hedge->m_response);
+
+            const std::chrono::steady_clock::time_point none;
+            Timings timings = hedge->m_timings;
+            timings.started = m_timings.started;
+            timings.admitted = m_timings.admitted != none ? m_timings.admitted 
+                                                          : hedge->m_timings.started;
+            m_timings = timings;
+            ec = m_hedge_error;
+        }
+        if (m_hedge_error == asio::error::operation_aborted)
+            ec = m_hedge_error;
+        if (ec && m_timeout_error)
+            ec = m_timeout_error;
+
+        m_metrics.record_hedge(m_is_outrun);
+        m_retry_budget.record_request();
+        complete(ec);
+    }
+
+    // Invoked by the hedge when it finishes
+    void on_hedge_finished(const boost::system::error_code& ec)
+    {
+        if (!m_is_outrun && !m_is_waiting_for_hedge) {
+            m_hedge.reset();
+            m_metrics.record_hedge(false);
+            return;
+        }
+
+        m_hedge_error = ec;
+        m_is_hedge_done = true;
+        if (m_is_waiting_for_hedge)
+            complete_with_hedge();
+    }
+
+    // The first response head wins. Returns true if this request lost and 
+    // is finished.
+    bool check_if_hedge_lost()
+    {
+        if (m_is_hedge) {
+            if (!m_hedged) {
+                on_finish(boost::system::error_code(asio::error::operation_aborted));
+                return true;
+            }
+            m_hedged->on_outrun();
+            return false;
+        }
+
+        if (m_is_outrun) {
+            on_finish(boost::system::error_code(asio::error::operation_aborted));
+            return true;
+        }
+        if (m_hedge)
+            drop_hedge();
+        return false;
+    }
+
+    // Cancels the hedge, which no longer reports back
+    void drop_hedge()
+    {
+        m_deadlines.cancel(m_hedge_entry);
+        if (!m_hedge) return;
+
+        m_hedge->m_hedged = nullptr;
+        m_hedge->cancel();
+        m_hedge.reset();
+        m_metrics.record_hedge(false);
+    }
+
+    // The hedge received its response head first, this request stops and 
+    // waits for the hedge to finish
+    void on_outrun()
+    {
+        m_is_outrun = true;
+        m_deadlines.cancel(m_hedge_entry);
+        if (m_is_waiting_for_hedge) return;
+
+        m_was_cancelled.store(true, std::memory_order_relaxed);
+        abort();
+    }
+
+    // Invoked by the hedge entry when the response is late
+    void on_hedge_due()
+    {
+        if (!m_conn || m_timings.first_byte != std::chrono::steady_clock::time_point() || m_hedge)
+            return;
+        launch_hedge();
+    }
+
+    void launch_hedge();
+
+    // Sets the deadline entry to the earliest deadline that applies now
+    void update_deadline()
+    {
+        const std::chrono::steady_clock::time_point none;
+
+        std::chrono::steady_clock::time_point deadline = m_connect_deadline;
+        if (m_first_byte_deadline != none 
+            && (deadline == none || m_first_byte_deadline < deadline))
+            deadline = m_first_byte_deadline;
+
+        if (m_timeout > std::chrono::steady_clock::duration::zero()) {
+            std::chrono::steady_clock::time_point total = m_timings.started + m_timeout;
+            if (deadline == none || total < deadline)
+                deadline = total;
+        }
+
+        if (deadline == none)
+            m_deadlines.cancel(m_deadline_entry);
+        else
+            m_deadlines.schedule(m_deadline_entry, deadline);
+    }
+
+    // Invoked by the deadline entry, on the I/O thread
+    void on_deadline()
+    {
+        const std::chrono::steady_clock::time_point none;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        if (m_connect_deadline != none && now >= m_connect_deadline)
+            m_timeout_error = http_errors::connect_timeout;
+        else if (m_first_byte_deadline != none && now >= m_first_byte_deadline)
+            m_timeout_error = http_errors::first_byte_timeout;
+        else
+            m_timeout_error = http_errors::request_timeout;
+
+        m_was_cancelled.store(true, std::memory_order_relaxed);
+        abort();
+    }
+
+    // Records the phases of the finished request in the thread's metrics. 
+    // Phases that were skipped are left out.
+    void record_metrics(const boost::system::error_code& ec)
+    {
+        const std::chrono::steady_clock::time_point none;
+        const Timings& timings = m_timings;
+
+        // Time spent queued is not part of the phases that follow
+        std::chrono::steady_clock::time_point admitted = timings.started;
+        if (timings.admitted != none) {
+            admitted = timings.admitted;
+            m_metrics.record_phase(ClientMetrics::queue, admitted - timings.started);
+        }
+
+        if (timings.resolved != none)
+            m_metrics.record_phase(ClientMetrics::resolve, timings.resolved - admitted);
+
+        if (timings.connected != none) {
+            m_metrics.record_phase(ClientMetrics::connect, timings.connected - timings.resolved);
+            m_metrics.record_connection_opened();
+        }
+
+        if (timings.secured != none)
+            m_metrics.record_phase(ClientMetrics::tls, timings.secured - timings.connected);
+
+        if (timings.sent != none) {
+            std::chrono::steady_clock::time_point ready = timings.secured != none 
+                ? timings.secured 
+                : (timings.connected != none ? timings.connected : admitted);
+            m_metrics.record_phase(ClientMetrics::send, timings.sent - ready);
+
+            if (timings.first_byte != none)
+                m_metrics.record_phase(ClientMetrics::wait, timings.first_byte - timings.sent);
+        }
+
+        if (timings.head_received != none) {
+            m_metrics.record_phase(ClientMetrics::head, 
+                timings.head_received - timings.first_byte);
+            m_metrics.record_phase(ClientMetrics::body, 
+                timings.finished - timings.head_received);
+            m_metrics.record_status(m_response.get_status_code());
+        }
+
+        m_metrics.record_phase(ClientMetrics::total, timings.finished - timings.started);
+
+        if (!ec)
+            m_metrics.record_outcome(ClientMetrics::success);
+        else if (ec == asio::error::operation_aborted)
+            m_metrics.record_outcome(ClientMetrics::cancelled);
+        else
+            m_metrics.record_outcome(ClientMetrics::failure);
+    }
+
+    bool is_cancelled() const {
+        return m_was_cancelled.load(std::memory_order_acquire);
+    }
+
+    bool check_if_request_cancelled() {
+        if (is_cancelled()) {
+            on_finish(boost::system::error_code(asio::error::operation_aborted));
+            return true;
+        }
+        return false;
+    }
+
+    bool check_if_error_occurred(const boost::system::error_code& ec) {
+        if (ec.value() != 0) {
+            on_finish(ec);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    // Request parameters
+    std::string m_host;
+    unsigned int m_port;
+    bool m_is_secure;                   // HTTPS
+    std::string m_uri;
+
+    // Object unique identifier
+    unsigned int m_id;
+
+    // Callback to be invoked when request completes
+    Callback m_callback;
+
+    // Headers rendered once for the endpoint, and those of this request
+    std::shared_ptr<const RequestTemplate> m_template;
+    std::string m_headers;
+
+    // The request message, written with one gathered write
+    RequestBuffers m_request_bufs;
+
+    // Structure to hold response data received from server
+    HTTPResponse m_response;
+
+    // Parses the response head received on the connection
+    ResponseHeadParser m_head_parser;
+    bool m_is_known_headers_only;       // unknown response headers are skipped
+
+    // Response body framing
+    std::size_t m_content_length;
+    BodyFraming m_body_framing;
+    ChunkedDecoder m_chunked_decoder;
+    bool m_is_keep_alive;               // connection can be reused
+
+    // When each phase of the request ended
+    Timings m_timings;
+
+    // For cancelling mechanism, set by cancel() on any thread
+    std::atomic<bool> m_was_cancelled;
+
+    // Waiting for the host name to be resolved
+    bool m_is_resolving;
+
+    // The connection the request is sent on, shared when pipelining
+    std::string m_conn_key;             // host:port
+    std::shared_ptr<Connection> m_conn;
+    std::shared_ptr<ConnectRace> m_connect_race;  // while connecting
+    bool m_is_request_sent;
+    unsigned int m_restarts;            // times issued again on a new connection
+    bool m_is_conn_reused;              // taken from the pool, may be stale
+    SocketOptions m_socket_options;     // for new connections, over the pool's
+    bool m_has_socket_options;
+
+    // Streaming of the response body
+    DataCallback m_data_callback;
+    std::size_t m_high_water_mark;      // most body bytes buffered at once
+    std::size_t m_body_remaining;       // Content-Length bytes still to read
+    bool m_is_paused;                   // the data callback paused reading
+
+    // Decompression of the response body, the buffers are kept when the
+    // request is recycled
+    bool m_is_accept_encoding;
+    ContentDecoder m_content_decoder;
+    asio::streambuf m_encoded_buf;      // body bytes not yet decoded
+
+    // Storing the response body in a file
+    std::string m_body_file;            // path, empty to buffer the body
+    FileSink m_body_sink;
+
+    // The response cache, for a request that may be answered from it
+    std::string m_cache_key;            // the message, empty if not cached
+    std::shared_ptr<const CachedResponse> m_cached; // revalidated by this request
+    std::string m_conditional_headers;  // If-None-Match and If-Modified-Since
+
+    // Coalescing with identical requests in flight
+    std::string m_flight_key;           // the message, empty unless coalesced
+    bool m_is_flight_leader;            // sent for the requests that wait for it
+    bool m_is_coalesced;                // waiting for the leader's response
+
+    // Deadlines, kept in the I/O thread's timer wheel
+    std::chrono::steady_clock::duration m_connect_timeout;
+    std::chrono::steady_clock::duration m_first_byte_timeout;
+    std::chrono::steady_clock::duration m_timeout;
+    std::chrono::steady_clock::time_point m_connect_deadline;
+    std::chrono::steady_clock::time_point m_first_byte_deadline;
+    TimerWheel::Entry m_deadline_entry; // set to the earliest deadline
+    boost::system::error_code m_timeout_error;
+
+    // Admission by the client's scheduler, while it limits requests in flight
+    RequestScheduler::Entry m_schedule_entry;
+    bool m_is_admitted;                 // counted in flight, to be released
+
+    // Retries after failures, waiting in the timer wheel for the backoff
+    RetryPolicy m_retry_policy;
+    unsigned int m_retries;
+    TimerWheel::Entry m_retry_entry;
+
+    // Hedging, a request and its hedge refer to each other until one has lost
+    HedgePolicy m_hedge_policy;
+    TimerWheel::Entry m_hedge_entry;    // when the hedge is due
+    std::shared_ptr<HTTPRequest> m_hedge;
+    HTTPRequest* m_hedged;              // of a hedge, the request it duplicates
+    bool m_is_hedge;
+    bool m_is_outrun;                   // the hedge's response came first
+    bool m_is_waiting_for_hedge;        // finished but for the hedge
+    bool m_is_hedge_done;
+    boost::system::error_code m_attempt_error;
+    boost::system::error_code m_hedge_error;
+    asio::ip::tcp::endpoint m_avoided_endpoint; // of a hedge, tried last
+
+#if defined(HTTP_WITH_NGHTTP2)
+    // The request's stream on a HTTP/2 connection
+    std::int32_t m_h2_stream_id;        // zero until submitted
+    std::size_t m_h2_unconsumed;        // body bytes not yet given back to the window
+    bool m_is_h2_stream_closed;         // ended by the server, or refused
+    std::vector<nghttp2_nv> m_h2_fields;// header fields, keeping their capacity
+    std::string m_h2_names;             // the lowercase names the fields point into
+#endif
+
+    // Memory for the request's outstanding asynchronous operation
+    HandlerMemory m_handler_memory;
+
+    // Set by the pool while the request is referenced. The strong reference
+    // is held from execute() until the callback has run.
+    std::weak_ptr<HTTPRequest> m_weak_self;
+    std::shared_ptr<HTTPRequest> m_self;
+
+    asio::io_service& m_ios;
+    ConnectionPool& m_pool;             // idle persistent connections
+    DNSCache& m_dns_cache;              // shared host name resolutions
+    TLSContext& m_tls;                  // shared TLS settings and sessions
+    RequestScheduler& m_scheduler;      // shared in-flight limits
+    ResponseCache& m_response_cache;    // shared responses
+    RequestCoalescer& m_coalescer;      // shared requests in flight
+    ClientMetrics& m_metrics;           // counters of the I/O thread
+    RequestDeadlines& m_deadlines;      // timer wheel of the I/O thread
+    RetryBudget& m_retry_budget;        // of the I/O thread
+    RequestPool& m_requests;            // for the hedges
+};
+
+const unsigned int HTTPRequest::CONNECTION_ATTEMPT_DELAY_MS;
+
+// --------------------------------------------------------------------------------
+// RequestPool class: Recycles the HTTPRequest objects of one I/O thread. A 
+// request released by its last shared_ptr goes back to the free list, with its
+// buffers, instead of being deleted. The shared_ptr control blocks are recycled
+// the same way, so creating a request in the steady state does not allocate.
+//
+// The free lists are shared with the deleters, so the pool may go away while 
+// requests are still referenced; those are then deleted as usual.
+// --------------------------------------------------------------------------------
+
+class RequestPool
+{
+    static const std::size_t MAX_FREE = 1024;
+
+    struct FreeLists 
+    {
+        FreeLists() : block_size(0), is_closed(false)
+        {}
+
+        ~FreeLists() {
+            for (HTTPRequest* request : requests)
+                delete request;
+            for (void* block : blocks)
+                ::operator delete(block);
+        }
+
+        std::mutex mux;
+        std::vector<HTTPRequest*> requests;
+        std::vector<void*> blocks;          // shared_ptr control blocks
+        std::size_t block_size;
+        bool is_closed;
+    };
+
+    // Returns the request to the free list, or deletes it.
+    struct Deleter 
+    {
+        void operator()(HTTPRequest* request) const {
+            // Its weak reference would keep this control block, and through
+            // the block allocator the free lists, alive.
+            request->m_weak_self.reset();
+            {
+                std::lock_guard<std::mutex> lock(lists->mux);
+                if (!lists->is_closed && lists->requests.size() < MAX_FREE) {
+                    lists->requests.push_back(request);
+                    return;
+                }
+            }
+            delete request;
+        }
+
+        std::shared_ptr<FreeLists> lists;
+    };
+
+    // Allocates the shared_ptr control blocks from the free list
+    template <typename T>
+    struct BlockAllocator 
+    {
+        typedef T value_type;
+
+        explicit BlockAllocator(const std::shared_ptr<FreeLists>& lists) : lists(lists)
+        {}
+
+        template <typename U>
+        BlockAllocator(const BlockAllocator<U>& other) : lists(other.lists)
+        {}
+
+        T* allocate(std::size_t n) {
+            std::size_t size = sizeof(T) * n;
+            {
+                std::lock_guard<std::mutex> lock(lists->mux);
+                if (size == lists->block_size && !lists->blocks.empty()) {
+                    void* block = lists->blocks.back();
+                    lists->blocks.pop_back();
+                    return static_cast<T*>(block);
+                }
+            }
+            return static_cast<T*>(::operator new(size));
+        }
+
+        void deallocate(T* pointer, std::size_t n) {
+            std::size_t size = sizeof(T) * n;
+            {
+                std::lock_guard<std::mutex> lock(lists->mux);
+                if (lists->block_size == 0)
+                    lists->block_size = size;
+
+                if (size == lists->block_size && lists->blocks.size() < MAX_FREE) {
+                    lists->blocks.push_back(pointer);
+                    return;
+                }
+            }
+            ::operator delete(pointer);
+        }
+
+        template <typename U>
+        bool operator==(const BlockAllocator<U>& other) const { return lists == other.lists; }
+        template <typename U>
+        bool operator!=(const BlockAllocator<U>& other) const { return lists != other.lists; }
+
+        std::shared_ptr<FreeLists> lists;
+    };
+
+public:
+    RequestPool(asio::io_service& ios, ConnectionPool& pool, DNSCache& dns_cache,
+        TLSContext& tls, RequestScheduler& scheduler, ResponseCache& response_cache, 
+        RequestCoalescer& coalescer, ClientMetrics& metrics, RequestDeadlines& deadlines, 
+        RetryBudget& retry_budget) :
+        m_lists(std::make_shared<FreeLists>()),
+        m_ios(ios),
+        m_pool(pool),
+        m_dns_cache(dns_cache),
+        m_tls(tls),
+        m_scheduler(scheduler),
+        m_response_cache(response_cache),
+        m_coalescer(coalescer),
+        m_metrics(metrics),
+        m_deadlines(deadlines),
+        m_retry_budget(retry_budget)
+    {}
+
+    ~RequestPool() {
+        // Requests still referenced are deleted when released
+        std::lock_guard<std::mutex> lock(m_lists->mux);
+        m_lists->is_closed = true;
+    }
+
+    std::shared_ptr<HTTPRequest> create(unsigned int id) 
+    {
+        HTTPRequest* request = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_lists->mux);
+            if (!m_lists->requests.empty()) {
+                request = m_lists->requests.back();
+                m_lists->requests.pop_back();
+            }
+        }
+
+        if (request)
+            request->reset(id);
+        else
+            request = new HTTPRequest(m_ios, id, m_pool, m_dns_cache, m_tls, 
+                m_scheduler, m_response_cache, m_coalescer, m_metrics, m_deadlines, 
+                m_retry_budget, *this);
+
+        std::shared_ptr<HTTPRequest> shared(request, Deleter{m_lists}, 
+            BlockAllocator<HTTPRequest>(m_lists));
+        request->m_weak_self = shared;
+        return shared;
+    }
+
+private:
+    std::shared_ptr<FreeLists> m_lists;
+
+    asio::io_service& m_ios;
+    ConnectionPool& m_pool;
+    DNSCache& m_dns_cache;
+    TLSContext& m_tls;
+    RequestScheduler& m_scheduler;
+    ResponseCache& m_response_cache;
+    RequestCoalescer& m_coalescer;
+    ClientMetrics& m_metrics;
+    RequestDeadlines& m_deadlines;
+    RetryBudget& m_retry_budget;
+};
+
+const std::size_t RequestPool::MAX_FREE;
+
+// The hedge is a copy of the request on a new connection, which tries the 
+// endpoint of the late one last
+inline void HTTPRequest::launch_hedge()
+{
+    std::shared_ptr<HTTPRequest> hedge = m_requests.create(m_id);
+    hedge->m_host = m_host;
+    hedge->m_port = m_port;
+    hedge->m_is_secure = m_is_secure;
+    hedge->m_uri = m_uri;
+    hedge->m_template = m_template;
+    hedge->m_headers = m_headers;
+    hedge->m_conditional_headers = m_conditional_headers;
+    hedge->m_is_accept_encoding = m_is_accept_encoding;
+    hedge->m_is_known_headers_only = m_is_known_headers_only;
+    hedge->m_schedule_entry.set_priority(m_schedule_entry.get_priority());
+    hedge->m_connect_timeout = m_connect_timeout;
+    hedge->m_first_byte_timeout = m_first_byte_timeout;
+    hedge->m_socket_options = m_conn->socket_options;
+    hedge->m_has_socket_options = true;
+    hedge->m_callback = [](const HTTPRequest&, const HTTPResponse&, const boost::system::error_code&) {};
+    hedge->m_is_hedge = true;
+    hedge->m_hedged = this;
+
+    boost::system::error_code ec;
+    if (m_conn->is_connected)
+        hedge->m_avoided_endpoint = m_conn->sock.remote_endpoint(ec);
+
+    m_hedge = hedge;
+    hedge->execute();
+}
+
+// --------------------------------------------------------------------------------
+// RequestBatch class: GET requests issued as one unit by HTTPClient::execute_batch
+// and completed with a single callback. The requests of a batch run on the same 
+// I/O thread, so it counts them down without synchronization. An optional item 
+// callback sees each result as it arrives, and an optional deadline cancels the 
+// requests still outstanding, which then fail with timed_out.
+// --------------------------------------------------------------------------------
+
+struct BatchEntry
+{
+    std::string host;
+    unsigned int port;
+    std::string uri;
+};
+
+class RequestBatch
+{
+    friend class HTTPClient;
+
+public:
+    std::size_t size() const { return m_requests.size(); }
+
+    // The requests and their results, by entry index. They are released once 
+    // the completion callback returns.
+    const HTTPRequest& get_request(std::size_t index) const { return *m_requests[index]; }
+    const HTTPResponse& get_response(std::size_t index) const { 
+        return m_requests[index]->m_response; 
+    }
+    const boost::system::error_code& get_error(std::size_t index) const { 
+        return m_errors[index]; 
+    }
+
+    std::size_t get_failed_count() const { return m_failed; }
+    bool is_timed_out() const { return m_is_timed_out; }
+
+private:
+    explicit RequestBatch(asio::io_service& ios) :
+        m_remaining(0),
+        m_failed(0),
+        m_is_timed_out(false),
+        m_deadline_timer(ios)
+    {}
+
+    // Runs on the batch's I/O thread
+    void start(std::chrono::steady_clock::duration deadline, 
+        const std::shared_ptr<RequestBatch>& self)
+    {
+        if (deadline > std::chrono::steady_clock::duration::zero()) {
+            m_deadline_timer.expires_from_now(deadline);
+            m_deadline_timer.async_wait([self](const boost::system::error_code& ec) {
+                self->on_deadline(ec);
+            });
+        }
+
+        // The extra count keeps the batch from completing before all 
+        // requests have been started.
+        m_remaining = m_requests.size() + 1;
+        for (auto& request : m_requests)
+            request->begin();
+        on_item_done();
+    }
+
+    void on_item_finished(std::size_t index, const HTTPRequest& request, 
+        const HTTPResponse& response, boost::system::error_code ec)
+    {
+        if (m_is_timed_out && ec == asio::error::operation_aborted)
+            ec = asio::error::timed_out;
+        if (ec)
+            ++m_failed;
+        m_errors[index] = ec;
+        m_is_finished[index] = true;
+
+        if (m_on_item)
+            m_on_item(request, response, ec);
+        on_item_done();
+    }
+
+    void on_item_done()
+    {
+        if (--m_remaining > 0) return;
+
+        m_deadline_timer.cancel();
+        m_on_complete(*this);
+
+        // The requests' callbacks hold the batch, drop them to break the 
+        // cycle. The last request is finishing, all are safe to release.
+        for (auto& request : m_requests)
+            request->set_callback(nullptr);
+        m_requests.clear();
+    }
+
+    void on_deadline(const boost::system::error_code& ec)
+    {
+        if (ec == asio::error::operation_aborted || m_remaining == 0) return;
+
+        m_is_timed_out = true;
+        for (std::size_t i = 0; i < m_requests.size(); ++i)
+            if (!m_is_finished[i])
+                m_requests[i]->cancel();
+    }
+
+private:
+    std::vector<std::shared_ptr<HTTPRequest>> m_requests;
+    std::vector<boost::system::error_code> m_errors;
+    std::vector<bool> m_is_finished;
+    std::size_t m_remaining;            // requests not finished yet
+    std::size_t m_failed;
+    bool m_is_timed_out;
+
+    Callback m_on_item;
+    BatchCallback m_on_complete;
+    asio::steady_timer m_deadline_timer;
+};
+
+// --------------------------------------------------------------------------------
+// GetOperation class: The state of HTTPClient::async_get while the request is in
+// flight: the completion handler and work on the handler's executor. It is 
+// allocated with the handler's associated allocator and held by the request's 
+// callback.
+// --------------------------------------------------------------------------------
+
+template <typename Handler>
+class GetOperation
+{
+public:
+    typedef typename asio::associated_executor<Handler, 
+        asio::io_service::executor_type>::type executor_type;
+
+    GetOperation(Handler& handler, const asio::io_service::executor_type& io_executor) :
+        m_handler(std::move(handler)),
+        m_work(asio::get_associated_executor(m_handler, io_executor))
+    {}
+
+    // Passes the result to the handler on its executor
+    void complete(const boost::system::error_code& ec, std::shared_ptr<HTTPRequest> request)
+    {
+        executor_type executor = m_work.get_executor();
+        asio::dispatch(executor, Completion{std::move(m_handler), ec, std::move(request)});
+        m_work.reset();
+    }
+
+private:
+    struct Completion 
+    {
+        void operator()() {
+            handler(ec, std::move(request));
+        }
+
+        Handler handler;
+        boost::system::error_code ec;
+        std::shared_ptr<HTTPRequest> request;
+    };
+
+    Handler m_handler;
+    asio::executor_work_guard<executor_type> m_work;
+};
+
+// --------------------------------------------------------------------------------
+// HTTPClient: Establishes a threading policy. Spawns and destroys threads in a 
+// thread pool. Running the Boost.Asio event loop and delivering asynchronous 
+// operation's completion events. Acts as a factory of the HTTPRequest objects.
+//
+// Each thread runs its own io_service with its own connection pool. Requests are 
+// placed on the threads round-robin and all handlers of a request run on the 
+// same thread, so a request's state is never touched by two threads at once.
+// --------------------------------------------------------------------------------
+
+class HTTPClient
+{
+public:
+    HTTPClient(unsigned int num_threads = 1, bool pin_threads = false) :
+        m_next_worker(0)
+    {
+        assert(num_threads > 0);
+
+        for (unsigned int i = 0; i < num_threads; ++i) 
+        {
+            Worker* worker = new Worker(m_dns_cache, m_tls, m_scheduler, m_response_cache,
+                m_coalescer);
+            m_workers.emplace_back(worker);
+
+            worker->work.reset(new boost::asio::io_service::work(worker->ios));
+
+            worker->thread.reset(new std::thread([worker](){
+                worker->ios.run();
+            }));
+
+            if (pin_threads)
+                pin_thread_to_cpu(*worker->thread, i);
+        }
+    }
+
+    std::shared_ptr<HTTPRequest> create_request(unsigned int id) {
+        Worker& worker = *m_workers[m_next_worker++ % m_workers.size()];
+        return worker.requests.create(id);
+    }
+
+    // Issues a GET request and completes with (error_code, request) through 
+    // an asio completion token: a callback, asio::use_future, or, in a 
+    // coroutine, asio::use_awaitable as in
+    //
+    //     auto request = co_await client.async_get(host, 80, "/", asio::use_awaitable);
+    //
+    // The handler runs on its associated executor, the I/O thread if it has 
+    // none. The request holds the response and stays alive while the handler
+    // has it.
+    template <typename CompletionToken>
+    BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, 
+        void(boost::system::error_code, std::shared_ptr<HTTPRequest>))
+    async_get(const std::string& host, unsigned int port, const std::string& uri, 
+        CompletionToken&& token)
+    {
+        return asio::async_initiate<CompletionToken, 
+            void(boost::system::error_code, std::shared_ptr<HTTPRequest>)>(
+            GetInitiation{this}, token, host, port, uri);
+    }
+
+    // Issues a GET request for each entry and invokes on_complete once all 
+    // have finished. The requests are placed on one thread and started with 
+    // a single post; entries for the same host:port share a request template 
+    // and one DNS lookup. Request ids are the entry indexes. A positive 
+    // deadline cancels the requests still outstanding when it expires.
+    void execute_batch(const std::vector<BatchEntry>& entries, BatchCallback on_complete,
+        Callback on_item = nullptr, 
+        std::chrono::steady_clock::duration deadline = std::chrono::steady_clock::duration::zero())
+    {
+        assert(on_complete != nullptr);
+
+        Worker& worker = *m_workers[m_next_worker++ % m_workers.size()];
+        std::shared_ptr<RequestBatch> batch(new RequestBatch(worker.ios));
+        batch->m_on_complete = std::move(on_complete);
+        batch->m_on_item = std::move(on_item);
+        batch->m_requests.reserve(entries.size());
+        batch->m_errors.resize(entries.size());
+        batch->m_is_finished.resize(entries.size());
+
+        std::map<std::string, std::shared_ptr<const RequestTemplate>> templates;
+        std::string key;
 
-typedef void(*Callback) (const HTTPRequest& request, 
-    const HTTPResponse& response, const system::error_code& ec);
+        for (std::size_t i = 0; i < entries.size(); ++i) 
+        {
+            const BatchEntry& entry = entries[i];
+            ConnectionPool::make_key(entry.host, entry.port, key);
+            std::shared_ptr<const RequestTemplate>& request_template = templates[key];
+            if (!request_template)
+                request_template = std::make_shared<RequestTemplate>(entry.host, entry.port);
 
-// --------------------------------------------------------------------------------
-// HTTPResponse class: Represents a HTTP response message sent to the client as a
-// response to the request.
-// --------------------------------------------------------------------------------
+            std::shared_ptr<HTTPRequest> request = 
+                worker.requests.create(static_cast<unsigned int>(i));
+            request->set_template(request_template);
+            request->set_uri(entry.uri);
+            request->set_callback([batch, i](const HTTPRequest& request, 
+                const HTTPResponse& response, const boost::system::error_code& ec) {
+                batch->on_item_finished(i, request, response, ec);
+            });
+            request->prepare();
 
-class HTTPResponse 
-{
-    friend class HTTPRequest;
-    
-    // Private constructor - only HTTPRequest can invokes it 
-    HTTPResponse() : m_response_stream(&m_response_buf)
-    {}
+            batch->m_requests.push_back(std::move(request));
+        }
 
-public:
-    unsigned int get_status_code() const {
-        return m_status_code;
+        worker.ios.post([batch, deadline]() {
+            batch->start(deadline, batch);
+        });
     }
 
-    const std::string& get_status_message() const {
-        return m_status_message;
+    unsigned int get_num_threads() const {
+        return static_cast<unsigned int>(m_workers.size());
     }
 
-    const std::map<std::string, std::string>& get_headers() const {
-        return m_headers;
+    // The mechanism the I/O threads wait for their sockets with
+    static const char* get_event_loop_name()
+    {
+#if defined(BOOST_ASIO_HAS_IO_URING_AS_DEFAULT)
+        return "io_uring";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+        return "iocp";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+        return "epoll";
+#elif defined(BOOST_ASIO_HAS_KQUEUE)
+        return "kqueue";
+#elif defined(BOOST_ASIO_HAS_DEV_POLL)
+        return "/dev/poll";
+#else
+        return "select";
+#endif
     }
 
-    const std::istream& get_response() const {
-        return m_response_stream;
+    // Connection pool settings, applied to the pool of every thread.
+    void set_max_idle_per_host(std::size_t max_idle) {
+        for (auto& worker : m_workers)
+            worker->pool.set_max_idle_per_host(max_idle);
     }
 
-private: // exposed only to HTTPRequest class 
-    asio::streambuf& get_response_buf() {
-        return m_response_buf;
+    void set_idle_timeout(std::chrono::steady_clock::duration idle_timeout) {
+        for (auto& worker : m_workers)
+            worker->pool.set_idle_timeout(idle_timeout);
     }
 
-    void set_status_code(unsigned int status_code) {
-        m_status_code = status_code;
+    // Requests in flight on one connection, above one enables pipelining.
+    void set_pipeline_depth(std::size_t depth) {
+        for (auto& worker : m_workers)
+            worker->pool.set_pipeline_depth(depth);
     }
 
-    void set_status_message(const std::string& status_message) {
-        m_status_message = status_message;
+    // How the sockets of new connections are set up, see SocketOptions
+    void set_socket_options(const SocketOptions& options) {
+        for (auto& worker : m_workers)
+            worker->pool.set_socket_options(options);
     }
 
-    void add_header(const std::string& name, const std::string& value) {
-        m_headers[name] = value;
+    // Caches responses up to the given bytes in all, zero for no cache (the
+    // default), see ResponseCache. Requests whose body is streamed or written
+    // to a file neither use nor fill it.
+    void set_response_cache(std::size_t max_bytes) {
+        m_response_cache.set_max_bytes(max_bytes);
     }
 
-private:
-    unsigned int m_status_code;         // HTTP status code
-    std::string m_status_message;       // HTTP status message
+    // Requests identical to one in flight wait for it and share its response
+    // instead of being sent, see RequestCoalescer. Off by default. Requests 
+    // whose body is streamed or written to a file are always sent.
+    void set_coalescing(bool is_enabled) {
+        m_coalescer.set_enabled(is_enabled);
+    }
 
-    // Response headers
-    std::map<std::string, std::string> m_headers;
-    asio::streambuf m_response_buf;     // Will contain response data from server 
-    std::istream m_response_stream;     // For extracting data in response buffer
-};
+    // Admission control, zero for no limit. Requests over the limits wait in
+    // a queue per host:port and start as others finish, see RequestScheduler.
+    // Set the limits before making requests; until one is set requests start
+    // at once without taking the scheduler's lock.
+    void set_max_in_flight(std::size_t max_in_flight) {
+        m_scheduler.set_max_in_flight(max_in_flight);
+    }
 
-// --------------------------------------------------------------------------------
-// HTTPRequest class: Represents a HTTP GET request that constructs the HTTP
-// request message based on information provided by the class users, sends it to
-// the server, and then receives and parses the HTTP response message.
-// --------------------------------------------------------------------------------
+    void set_max_in_flight_per_host(std::size_t max_in_flight) {
+        m_scheduler.set_max_in_flight_per_origin(max_in_flight);
+    }
 
-class HTTPRequest
-{
-    friend class HTTPClient;
+    // Retries each I/O thread may make, as a ratio of its finished requests
+    // plus those always allowed per second, see RetryBudget. Retries are
+    // only made by requests given a RetryPolicy.
+    void set_retry_budget(double ratio, unsigned int min_per_second) {
+        for (auto& worker : m_workers)
+            worker->retry_budget.set_limits(ratio, min_per_second);
+    }
 
-    static const unsigned int DEFAULT_PORT = 80;
+    // Overrides the per host limit for one server, and gives it weight times 
+    // the share of the queued requests admitted of others.
+    void set_host_limits(const std::string& host, unsigned int port, std::size_t max_in_flight,
+        unsigned int weight = 1, bool is_secure = false) 
+    {
+        std::string key;
+        ConnectionPool::make_key(host, port, key, is_secure);
+        m_scheduler.set_origin_limits(key, max_in_flight, weight);
+    }
 
-    // Private constructor - only HTTPClient can invokes it 
-    HTTPRequest(asio::io_service& ios, unsigned int id) :
-        m_port(DEFAULT_PORT),
-        m_id(id),
-        m_callback(nullptr),
-        m_sock(ios),
-        m_resolver(ios),
-        m_was_cancelled(false),
-        m_ios(ios)
-    {}
+    // Resolved host names are reused for this long
+    void set_dns_ttl(std::chrono::steady_clock::duration ttl) {
+        m_dns_cache.set_ttl(ttl);
+    }
 
-public:
-    // Setters
-    void set_host(const std::string& host) { m_host = host; }
-    void set_port(unsigned int port) { m_port = port; }
-    void set_uri(const std::string& uri) { m_uri = uri; }
-    void set_callback(Callback callback) { m_callback = callback; }
+    // Host names kept resolved at most, 4096 by default
+    void set_dns_max_entries(std::size_t max_entries) {
+        m_dns_cache.set_max_entries(max_entries);
+    }
 
-    // Getters
-    std::string get_host() const { return m_host; }
-    unsigned int get_port() const { return m_port; }
-    const std::string& get_uri() const { return m_uri; }
-    unsigned int get_id() const { return m_id; }
+#if defined(HTTP_WITH_OPENSSL)
+    // The TLS context of secure requests, e.g. for trusting a private CA with
+    // load_verify_file(). Configure it before making requests.
+    asio::ssl::context& get_tls_context() {
+        return m_tls.get_context();
+    }
+#endif
 
-    // Initiates an asynchronous GET request
-    void execute() 
+#if defined(HTTP_WITH_NGHTTP2)
+    // Offers h2 with ALPN to a server of secure requests. If the server 
+    // selects it, the requests of each thread to that server are streams on
+    // one connection, a second one opening only once the server's limit of 
+    // concurrent streams is reached.
+    void set_http2(const std::string& host, unsigned int port, bool is_enabled = true) 
     {
-        // Ensure that preconditions hold
-        assert(m_port > 0);
-        assert(m_host.length() > 0);
-        assert(m_uri.length() > 0);
-        assert(m_callback != nullptr);
+        std::string key;
+        ConnectionPool::make_key(host, port, key, true);
+        m_tls.set_http2(key, is_enabled);
+    }
+#endif
 
-        // Prepare the resolve query
-        asio::ip::tcp::resolver::query resolver_query(
-            m_host, std::to_string(m_port),
-            asio::ip::tcp::resolver::query::numeric_service);
-        
-        // Check if request was cancelled
-        if (check_if_request_cancelled()) return;
+    // Writes the metrics of all threads in the Prometheus text format, e.g. 
+    // to serve them on /metrics. May be called from any thread.
+    void write_metrics(std::ostream& os) const {
+        std::vector<const ClientMetrics*> metrics;
+        for (auto& worker : m_workers)
+            metrics.push_back(&worker->metrics);
+        ClientMetrics::write_prometheus(os, metrics);
 
-        // Resolve the host name (starts asynchronous callback chain)
-        m_resolver.async_resolve(resolver_query, 
-            [this](const boost::system::error_code& ec, asio::ip::tcp::resolver::iterator iterator) {
-                on_host_name_resolved(ec, iterator);
-            });
+        os << "# HELP http_client_scheduled_requests Requests admitted and in flight, and "
+            "waiting to be admitted.\n"
+            "# TYPE http_client_scheduled_requests gauge\n"
+            "http_client_scheduled_requests{state=\"in_flight\"} " 
+            << m_scheduler.get_in_flight() << '\n'
+            << "http_client_scheduled_requests{state=\"queued\"} " 
+            << m_scheduler.get_queued() << '\n';
     }
 
-    // Cancels the GET request, stops asynchronous callback chain
-    void cancel() 
-    {
-        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux);
-        m_was_cancelled = true;
-        cancel_lock.unlock();
-
-        m_resolver.cancel();
+    void close() {
+        for (auto& worker : m_workers) {
+            // Close idle connections on the I/O thread which owns them.
+            ConnectionPool& pool = worker->pool;
+            RequestDeadlines& deadlines = worker->deadlines;
+            worker->ios.post([&pool, &deadlines]() {
+                pool.close();
+                deadlines.close();
+            });
 
-        // Finish all outstanding asynchronous operations immediately on socket.
-        // Will pass handlers operation_abort_error error code.
-        if (m_sock.is_open()) {
-            m_sock.cancel();
+            worker->work.reset(nullptr); // destroy work object
         }
+
+        for (auto& worker : m_workers)
+            worker->thread->join(); // wait for I/O threads to exit
     }
 
 private:
-    void on_host_name_resolved(const boost::system::error_code& ec, 
-        asio::ip::tcp::resolver::iterator iterator)
+    struct GetInitiation 
     {
-        // Handle any error codes
-        if (check_if_error_occurred(ec)) return;
+        template <typename Handler>
+        void operator()(Handler&& handler, const std::string& host, unsigned int port,
+            const std::string& uri) const
+        {
+            typedef GetOperation<typename std::decay<Handler>::type> Operation;
 
-        // Check if request was cancelled
-        if (check_if_request_cancelled()) return;
+            std::shared_ptr<HTTPRequest> request = client->create_request(0);
+            std::shared_ptr<Operation> operation = std::allocate_shared<Operation>(
+                asio::get_associated_allocator(handler), handler, 
+                request->m_ios.get_executor());
 
-        // Connect to the first successful endpoint via the iterator
-        asio::async_connect(m_sock, iterator, 
-            [this](const boost::system::error_code& ec, asio::ip::tcp::resolver::iterator iterator) {
-                on_connection_established(ec, iterator);
+            request->set_host(host);
+            request->set_port(port);
+            request->set_uri(uri);
+            // The operation must not hold the request, which holds it
+            request->set_callback([operation](const HTTPRequest& request, 
+                const HTTPResponse&, const boost::system::error_code& ec) {
+                operation->complete(ec, request.m_weak_self.lock());
             });
-    }
+            request->execute();
+        }
 
-    void on_connection_established(const boost::system::error_code& ec,
-        asio::ip::tcp::resolver::iterator iterator)
+        HTTPClient* client;
+    };
+
+    // An event loop and the state bound to it
+    struct Worker 
     {
-        // Handle any errors
-        if (check_if_error_occurred(ec)) return;
+        // Only this worker's thread runs the io_service
+        Worker(DNSCache& dns_cache, TLSContext& tls, RequestScheduler& scheduler,
+            ResponseCache& response_cache, RequestCoalescer& coalescer) : 
+            ios(1), pool(ios), deadlines(ios), 
+            requests(ios, pool, dns_cache, tls, scheduler, response_cache, coalescer, metrics, 
+                deadlines, retry_budget)
+        {}
 
-        // Compose the request message
-        m_request_buf += "GET " + m_uri + " HTTP/1.1\r\n";
-        // Add mandatory header
-        m_request_buf += "Host: " + m_host + "\r\n";
-        // Add final return
-        m_request_buf += "\r\n";
+        asio::io_service ios;
+        ConnectionPool pool;                    // keep-alive connections per host:port
+        ClientMetrics metrics;                  // recorded by this thread only
+        RequestDeadlines deadlines;             // timer wheel of the requests
+        RetryBudget retry_budget;               // of this thread's retries
+        RequestPool requests;                   // recycled HTTPRequest objects
+        std::unique_ptr<boost::asio::io_service::work> work;
+        std::unique_ptr<std::thread> thread;    // runs io_service event loop
+    };
 
-        // Check if request was cancelled
-        if (check_if_request_cancelled()) return;
+    // Binds the thread to one CPU so that its caches, and the connections it
+    // serves, stay on that core.
+    static void pin_thread_to_cpu(std::thread& thread, unsigned int index) 
+    {
+#if BOOST_OS_LINUX
+        unsigned int num_cpus = std::max(1u, std::thread::hardware_concurrency());
 
-        // Send the request message
-        asio::async_write(m_sock, asio::buffer(m_request_buf),
-            [this](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-                on_request_sent(ec, bytes_transferred);
-            });
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(index % num_cpus, &cpu_set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpu_set);
+#else
+        // Not supported on this platform
+        (void)thread;
+        (void)index;
+#endif
     }
 
-    void on_request_sent(const boost::system::error_code& ec, std::size_t bytes_transferred)
+private:
+    DNSCache m_dns_cache;                       // shared by all threads
+    TLSContext m_tls;                           // shared by all threads
+    RequestScheduler m_scheduler;               // shared by all threads
+    ResponseCache m_response_cache;             // shared by all threads
+    RequestCoalescer m_coalescer;               // shared by all threads
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<unsigned int> m_next_worker;    // round-robin request placement
+};
+
+// --------------------------------------------------------------------------------
+// LoadGenerator class: Drives a HTTPClient to measure the callback chain. 
+// Closed-loop keeps a fixed number of requests in flight and issues the next 
+// one as soon as one completes. Open-loop issues requests at a fixed rate, 
+// whatever the responses do, and measures each request from the time it was 
+// due rather than the time it was sent. A stall then shows in the latencies of
+// the requests it delayed instead of being hidden (coordinated omission).
+// Latencies are recorded per phase, in microseconds.
+// --------------------------------------------------------------------------------
+
+class LoadGenerator
+{
+    static const unsigned int MAX_OPEN_LOOP_IN_FLIGHT = 10000;
+
+public:
+    enum Phase 
     {
-        // Handle any errors
-        if (check_if_error_occurred(ec)) return;
+        resolve,            // started to host name resolved
+        connect,            // resolved to connection established
+        first_byte,         // request written to first byte of the response
+        body,               // first byte to response complete
+        total,              // due to response complete
+        total_sent,         // started to response complete, open-loop only
+        PHASE_COUNT
+    };
 
-        // Let server know the full request is sent by shutting down the socket.
-        m_sock.shutdown(asio::ip::tcp::socket::shutdown_send);
+    struct Options 
+    {
+        Options() : port(80), uri("/"), is_open_loop(false), concurrency(1), 
+            rate(1000.0), duration(std::chrono::seconds(10))
+        {}
 
-        // Check if request was cancelled
-        if (check_if_request_cancelled()) return;
+        std::string host;
+        unsigned int port;
+        std::string uri;
+        bool is_open_loop;
+        unsigned int concurrency;       // requests in flight, closed-loop only
+        double rate;                    // requests per second, open-loop only
+        std::chrono::steady_clock::duration duration;
+    };
 
-        // Start reading response from server, starting with the status line.
-        asio::async_read_until(m_sock, m_response.get_response_buf(), "\r\n",
-            [this](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-                on_status_line_received(ec, bytes_transferred);
-            });
+    LoadGenerator(HTTPClient& client, const Options& options) :
+        m_client(client),
+        m_options(options),
+        m_next_id(0),
+        m_in_flight(0),
+        m_failed(0),
+        m_non_2xx(0)
+    {
+        unsigned int slots = options.is_open_loop ? MAX_OPEN_LOOP_IN_FLIGHT : options.concurrency;
+        m_slots.resize(slots);
+        m_due.resize(slots);
+        for (unsigned int slot = slots; slot > 0; --slot)
+            m_free_slots.push_back(slot - 1);
     }
 
-    void on_status_line_received(const boost::system::error_code& ec,
-        std::size_t bytes_transferred)
+    // Runs the load for the configured duration and waits for the requests
+    // still in flight.
+    void run()
     {
-        // Handle any errors
-        if (check_if_error_occurred(ec)) return;
+        m_started = std::chrono::steady_clock::now();
+        m_deadline = m_started + m_options.duration;
 
-        // Parse the status line
-        std::string http_version;
-        std::string str_status_code;
-        std::string status_message;
+        if (m_options.is_open_loop)
+            run_open_loop();
+        else
+            for (unsigned int slot = 0; slot < m_options.concurrency; ++slot)
+                issue(acquire_slot(), m_started);
 
-        std::istream response_stream(&m_response.get_response_buf());
-        response_stream >> http_version; // read until space
+        std::unique_lock<std::mutex> lock(m_mux);
+        m_done.wait(lock, [this]() { return m_in_flight == 0; });
+        m_finished = std::chrono::steady_clock::now();
+    }
 
-        if (http_version != "HTTP/1.1") {
-            on_finish(http_errors::invalid_response); // response is incorrect
-            return;
-        }
+    void report(std::ostream& out) const
+    {
+        double seconds = std::chrono::duration<double>(m_finished - m_started).count();
+        std::uint64_t completed = m_phases[total].get_count();
 
-        response_stream >> str_status_code; // read until space
+        out << (m_options.is_open_loop ? "open-loop" : "closed-loop") << ": ";
+        if (m_options.is_open_loop)
+            out << m_options.rate << " req/s target";
+        else
+            out << m_options.concurrency << " in flight";
+        out << ", " << std::fixed << std::setprecision(1) << seconds << " s, "
+            << m_client.get_num_threads() << " threads, " 
+            << HTTPClient::get_event_loop_name() << "\n";
 
-        // Convert status code into integer
-        unsigned int status_code = 200;
-        try {
-            status_code = std::stoul(str_status_code); // 302 (found)
-        }
-        catch (std::logic_error&) {
-            // Response is incorrect
-            on_finish(http_errors::invalid_response);
-            return;
-        }
+        out << "requests: " << completed << " completed, " << m_failed << " failed, "
+            << m_non_2xx << " non-2xx, " << std::setprecision(1) 
+            << (seconds > 0 ? completed / seconds : 0.0) << " req/s\n";
 
-        std::getline(response_stream, status_message, '\r'); // read until '\r'
-        response_stream.get(); // Remove '\n' from buffer
-        
-        m_response.set_status_code(status_code);
-        m_response.set_status_message(status_message);
+        static const char* const names[PHASE_COUNT] = { 
+            "resolve", "connect", "first byte", "body", "total", "total (sent)" 
+        };
 
-        // Check if request was cancelled
-        if (check_if_request_cancelled()) return;
+        out << std::left << std::setw(14) << "phase (us)" << std::right 
+            << std::setw(10) << "count" << std::setw(10) << "mean"
+            << std::setw(10) << "p50" << std::setw(10) << "p90" 
+            << std::setw(10) << "p99" << std::setw(10) << "p99.9" 
+            << std::setw(10) << "max" << "\n";
 
-        // Now read the response headers. According to HTTP protocol, the response
-        // headers block ends with "\r\n\r\n" delimiter.
-        asio::async_read_until(m_sock, m_response.get_response_buf(), "\r\n\r\n",
-            [this](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-                on_headers_received(ec, bytes_transferred);
-            });
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            const LatencyHistogram& histogram = m_phases[phase];
+            if (phase == total_sent && !m_options.is_open_loop)
+                continue;
+
+            out << std::left << std::setw(14) << names[phase] << std::right
+                << std::setw(10) << histogram.get_count() 
+                << std::setw(10) << std::setprecision(0) << histogram.get_mean()
+                << std::setw(10) << histogram.value_at_percentile(50.0)
+                << std::setw(10) << histogram.value_at_percentile(90.0)
+                << std::setw(10) << histogram.value_at_percentile(99.0)
+                << std::setw(10) << histogram.value_at_percentile(99.9)
+                << std::setw(10) << histogram.get_max() << "\n";
+        }
     }
 
-    void on_headers_received(const boost::system::error_code& ec,
-        std::size_t bytes_transferred)
+private:
+    // Issues requests as they fall due. Requests that are late, because all 
+    // slots were busy or the thread was not scheduled, go out at once.
+    void run_open_loop()
     {
-        // Handle any errors
-        if (check_if_error_occurred(ec)) return;
+        auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(1.0 / m_options.rate));
+        if (interval.count() <= 0)
+            interval = std::chrono::steady_clock::duration(1);
+
+        // Sleeping wakes up late by tens of microseconds, which would count
+        // against every request, so the last stretch is spent yielding.
+        const auto spin = std::chrono::microseconds(200);
 
-        // Parse and store headers
-        std::string header, header_name, header_value;
-        std::istream response_stream(&m_response.get_response_buf());
-
-        while (true)
-        {  
-            // Headers example:
-            // "Date: Wed, 06 May 2020 01:32:00 GMT"
-            // "Server: Apache/2.4.43 (FreeBSD) OpenSSL/1.1.1d-freebsd PHP/7.4.5"
-            // "Location: https://distrowatch.com/"
-            // "Content-Length: 208"
-            // "Content-Type: text/html; charset=iso-8859-1"
-            std::getline(response_stream, header, '\r'); // Date header
-            response_stream.get(); // remove '\n' symbol
-
-            if (header == "")
-                break;
+        auto due = m_started;
+        while (due < m_deadline) {
+            std::this_thread::sleep_until(due - spin);
+            while (std::chrono::steady_clock::now() < due)
+                std::this_thread::yield();
             
-            size_t separator_pos = header.find(':');
-            if (separator_pos != std::string::npos) {
-                // Get header name
-                header_name = header.substr(0, separator_pos);
-                // Get header value
-                if (separator_pos < header.length() - 1)
-                    header_value = header.substr(separator_pos + 1);
-                else 
-                    header_value = "";
-                
-                m_response.add_header(header_name, header_value);
-            }
+            auto now = std::chrono::steady_clock::now();
+            for (; due <= now && due < m_deadline; due += interval)
+                issue(acquire_slot(), due);
         }
+    }
 
-        // Check if request was cancelled
-        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux);
-
-        if (m_was_cancelled) {
-            cancel_lock.unlock();
-            on_finish(boost::system::error_code(asio::error::operation_aborted));
-            return;
-        }
+    // Waits for a free slot
+    unsigned int acquire_slot()
+    {
+        std::unique_lock<std::mutex> lock(m_mux);
+        m_done.wait(lock, [this]() { return !m_free_slots.empty(); });
 
-        // Now we want to read the response body
-        asio::async_read(m_sock, m_response.get_response_buf(),
-            [this](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-                on_response_body_received(ec, bytes_transferred);
-            });
+        unsigned int slot = m_free_slots.back();
+        m_free_slots.pop_back();
+        ++m_in_flight;
+        return slot;
     }
 
-    void on_response_body_received(const boost::system::error_code& ec,
-        std::size_t bytes_transferred)
+    void issue(unsigned int slot, std::chrono::steady_clock::time_point due)
     {
-        if (ec == asio::error::eof)
-            on_finish(boost::system::error_code()); // response body in streambuf
-        else
-            on_finish(ec);
+        std::shared_ptr<HTTPRequest> request = m_client.create_request(m_next_id++);
+        request->set_host(m_options.host);
+        request->set_port(m_options.port);
+        request->set_uri(m_options.uri);
+        request->set_callback([this, slot](const HTTPRequest& request, 
+            const HTTPResponse& response, const system::error_code& ec) {
+                on_complete(slot, request, response, ec);
+            });
+
+        m_due[slot] = due;
+        m_slots[slot] = request;
+        request->execute();
     }
 
-    // Invokes when request completes (either successfully or not)
-    void on_finish(const boost::system::error_code& ec) 
+    // Runs on the I/O threads
+    void on_complete(unsigned int slot, const HTTPRequest& request, 
+        const HTTPResponse& response, const system::error_code& ec)
     {
-        // Handle error code (can be done in callback)
         if (ec.value() != 0) {
-            std::cout << "Error occured.\nError code: " << ec.value() 
-                << "\nMessage: " << ec.message() << std::endl;
+            ++m_failed;
+        }
+        else {
+            if (response.get_status_code() / 100 != 2)
+                ++m_non_2xx;
+            record(request.get_timings(), m_due[slot]);
+        }
+
+        // Closed-loop: the slot goes on with the next request. Replacing it 
+        // releases the finished request, which the callback may do.
+        if (!m_options.is_open_loop && std::chrono::steady_clock::now() < m_deadline) {
+            issue(slot, std::chrono::steady_clock::now());
+            return;
         }
 
-        // Invoke callback
-        m_callback(*this, m_response, ec);
+        m_slots[slot].reset();
 
-        return;
+        std::lock_guard<std::mutex> lock(m_mux);
+        m_free_slots.push_back(slot);
+        --m_in_flight;
+        m_done.notify_all();
     }
 
-    bool check_if_request_cancelled() {
-        std::unique_lock<std::mutex> cancel_lock(m_cancel_mux);
-        
-        if (m_was_cancelled) {
-            cancel_lock.unlock();
-            on_finish(boost::system::error_code(asio::error::operation_aborted));
-            return true;
-        }
+    void record(const HTTPRequest::Timings& timings, std::chrono::steady_clock::time_point due)
+    {
+        const std::chrono::steady_clock::time_point none;
 
-        cancel_lock.unlock();
-        return false;
+        if (timings.resolved != none)
+            m_phases[resolve].record(micros(timings.resolved - timings.started));
+        if (timings.connected != none)
+            m_phases[connect].record(micros(timings.connected - timings.resolved));
+        if (timings.sent != none && timings.first_byte != none)
+            m_phases[first_byte].record(micros(timings.first_byte - timings.sent));
+        if (timings.first_byte != none)
+            m_phases[body].record(micros(timings.finished - timings.first_byte));
+
+        m_phases[total].record(micros(timings.finished - std::min(due, timings.started)));
+        if (m_options.is_open_loop)
+            m_phases[total_sent].record(micros(timings.finished - timings.started));
     }
 
-    bool check_if_error_occurred(const boost::system::error_code& ec) {
-        if (ec.value() != 0) {
-            on_finish(ec);
-            return true;
-        }
-        return false;
+    static std::uint64_t micros(std::chrono::steady_clock::duration duration) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+        return us > 0 ? static_cast<std::uint64_t>(us) : 0;
     }
 
 private:
-    // Request parameters
-    std::string m_host;
-    unsigned int m_port;
-    std::string m_uri;
+    HTTPClient& m_client;
+    Options m_options;
 
-    // Object unique identifier
-    unsigned int m_id;
+    std::atomic<unsigned int> m_next_id;
+    std::vector<std::shared_ptr<HTTPRequest>> m_slots;      // requests in flight
+    std::vector<std::chrono::steady_clock::time_point> m_due;
+    std::vector<unsigned int> m_free_slots;
+    unsigned int m_in_flight;
+    std::mutex m_mux;                   // for the free slots and m_in_flight
+    std::condition_variable m_done;
 
-    // Callback to be invoked when request completes
-    Callback m_callback;
+    std::atomic<std::uint64_t> m_failed;
+    std::atomic<std::uint64_t> m_non_2xx;
+    LatencyHistogram m_phases[PHASE_COUNT];
 
-    // Buffer containing the request line
-    std::string m_request_buf;
+    std::chrono::steady_clock::time_point m_started;
+    std::chrono::steady_clock::time_point m_deadline;
+    std::chrono::steady_clock::time_point m_finished;
+};
 
-    // Structure to hold response data received from server
-    HTTPResponse m_response;
+const unsigned int LoadGenerator::MAX_OPEN_LOOP_IN_FLIGHT;
 
-    // For cancelling mechanism 
-    bool m_was_cancelled;
-    std::mutex m_cancel_mux;
+// Runs "bench closed|open host port uri concurrency|rate seconds [threads] [depth]"
+int run_benchmark(int argc, char* argv[])
+{
+    if (argc < 8) {
+        std::cerr << "usage: " << argv[0] << " bench closed <host> <port> <uri> "
+            "<concurrency> <seconds> [threads] [pipeline_depth] [socket options]\n"
+            "       " << argv[0] << " bench open <host> <port> <uri> "
+            "<rate> <seconds> [threads] [pipeline_depth] [socket options]\n"
+            "socket options: --nodelay --quickack --fastopen --rcvbuf=<bytes> "
+            "--sndbuf=<bytes> --busy-poll=<us>" << std::endl;
+        return 1;
+    }
 
-    asio::ip::tcp::socket m_sock;
-    asio::ip::tcp::resolver m_resolver;
-    asio::io_service& m_ios;
-};
+    LoadGenerator::Options options;
+    options.is_open_loop = std::string(argv[2]) == "open";
+    options.host = argv[3];
+    options.port = std::atoi(argv[4]);
+    options.uri = argv[5];
+    if (options.is_open_loop)
+        options.rate = std::atof(argv[6]);
+    else
+        options.concurrency = std::max(1, std::atoi(argv[6]));
+    options.duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(std::atof(argv[7])));
 
-// --------------------------------------------------------------------------------
-// HTTPClient: Establishes a threading policy. Spawns and destroys threads in a 
-// thread pool. Running the Boost.Asio event loop and delivering asynchronous 
-// operation's completion events. Acts as a factory of the HTTPRequest objects.
-// --------------------------------------------------------------------------------
+    // The socket options may follow the positional arguments
+    std::vector<std::string> args(argv + 8, argv + argc);
+    SocketOptions socket_options;
+    for (auto it = args.begin(); it != args.end();) {
+        const std::string& arg = *it;
+        if (arg.compare(0, 2, "--") != 0) {
+            ++it;
+            continue;
+        }
 
-class HTTPClient
+        std::string::size_type equals = arg.find('=');
+        std::string name = arg.substr(2, equals == std::string::npos ? std::string::npos : equals - 2);
+        int value = equals == std::string::npos ? 0 : std::atoi(arg.c_str() + equals + 1);
+        if (name == "nodelay")
+            socket_options.is_no_delay = true;
+        else if (name == "quickack")
+            socket_options.is_quick_ack = true;
+        else if (name == "fastopen")
+            socket_options.is_fast_open = true;
+        else if (name == "rcvbuf")
+            socket_options.receive_buffer_size = value;
+        else if (name == "sndbuf")
+            socket_options.send_buffer_size = value;
+        else if (name == "busy-poll")
+            socket_options.busy_poll_us = static_cast<unsigned int>(std::max(0, value));
+        else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return 1;
+        }
+        it = args.erase(it);
+    }
+
+    unsigned int num_threads = args.size() > 0 ? std::max(1, std::atoi(args[0].c_str())) : 1;
+    unsigned int depth = args.size() > 1 ? std::max(1, std::atoi(args[1].c_str())) : 1;
+
+    HTTPClient client(num_threads);
+    client.set_pipeline_depth(depth);
+    client.set_max_idle_per_host(options.is_open_loop ? 1024 : options.concurrency);
+    client.set_socket_options(socket_options);
+
+    LoadGenerator generator(client, options);
+    generator.run();
+    client.close();
+
+    std::cout << "socket options: ";
+    socket_options.write(std::cout);
+    std::cout << '\n';
+    generator.report(std::cout);
+    return 0;
+}
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+// Fetches a page in a coroutine, the request lives in the coroutine frame
+asio::awaitable<void> fetch(HTTPClient& client, std::string host, unsigned int port,
+    std::string uri, int& result)
 {
-public:
-    HTTPClient() {
-        m_work.reset(new boost::asio::io_service::work(m_ios));
+    try 
+    {
+        std::shared_ptr<HTTPRequest> request = 
+            co_await client.async_get(host, port, uri, asio::use_awaitable);
 
-        m_thread.reset(new std::thread([this](){
-            m_ios.run();
-        }));
+        const HTTPResponse& response = request->get_response();
+        std::cout << response.get_status_code() << ' ' << response.get_status_message() 
+            << '\n' << response.get_response().rdbuf() << std::endl;
     }
-
-    std::shared_ptr<HTTPRequest> create_request(unsigned int id) {
-        return std::shared_ptr<HTTPRequest>(new HTTPRequest(m_ios, id));
+    catch (boost::system::system_error& e)
+    {
+        std::cerr << "Request failed: " << e.code().message() << std::endl;
+        result = 1;
     }
+}
 
-    void close() {
-        m_work.reset(nullptr); // destroy work object
-        m_thread->join(); // wait for I/O thread to exit
+// Runs "get host port uri"
+int run_get(int argc, char* argv[])
+{
+    if (argc < 5) {
+        std::cerr << "usage: " << argv[0] << " get <host> <port> <uri>" << std::endl;
+        return 1;
     }
 
-private:
-    asio::io_service m_ios;
-    std::unique_ptr<boost::asio::io_service::work> m_work;
-    std::unique_ptr<std::thread> m_thread;  // runs io_service event loop
-};
+    asio::io_context ioc;
+    HTTPClient client;
+    int result = 0;
+
+    asio::co_spawn(ioc, fetch(client, argv[2], std::atoi(argv[3]), argv[4], result), 
+        asio::detached);
+    ioc.run();
+
+    client.close();
+    return result;
+}
+#endif
 
 // --------------------------------------------------------------------------------
 // The callback implementation: Called when the request completes.
@@ -529,13 +5404,23 @@ void handler(const HTTPRequest& request, const HTTPResponse& response,
 }
 
 // --------------------------------------------------------------------------------
-// main
+// main, left out with HTTP_CLIENT_NO_MAIN when the client is built into a test
 // --------------------------------------------------------------------------------
 
+#if !defined(HTTP_CLIENT_NO_MAIN)
 int main(int argc, char* argv[])
 {
     try 
     {
+        // Load-test a server instead of sending the example request
+        if (argc > 1 && std::string(argv[1]) == "bench")
+            return run_benchmark(argc, argv);
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+        if (argc > 1 && std::string(argv[1]) == "get")
+            return run_get(argc, argv);
+#endif
+
         // Spawns thread and runs I/O event loop. Is also a HTTPRequest factory. 
         HTTPClient client;
 
@@ -563,4 +5448,5 @@ int main(int argc, char* argv[])
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif // HTTP_CLIENT_NO_MAIN
@@ -0,0 +1,306 @@
+/*
+Streaming decoder for compressed message bodies (Content-Encoding).
+*/
+
+#ifndef CONTENT_DECODER_HPP
+#define CONTENT_DECODER_HPP
+
+#include "http_errors.hpp"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/utility/string_view.hpp>
+#include <cassert>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+
+// The codecs are optional, define HTTP_WITH_ZLIB (link with -lz) for gzip and
+// deflate, and HTTP_WITH_BROTLI (link with -lbrotlidec) for br.
+#if defined(HTTP_WITH_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(HTTP_WITH_BROTLI)
+#include <brotli/decode.h>
+#endif
+
+// --------------------------------------------------------------------------------
+// ContentDecoder class: Decompresses a body as it arrives, in pieces of any size,
+// appending at most a given number of decoded bytes per call so that a small
+// body cannot expand without bound in memory. The codec state is kept and reset
+// between bodies, so a recycled decoder does not allocate again for zlib.
+// --------------------------------------------------------------------------------
+
+class ContentDecoder
+{
+public:
+    enum class Coding
+    {
+        identity,           // not encoded
+        gzip,
+        deflate,            // zlib format, or raw deflate as some servers send
+        br,                 // Brotli
+        unsupported         // unknown, or several codings applied
+    };
+
+    ContentDecoder() : 
+        m_coding(Coding::identity), 
+        m_is_done(false), 
+        m_has_pending_output(false)
+    {
+#if defined(HTTP_WITH_ZLIB)
+        m_is_zlib_initialized = false;
+#endif
+#if defined(HTTP_WITH_BROTLI)
+        m_brotli = nullptr;
+#endif
+    }
+
+    ContentDecoder(const ContentDecoder&) = delete;
+    ContentDecoder& operator=(const ContentDecoder&) = delete;
+
+    ~ContentDecoder() {
+#if defined(HTTP_WITH_ZLIB)
+        if (m_is_zlib_initialized)
+            inflateEnd(&m_zlib);
+#endif
+#if defined(HTTP_WITH_BROTLI)
+        if (m_brotli)
+            BrotliDecoderDestroyInstance(m_brotli);
+#endif
+    }
+
+    // The Accept-Encoding header line for the codings compiled in, or an
+    // empty string if there are none.
+    static boost::string_view get_accept_encoding()
+    {
+#if defined(HTTP_WITH_ZLIB) && defined(HTTP_WITH_BROTLI)
+        return "Accept-Encoding: gzip, deflate, br\r\n";
+#elif defined(HTTP_WITH_ZLIB)
+        return "Accept-Encoding: gzip, deflate\r\n";
+#elif defined(HTTP_WITH_BROTLI)
+        return "Accept-Encoding: br\r\n";
+#else
+        return boost::string_view();
+#endif
+    }
+
+    static Coding parse_coding(boost::string_view value)
+    {
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+            value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+            value.remove_suffix(1);
+
+        if (value.empty() || iequals(value, "identity"))
+            return Coding::identity;
+        if (iequals(value, "gzip") || iequals(value, "x-gzip"))
+            return Coding::gzip;
+        if (iequals(value, "deflate"))
+            return Coding::deflate;
+        if (iequals(value, "br"))
+            return Coding::br;
+        return Coding::unsupported;
+    }
+
+    static bool is_supported(Coding coding)
+    {
+        switch (coding) {
+        case Coding::identity:
+            return true;
+#if defined(HTTP_WITH_ZLIB)
+        case Coding::gzip:
+        case Coding::deflate:
+            return true;
+#endif
+#if defined(HTTP_WITH_BROTLI)
+        case Coding::br:
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    // Starts decoding a new body, the coding must be supported.
+    void reset(Coding coding)
+    {
+        assert(is_supported(coding));
+        m_coding = coding;
+        m_is_done = coding == Coding::identity;
+        m_has_pending_output = false;
+        m_is_format_known = coding != Coding::deflate;
+
+#if defined(HTTP_WITH_BROTLI)
+        if (m_brotli) {
+            BrotliDecoderDestroyInstance(m_brotli);
+            m_brotli = nullptr;
+        }
+#endif
+#if defined(HTTP_WITH_ZLIB)
+        if (coding == Coding::gzip)
+            start_zlib(16 + MAX_WINDOW_BITS);
+#endif
+    }
+
+    bool is_active() const { return m_coding != Coding::identity; }
+
+    // True once the end of the compressed stream has been decoded
+    bool is_done() const { return m_is_done; }
+
+    // The last call filled max_out and the codec may hold more decoded data,
+    // call again even if there is no more input.
+    bool has_pending_output() const { return m_has_pending_output; }
+
+    // Decodes up to size bytes, appending at most max_out decoded bytes to
+    // body. Returns the number of bytes consumed; call again with the rest
+    // once the output has been used. Bytes after the end of the compressed
+    // stream are consumed and ignored. Sets ec if the data cannot be decoded.
+    std::size_t decode(const char* data, std::size_t size, boost::asio::streambuf& body,
+        std::size_t max_out, boost::system::error_code& ec)
+    {
+        if (m_is_done)
+            return size;
+
+        switch (m_coding)
+        {
+#if defined(HTTP_WITH_ZLIB)
+        case Coding::gzip:
+        case Coding::deflate:
+            return decode_zlib(data, size, body, max_out, ec);
+#endif
+#if defined(HTTP_WITH_BROTLI)
+        case Coding::br:
+            return decode_brotli(data, size, body, max_out, ec);
+#endif
+        default:
+            (void)data;
+            (void)body;
+            (void)max_out;
+            ec = http_errors::invalid_content_encoding;
+            return 0;
+        }
+    }
+
+private:
+    static bool iequals(boost::string_view a, boost::string_view b)
+    {
+        if (a.size() != b.size()) return false;
+        for (std::size_t i = 0; i < a.size(); ++i)
+            if (std::tolower(static_cast<unsigned char>(a[i])) != b[i])
+                return false;
+        return true;
+    }
+
+#if defined(HTTP_WITH_ZLIB)
+    static const int MAX_WINDOW_BITS = 15;
+
+    void start_zlib(int window_bits)
+    {
+        if (m_is_zlib_initialized) {
+            inflateReset2(&m_zlib, window_bits);
+            return;
+        }
+
+        m_zlib.zalloc = Z_NULL;
+        m_zlib.zfree = Z_NULL;
+        m_zlib.opaque = Z_NULL;
+        m_zlib.next_in = Z_NULL;
+        m_zlib.avail_in = 0;
+        m_is_zlib_initialized = inflateInit2(&m_zlib, window_bits) == Z_OK;
+    }
+
+    std::size_t decode_zlib(const char* data, std::size_t size, boost::asio::streambuf& body,
+        std::size_t max_out, boost::system::error_code& ec)
+    {
+        // "deflate" is meant to be the zlib format, but some servers send raw
+        // deflate data. A zlib stream starts with a header whose first two
+        // bytes, read as a big-endian number, are a multiple of 31.
+        if (!m_is_format_known) {
+            if (size == 0) return 0;
+            unsigned char cmf = static_cast<unsigned char>(data[0]);
+            bool is_zlib = (cmf & 0x0f) == 8;
+            if (is_zlib && size > 1)
+                is_zlib = ((cmf << 8) | static_cast<unsigned char>(data[1])) % 31 == 0;
+            start_zlib(is_zlib ? MAX_WINDOW_BITS : -MAX_WINDOW_BITS);
+            m_is_format_known = true;
+        }
+        if (!m_is_zlib_initialized) {
+            ec = http_errors::invalid_content_encoding;
+            return 0;
+        }
+
+        boost::asio::mutable_buffer out = body.prepare(max_out);
+        m_zlib.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        m_zlib.avail_in = static_cast<uInt>(size);
+        m_zlib.next_out = static_cast<Bytef*>(out.data());
+        m_zlib.avail_out = static_cast<uInt>(out.size());
+
+        int result = inflate(&m_zlib, Z_NO_FLUSH);
+        body.commit(out.size() - m_zlib.avail_out);
+        m_has_pending_output = m_zlib.avail_out == 0;
+
+        if (result == Z_STREAM_END) {
+            m_is_done = true;
+            m_has_pending_output = false;
+            return size;
+        }
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            ec = http_errors::invalid_content_encoding;
+            return 0;
+        }
+        return size - m_zlib.avail_in;
+    }
+#endif
+
+#if defined(HTTP_WITH_BROTLI)
+    std::size_t decode_brotli(const char* data, std::size_t size, boost::asio::streambuf& body,
+        std::size_t max_out, boost::system::error_code& ec)
+    {
+        // There is no way to reset a Brotli decoder, one is created per body
+        if (!m_brotli)
+            m_brotli = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+        if (!m_brotli) {
+            ec = http_errors::invalid_content_encoding;
+            return 0;
+        }
+
+        boost::asio::mutable_buffer out = body.prepare(max_out);
+        std::size_t avail_in = size;
+        const std::uint8_t* next_in = reinterpret_cast<const std::uint8_t*>(data);
+        std::size_t avail_out = out.size();
+        std::uint8_t* next_out = static_cast<std::uint8_t*>(out.data());
+
+        BrotliDecoderResult result = BrotliDecoderDecompressStream(m_brotli,
+            &avail_in, &next_in, &avail_out, &next_out, nullptr);
+        body.commit(out.size() - avail_out);
+        m_has_pending_output = result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT;
+
+        if (result == BROTLI_DECODER_RESULT_SUCCESS) {
+            m_is_done = true;
+            return size;
+        }
+        if (result == BROTLI_DECODER_RESULT_ERROR) {
+            ec = http_errors::invalid_content_encoding;
+            return 0;
+        }
+        return size - avail_in;
+    }
+#endif
+
+private:
+    Coding m_coding;
+    bool m_is_done;                     // end of the compressed stream seen
+    bool m_has_pending_output;          // output was limited by max_out
+    bool m_is_format_known;             // zlib or raw deflate, decided on the first bytes
+
+#if defined(HTTP_WITH_ZLIB)
+    z_stream m_zlib;
+    bool m_is_zlib_initialized;
+#endif
+#if defined(HTTP_WITH_BROTLI)
+    BrotliDecoderState* m_brotli;
+#endif
+};
+
+#endif // CONTENT_DECODER_HPP
@@ -0,0 +1,288 @@
+/*
+Writes a message body straight to a file, without holding it in memory.
+*/
+
+#ifndef FILE_SINK_HPP
+#define FILE_SINK_HPP
+
+#include <boost/predef.h>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/system/error_code.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if !BOOST_OS_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// --------------------------------------------------------------------------------
+// FileSink class: A file a body is written to as it arrives. A file whose size
+// is known is allocated up front and can be written through a memory map, so
+// data is read from the socket straight into the page cache. The map covers a
+// window of the file at a time, so a body of several gigabytes does not take
+// as much address space and resident memory. On Linux data can also be moved
+// from a socket with splice() without being copied to user space at all. The
+// pipe used for that is kept when the sink is reused. POSIX only, opening a
+// file elsewhere fails with operation_not_supported.
+// --------------------------------------------------------------------------------
+
+class FileSink
+{
+    static const std::size_t MAP_WINDOW_SIZE = 64 * 1024 * 1024;   // a multiple of the page size
+    static const int PIPE_SIZE = 1024 * 1024;                       // asked for, the system may limit it
+
+public:
+    FileSink() :
+        m_fd(-1),
+        m_size(0),
+        m_capacity(0),
+        m_map(nullptr),
+        m_map_offset(0),
+        m_map_size(0),
+        m_pipe_size(0)
+    {
+        m_pipe[0] = m_pipe[1] = -1;
+    }
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    ~FileSink() {
+        boost::system::error_code ignored_ec;
+        close(ignored_ec);
+        close_pipe();
+    }
+
+    // Creates or truncates the file at path. A size other than zero is
+    // allocated, and can then be written through prepare() and commit().
+    void open(const std::string& path, std::uint64_t size, boost::system::error_code& ec)
+    {
+        boost::system::error_code ignored_ec;
+        close(ignored_ec);
+
+#if BOOST_OS_WINDOWS
+        (void)path;
+        (void)size;
+        ec = boost::asio::error::operation_not_supported;
+#else
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (m_fd < 0) {
+            set_error(ec);
+            return;
+        }
+        if (size == 0)
+            return;
+
+        // Reserving the blocks also means that running out of space fails
+        // here, rather than with SIGBUS on writing to the map.
+#if BOOST_OS_LINUX
+        int result = ::posix_fallocate(m_fd, 0, static_cast<off_t>(size));
+#else
+        int result = ::ftruncate(m_fd, static_cast<off_t>(size)) == 0 ? 0 : errno;
+#endif
+        if (result != 0) {
+            ec.assign(result, boost::system::system_category());
+            close(ignored_ec);
+            return;
+        }
+        m_capacity = size;
+#endif
+    }
+
+    bool is_open() const { return m_fd >= 0; }
+
+    // Bytes written so far
+    std::uint64_t get_size() const { return m_size; }
+
+    void write(const char* data, std::size_t size, boost::system::error_code& ec)
+    {
+#if BOOST_OS_WINDOWS
+        (void)data;
+        (void)size;
+        ec = boost::asio::error::operation_not_supported;
+#else
+        // Into the map while it lasts, so the two do not overlap
+        while (size > 0 && m_size < m_capacity) {
+            boost::asio::mutable_buffer out = prepare(size, ec);
+            if (ec) return;
+            std::memcpy(out.data(), data, out.size());
+            commit(out.size());
+            data += out.size();
+            size -= out.size();
+        }
+
+        while (size > 0) {
+            ssize_t written = ::pwrite(m_fd, data, size, static_cast<off_t>(m_size));
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                set_error(ec);
+                return;
+            }
+            m_size += static_cast<std::uint64_t>(written);
+            data += written;
+            size -= static_cast<std::size_t>(written);
+        }
+#endif
+    }
+
+    // The file's memory following what has been written, at most max_size
+    // bytes and empty once the allocated size has been written. Data put
+    // there is written by commit().
+    boost::asio::mutable_buffer prepare(std::size_t max_size, boost::system::error_code& ec)
+    {
+#if BOOST_OS_WINDOWS
+        (void)max_size;
+        ec = boost::asio::error::operation_not_supported;
+        return boost::asio::mutable_buffer();
+#else
+        if (m_size >= m_capacity)
+            return boost::asio::mutable_buffer();
+
+        if (!m_map || m_size >= m_map_offset + m_map_size) {
+            unmap();
+
+            // Windows start at multiples of their size, so are page aligned
+            std::uint64_t offset = m_size - m_size % MAP_WINDOW_SIZE;
+            std::uint64_t window_size = MAP_WINDOW_SIZE;
+            std::size_t map_size = static_cast<std::size_t>(
+                std::min(window_size, m_capacity - offset));
+            void* map = ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                m_fd, static_cast<off_t>(offset));
+            if (map == MAP_FAILED) {
+                set_error(ec);
+                return boost::asio::mutable_buffer();
+            }
+            m_map = static_cast<char*>(map);
+            m_map_offset = offset;
+            m_map_size = map_size;
+        }
+
+        std::size_t offset = static_cast<std::size_t>(m_size - m_map_offset);
+        return boost::asio::buffer(m_map + offset, std::min(max_size, m_map_size - offset));
+#endif
+    }
+
+    void commit(std::size_t size) {
+        m_size += size;
+    }
+
+#if BOOST_OS_LINUX
+    // Moves at most max_size bytes from the non-blocking descriptor fd, a
+    // socket, to the end of the file through a pipe. Returns the number of
+    // bytes moved; ec is would_block if none are available and eof once the
+    // peer has closed.
+    std::size_t splice_from(int fd, std::size_t max_size, boost::system::error_code& ec)
+    {
+        if (m_pipe[0] < 0) {
+            if (::pipe2(m_pipe, O_CLOEXEC) != 0) {
+                set_error(ec);
+                return 0;
+            }
+            ::fcntl(m_pipe[1], F_SETPIPE_SZ, PIPE_SIZE); // at the default size if not allowed
+            m_pipe_size = static_cast<std::size_t>(std::max(::fcntl(m_pipe[1], F_GETPIPE_SZ), 4096));
+        }
+
+        ssize_t moved;
+        do {
+            moved = ::splice(fd, nullptr, m_pipe[1], nullptr, std::min(max_size, m_pipe_size),
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (moved < 0 && errno == EINTR);
+
+        if (moved < 0) {
+            set_error(ec);
+            return 0;
+        }
+        if (moved == 0) {
+            ec = boost::asio::error::eof;
+            return 0;
+        }
+
+        // The pipe is emptied each time, so it holds nothing between calls
+        std::size_t left = static_cast<std::size_t>(moved);
+        while (left > 0) {
+            loff_t offset = static_cast<loff_t>(m_size);
+            ssize_t written = ::splice(m_pipe[0], nullptr, m_fd, &offset, left, SPLICE_F_MOVE);
+            if (written <= 0) {
+                if (written < 0 && errno == EINTR) continue;
+                if (written < 0)
+                    set_error(ec);
+                else
+                    ec = boost::asio::error::broken_pipe;
+                close_pipe(); // may still hold data
+                return 0;
+            }
+            m_size += static_cast<std::uint64_t>(written);
+            left -= static_cast<std::size_t>(written);
+        }
+        return static_cast<std::size_t>(moved);
+    }
+#endif
+
+    // Unmaps and closes the file. What was allocated but not written, as
+    // when the body was cut short, is dropped.
+    void close(boost::system::error_code& ec)
+    {
+#if !BOOST_OS_WINDOWS
+        if (m_fd < 0) return;
+
+        unmap();
+        if (m_capacity > m_size && ::ftruncate(m_fd, static_cast<off_t>(m_size)) != 0)
+            set_error(ec);
+        if (::close(m_fd) != 0 && !ec)
+            set_error(ec);
+#else
+        (void)ec;
+#endif
+        m_fd = -1;
+        m_size = 0;
+        m_capacity = 0;
+    }
+
+private:
+#if !BOOST_OS_WINDOWS
+    void unmap()
+    {
+        if (!m_map) return;
+
+        ::munmap(m_map, m_map_size);
+        m_map = nullptr;
+        m_map_offset = 0;
+        m_map_size = 0;
+    }
+
+    static void set_error(boost::system::error_code& ec) {
+        ec.assign(errno, boost::system::system_category());
+    }
+#endif
+
+    void close_pipe()
+    {
+#if !BOOST_OS_WINDOWS
+        for (int& fd : m_pipe) {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+private:
+    int m_fd;
+    std::uint64_t m_size;               // bytes written
+    std::uint64_t m_capacity;           // bytes allocated, written through the map
+    char* m_map;                        // window of the file being written
+    std::uint64_t m_map_offset;
+    std::size_t m_map_size;
+    int m_pipe[2];                      // for splice(), read and write ends
+    std::size_t m_pipe_size;
+};
+
+#endif // FILE_SINK_HPP
@@ -0,0 +1,114 @@
+/*
+Handler memory reuse for the asynchronous operations of a chain.
+*/
+
+#ifndef HANDLER_ALLOC_HPP
+#define HANDLER_ALLOC_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// --------------------------------------------------------------------------------
+// HandlerMemory class: A block of memory reused for the asynchronous operations 
+// of one chain. Asio allocates the state of every operation it starts through 
+// the handler's associated allocator; handlers wrapped by make_alloc_handler()
+// take that memory from here instead of the heap. A chain has one operation 
+// outstanding at a time, anything else falls back to operator new.
+// --------------------------------------------------------------------------------
+
+class HandlerMemory
+{
+public:
+    HandlerMemory() : m_in_use(false)
+    {}
+
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(std::size_t size) {
+        if (!m_in_use && size <= sizeof(m_storage)) {
+            m_in_use = true;
+            return &m_storage;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer) {
+        if (pointer == &m_storage)
+            m_in_use = false;
+        else
+            ::operator delete(pointer);
+    }
+
+private:
+    // Large enough for the composed read and write operations
+    typename std::aligned_storage<1024>::type m_storage;
+    bool m_in_use;
+};
+
+// The allocator associated with handlers that use a HandlerMemory
+template <typename T>
+class HandlerAllocator
+{
+    template <typename> friend class HandlerAllocator;
+
+public:
+    typedef T value_type;
+
+    explicit HandlerAllocator(HandlerMemory& memory) : m_memory(&memory)
+    {}
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) : m_memory(other.m_memory)
+    {}
+
+    T* allocate(std::size_t n) const {
+        return static_cast<T*>(m_memory->allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* pointer, std::size_t) const {
+        m_memory->deallocate(pointer);
+    }
+
+    bool operator==(const HandlerAllocator& other) const { return m_memory == other.m_memory; }
+    bool operator!=(const HandlerAllocator& other) const { return m_memory != other.m_memory; }
+
+private:
+    HandlerMemory* m_memory;
+};
+
+// Wraps a handler so that its operations are allocated from a HandlerMemory
+template <typename Handler>
+class AllocHandler
+{
+public:
+    typedef HandlerAllocator<Handler> allocator_type;
+
+    AllocHandler(HandlerMemory& memory, Handler handler) :
+        m_memory(memory), 
+        m_handler(std::move(handler))
+    {}
+
+    allocator_type get_allocator() const {
+        return allocator_type(m_memory);
+    }
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        m_handler(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory& m_memory;
+    Handler m_handler;
+};
+
+template <typename Handler>
+inline AllocHandler<Handler> make_alloc_handler(HandlerMemory& memory, Handler handler)
+{
+    return AllocHandler<Handler>(memory, std::move(handler));
+}
+
+#endif // HANDLER_ALLOC_HPP
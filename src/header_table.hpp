@@ -0,0 +1,358 @@
+/*
+Flat, case-insensitive storage for the header fields of a HTTP message.
+*/
+
+#ifndef HEADER_TABLE_HPP
+#define HEADER_TABLE_HPP
+
+#include "http_parser.hpp"
+
+#include <boost/utility/string_view.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+// --------------------------------------------------------------------------------
+// HeaderTable class: Flat storage for the headers of a message. Names and values
+// are copied into one contiguous buffer and indexed by a small vector with inline
+// room for the common number of headers, so storing a typical message's headers
+// costs no allocation once the buffer has grown. Lookups are case insensitive and
+// well-known header names are interned so finding them is O(1). Interning takes
+// one comparison: names are placed in a table by a hash of their length and
+// first and last letters, which is checked at compile time to be collision free.
+// --------------------------------------------------------------------------------
+
+enum class KnownHeader 
+{
+    content_length,
+    transfer_encoding,
+    connection,
+    content_type,
+    content_encoding,
+    cache_control,
+    etag,
+    last_modified,
+    expires,
+    age,
+    date,
+    location,
+    set_cookie,
+    keep_alive,
+    vary,
+    server,
+    host,
+    unknown         // not interned, must be last
+};
+
+// The names of KnownHeader, in its order
+constexpr const char* KNOWN_HEADER_NAMES[] = {
+    "Content-Length", "Transfer-Encoding", "Connection", "Content-Type",
+    "Content-Encoding", "Cache-Control", "ETag", "Last-Modified", "Expires",
+    "Age", "Date", "Location", "Set-Cookie", "Keep-Alive", "Vary", "Server",
+    "Host"
+};
+
+constexpr std::size_t KNOWN_HEADER_SLOTS = 32;
+
+// The slot of a name of at least one character, ignoring case
+constexpr std::size_t known_header_slot(const char* name, std::size_t size) {
+    return (5 * size + 5 * static_cast<unsigned char>(name[0] | 0x20) 
+        + 7 * static_cast<unsigned char>(name[size - 1] | 0x20)) % KNOWN_HEADER_SLOTS;
+}
+
+// The header that may be in each slot; the names are compared to confirm
+constexpr KnownHeader KNOWN_HEADER_TABLE[KNOWN_HEADER_SLOTS] = {
+    KnownHeader::unknown, KnownHeader::expires, KnownHeader::unknown, 
+    KnownHeader::connection, KnownHeader::cache_control, KnownHeader::unknown, 
+    KnownHeader::location, KnownHeader::unknown, KnownHeader::host, 
+    KnownHeader::unknown, KnownHeader::transfer_encoding, KnownHeader::date, 
+    KnownHeader::keep_alive, KnownHeader::content_length, KnownHeader::content_type, 
+    KnownHeader::unknown, KnownHeader::content_encoding, KnownHeader::vary, 
+    KnownHeader::unknown, KnownHeader::unknown, KnownHeader::set_cookie, 
+    KnownHeader::unknown, KnownHeader::unknown, KnownHeader::age, 
+    KnownHeader::unknown, KnownHeader::last_modified, KnownHeader::unknown, 
+    KnownHeader::server, KnownHeader::unknown, KnownHeader::unknown, 
+    KnownHeader::etag, KnownHeader::unknown
+};
+
+constexpr std::size_t constexpr_strlen(const char* s) {
+    return *s == '\0' ? 0 : 1 + constexpr_strlen(s + 1);
+}
+
+// Whether every name from index on is found in its slot, and so no two share one
+constexpr bool is_known_header_table_valid(std::size_t index) {
+    return index == static_cast<std::size_t>(KnownHeader::unknown) 
+        || (KNOWN_HEADER_TABLE[known_header_slot(KNOWN_HEADER_NAMES[index], 
+                constexpr_strlen(KNOWN_HEADER_NAMES[index]))] == static_cast<KnownHeader>(index)
+            && is_known_header_table_valid(index + 1));
+}
+
+static_assert(sizeof(KNOWN_HEADER_NAMES) / sizeof(KNOWN_HEADER_NAMES[0]) 
+    == static_cast<std::size_t>(KnownHeader::unknown), "a name for each KnownHeader");
+static_assert(is_known_header_table_valid(0), 
+    "KNOWN_HEADER_TABLE must match known_header_slot()");
+
+class HeaderTable
+{
+    static const std::size_t INLINE_CAPACITY = 16;
+    static const std::size_t KNOWN_COUNT = static_cast<std::size_t>(KnownHeader::unknown);
+    static const std::size_t NOT_FOUND = static_cast<std::size_t>(-1);
+
+    // A header is stored as offsets into the buffer, which may be reallocated
+    struct Entry 
+    {
+        std::uint32_t name_offset;
+        std::uint32_t name_length;
+        std::uint32_t value_offset;
+        std::uint32_t value_length;
+    };
+
+public:
+    // Iterates the headers in the order they were received
+    class const_iterator
+    {
+    public:
+        const_iterator(const HeaderTable* table, std::size_t index) : 
+            m_table(table), m_index(index)
+        {}
+
+        HeaderField operator*() const { return m_table->field(m_index); }
+        const_iterator& operator++() { ++m_index; return *this; }
+        bool operator==(const const_iterator& other) const { return m_index == other.m_index; }
+        bool operator!=(const const_iterator& other) const { return m_index != other.m_index; }
+
+    private:
+        const HeaderTable* m_table;
+        std::size_t m_index;
+    };
+
+    HeaderTable() {
+        clear();
+    }
+
+    void clear() {
+        m_size = 0;
+        m_data.clear();         // buffers keep their capacity for the next message
+        m_overflow.clear();
+        // Copied so the constant needs no out-of-class definition
+        std::fill(m_known, m_known + KNOWN_COUNT, std::size_t(NOT_FOUND));
+    }
+
+    std::size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, m_size); }
+
+    HeaderField field(std::size_t index) const {
+        const Entry& e = entry(index);
+        return HeaderField{ 
+            boost::string_view(m_data.data() + e.name_offset, e.name_length),
+            boost::string_view(m_data.data() + e.value_offset, e.value_length) };
+    }
+
+    // Appends a header. Repeated headers, e.g. Set-Cookie, are all kept.
+    void add(boost::string_view name, boost::string_view value)
+    {
+        Entry e;
+        e.name_offset = static_cast<std::uint32_t>(m_data.size());
+        e.name_length = static_cast<std::uint32_t>(name.size());
+        m_data.append(name.data(), name.size());
+        e.value_offset = static_cast<std::uint32_t>(m_data.size());
+        e.value_length = static_cast<std::uint32_t>(value.size());
+        m_data.append(value.data(), value.size());
+
+        if (m_size < INLINE_CAPACITY)
+            m_inline[m_size] = e;
+        else
+            m_overflow.push_back(e);
+
+        // Remember the first occurrence of well-known headers
+        KnownHeader id = intern(name);
+        if (id != KnownHeader::unknown && m_known[static_cast<std::size_t>(id)] == NOT_FOUND)
+            m_known[static_cast<std::size_t>(id)] = m_size;
+
+        ++m_size;
+    }
+
+    // Finds the first header with the given name. Returns false if absent.
+    bool find(KnownHeader id, boost::string_view& value) const 
+    {
+        if (id == KnownHeader::unknown)
+            return false;
+
+        std::size_t index = m_known[static_cast<std::size_t>(id)];
+        if (index == NOT_FOUND)
+            return false;
+
+        value = field(index).value;
+        return true;
+    }
+
+    bool find(boost::string_view name, boost::string_view& value) const 
+    {
+        KnownHeader id = intern(name);
+        if (id != KnownHeader::unknown)
+            return find(id, value);
+
+        for (std::size_t i = 0; i < m_size; ++i) {
+            HeaderField f = field(i);
+            if (iequals(f.name, name)) {
+                value = f.value;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool contains(KnownHeader id) const {
+        boost::string_view ignored;
+        return find(id, ignored);
+    }
+
+    bool contains(boost::string_view name) const {
+        boost::string_view ignored;
+        return find(name, ignored);
+    }
+
+    // Maps a header name to its interned identifier, ignoring case.
+    static KnownHeader intern(boost::string_view name)
+    {
+        if (name.empty())
+            return KnownHeader::unknown;
+
+        KnownHeader id = KNOWN_HEADER_TABLE[known_header_slot(name.data(), name.size())];
+        if (id == KnownHeader::unknown 
+            || !iequals(name, KNOWN_HEADER_NAMES[static_cast<std::size_t>(id)]))
+            return KnownHeader::unknown;
+        return id;
+    }
+
+    static bool iequals(boost::string_view a, boost::string_view b)
+    {
+        if (a.size() != b.size())
+            return false;
+
+        // Header names are ASCII, no locale is consulted
+        for (std::size_t i = 0; i < a.size(); ++i)
+            if (to_lower(a[i]) != to_lower(b[i]))
+                return false;
+
+        return true;
+    }
+
+    static char to_lower(char c) {
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c + ('a' - 'A')) : c;
+    }
+
+    // The body length given by the Content-Length headers. Returns false if
+    // there is none. Sets is_valid to false if one is not a number or they 
+    // differ, as the message could then be framed differently elsewhere.
+    bool find_content_length(std::size_t& length, bool& is_valid) const
+    {
+        std::size_t first = m_known[static_cast<std::size_t>(KnownHeader::content_length)];
+        if (first == NOT_FOUND)
+            return false;
+
+        is_valid = parse_content_length(field(first).value, length);
+        for (std::size_t i = first + 1; i < m_size && is_valid; ++i) {
+            HeaderField f = field(i);
+            std::size_t other = 0;
+            if (iequals(f.name, "Content-Length"))
+                is_valid = parse_content_length(f.value, other) && other == length;
+        }
+        return true;
+    }
+
+    // The last Transfer-Encoding header, whose final coding is the one the
+    // body framing depends on, and the number of such headers. Returns false
+    // if there is none.
+    bool find_transfer_encoding(boost::string_view& last, std::size_t& count) const
+    {
+        std::size_t first = m_known[static_cast<std::size_t>(KnownHeader::transfer_encoding)];
+        if (first == NOT_FOUND)
+            return false;
+
+        last = field(first).value;
+        count = 1;
+        for (std::size_t i = first + 1; i < m_size; ++i) {
+            HeaderField f = field(i);
+            if (iequals(f.name, "Transfer-Encoding")) {
+                last = f.value;
+                ++count;
+            }
+        }
+        return true;
+    }
+
+    // Content-Length must be a plain decimal number.
+    static bool parse_content_length(boost::string_view value, std::size_t& length)
+    {
+        std::size_t begin = value.find_first_not_of(" \t");
+        std::size_t end = value.find_last_not_of(" \t");
+        if (begin == boost::string_view::npos)
+            return false;
+
+        length = 0;
+        for (std::size_t i = begin; i <= end; ++i) {
+            if (value[i] < '0' || value[i] > '9')
+                return false;
+            
+            std::size_t digit = value[i] - '0';
+            if (length > (std::numeric_limits<std::size_t>::max() - digit) / 10)
+                return false; // overflow
+            length = length * 10 + digit;
+        }
+
+        return true;
+    }
+
+    // Checks whether chunked is the final transfer coding applied, e.g. 
+    // "gzip, chunked".
+    static bool is_chunked(boost::string_view transfer_encoding)
+    {
+        std::size_t comma = transfer_encoding.rfind(',');
+        boost::string_view last_coding = (comma == boost::string_view::npos) 
+            ? transfer_encoding : transfer_encoding.substr(comma + 1);
+        return iequals_trimmed(last_coding, "chunked");
+    }
+
+    // Case insensitive comparison ignoring surrounding whitespace.
+    static bool iequals_trimmed(boost::string_view value, const char* expected) 
+    {
+        std::size_t begin = value.find_first_not_of(" \t");
+        std::size_t end = value.find_last_not_of(" \t");
+        if (begin == boost::string_view::npos)
+            return *expected == '\0';
+
+        return iequals(value.substr(begin, end - begin + 1), expected);
+    }
+
+private:
+    const Entry& entry(std::size_t index) const {
+        return index < INLINE_CAPACITY ? m_inline[index] : m_overflow[index - INLINE_CAPACITY];
+    }
+
+private:
+    std::size_t m_size;
+    Entry m_inline[INLINE_CAPACITY];        // the first headers
+    std::vector<Entry> m_overflow;          // headers beyond the inline capacity
+    std::string m_data;                     // names and values back to back
+    std::size_t m_known[KNOWN_COUNT];       // index of first well-known header
+};
+
+// --------------------------------------------------------------------------------
+// KnownFields struct: A field policy of ResponseHeadParser that keeps the headers
+// of KnownHeader and skips all others, for servers whose responses carry nothing
+// else of interest. Skipped headers are checked but never stored.
+// --------------------------------------------------------------------------------
+
+struct KnownFields
+{
+    static bool is_kept(boost::string_view name) {
+        return HeaderTable::intern(name) != KnownHeader::unknown;
+    }
+};
+
+#endif // HEADER_TABLE_HPP
@@ -0,0 +1,224 @@
+/*
+Latency histogram with HDR-style log-linear buckets, and a window of the latest
+latencies.
+*/
+
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// --------------------------------------------------------------------------------
+// LatencyHistogram class: Counts values, e.g. latencies in microseconds, in
+// buckets laid out like an HdrHistogram with 3 significant digits. Values
+// below 2048 have a bucket each; above that every power of two is split into
+// 1024 buckets, so a value is reported to within 0.1%. Recording is a single
+// relaxed atomic increment, so any thread may record without locking.
+// --------------------------------------------------------------------------------
+
+class LatencyHistogram
+{
+    static const unsigned int SUB_BUCKET_BITS = 11;                 // 2048 exact values
+    static const std::uint64_t SUB_BUCKET_COUNT = 1ull << SUB_BUCKET_BITS;
+    static const std::uint64_t SUB_BUCKET_HALF = SUB_BUCKET_COUNT / 2;
+    static const unsigned int MAX_EXPONENT = 63 - SUB_BUCKET_BITS + 1;
+
+public:
+    LatencyHistogram() :
+        m_counts(SUB_BUCKET_COUNT + MAX_EXPONENT * SUB_BUCKET_HALF),
+        m_total(0),
+        m_sum(0),
+        m_max(0)
+    {}
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(std::uint64_t value)
+    {
+        m_counts[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+        m_total.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+
+        std::uint64_t max = m_max.load(std::memory_order_relaxed);
+        while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+            ;
+    }
+
+    // Records a value measured by a loop that waits for each operation to
+    // complete before starting the next, adding the values that operations
+    // stalled behind it would have seen (coordinated omission correction).
+    void record_corrected(std::uint64_t value, std::uint64_t expected_interval)
+    {
+        record(value);
+        if (expected_interval == 0)
+            return;
+
+        for (std::uint64_t missed = value; missed > expected_interval; ) {
+            missed -= expected_interval;
+            record(missed);
+        }
+    }
+
+    void reset()
+    {
+        for (auto& count : m_counts)
+            count.store(0, std::memory_order_relaxed);
+        m_total.store(0, std::memory_order_relaxed);
+        m_sum.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+
+    std::uint64_t get_count() const { return m_total.load(std::memory_order_relaxed); }
+    std::uint64_t get_sum() const { return m_sum.load(std::memory_order_relaxed); }
+    std::uint64_t get_max() const { return m_max.load(std::memory_order_relaxed); }
+
+    double get_mean() const {
+        std::uint64_t count = get_count();
+        return count ? static_cast<double>(get_sum()) / count : 0.0;
+    }
+
+    // The value below which the given percentage of values fall, e.g. 99.9.
+    // Reports the highest value of the bucket, as HdrHistogram does.
+    std::uint64_t value_at_percentile(double percentile) const
+    {
+        std::uint64_t count = get_count();
+        if (count == 0)
+            return 0;
+
+        std::uint64_t wanted = static_cast<std::uint64_t>(percentile / 100.0 * count + 0.5);
+        if (wanted == 0)
+            wanted = 1;
+        if (wanted > count)
+            wanted = count;
+
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < m_counts.size(); ++i) {
+            seen += m_counts[i].load(std::memory_order_relaxed);
+            if (seen >= wanted)
+                return std::min(highest_value_at(i), get_max());
+        }
+        return get_max();
+    }
+
+    // Number of values less than or equal to value, to within the bucket
+    // resolution. Used for exporting cumulative buckets.
+    std::uint64_t count_at_or_below(std::uint64_t value) const
+    {
+        std::size_t last = index_of(value);
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i <= last; ++i)
+            seen += m_counts[i].load(std::memory_order_relaxed);
+        return seen;
+    }
+
+private:
+    static std::size_t index_of(std::uint64_t value)
+    {
+        if (value < SUB_BUCKET_COUNT)
+            return static_cast<std::size_t>(value);
+
+        // Shift the value down until it falls in the upper half of the sub
+        // buckets; the shift picks the power of two.
+        unsigned int exponent = 63 - count_leading_zeros(value) - (SUB_BUCKET_BITS - 1);
+        std::uint64_t sub_bucket = value >> exponent;
+        return static_cast<std::size_t>(SUB_BUCKET_COUNT + (exponent - 1) * SUB_BUCKET_HALF
+            + (sub_bucket - SUB_BUCKET_HALF));
+    }
+
+    static std::uint64_t highest_value_at(std::size_t index)
+    {
+        if (index < SUB_BUCKET_COUNT)
+            return index;
+
+        std::size_t offset = index - SUB_BUCKET_COUNT;
+        unsigned int exponent = static_cast<unsigned int>(offset / SUB_BUCKET_HALF) + 1;
+        std::uint64_t sub_bucket = offset % SUB_BUCKET_HALF + SUB_BUCKET_HALF;
+        return ((sub_bucket + 1) << exponent) - 1;
+    }
+
+    static unsigned int count_leading_zeros(std::uint64_t value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<unsigned int>(__builtin_clzll(value));
+#else
+        unsigned int zeros = 0;
+        for (std::uint64_t bit = 1ull << 63; (value & bit) == 0; bit >>= 1)
+            ++zeros;
+        return zeros;
+#endif
+    }
+
+private:
+    std::vector<std::atomic<std::uint64_t>> m_counts;
+    std::atomic<std::uint64_t> m_total;
+    std::atomic<std::uint64_t> m_sum;
+    std::atomic<std::uint64_t> m_max;
+};
+
+// --------------------------------------------------------------------------------
+// LatencyWindow class: The latest 256 values recorded, for percentiles that 
+// follow changes in latency rather than its whole history. Finding a percentile
+// partially sorts a copy of the window, so the result is kept until another 32 
+// values have been recorded or another percentile is asked for. Not thread safe.
+// --------------------------------------------------------------------------------
+
+class LatencyWindow
+{
+    static const std::size_t SIZE = 256;
+    static const std::uint64_t REFRESH_INTERVAL = 32;
+
+public:
+    LatencyWindow() : m_count(0), m_cached_percentile(0.0), m_cached_count(0), m_cached_value(0)
+    {}
+
+    LatencyWindow(const LatencyWindow&) = delete;
+    LatencyWindow& operator=(const LatencyWindow&) = delete;
+
+    void record(std::uint64_t value) {
+        m_values[m_count % SIZE] = value;
+        ++m_count;
+    }
+
+    // Values recorded, including those no longer in the window
+    std::uint64_t get_count() const { return m_count; }
+
+    // The value below which the given percentage of the window falls
+    std::uint64_t value_at_percentile(double percentile)
+    {
+        if (m_count == 0)
+            return 0;
+
+        if (percentile != m_cached_percentile || m_count - m_cached_count >= REFRESH_INTERVAL
+            || m_cached_count == 0) 
+        {
+            std::size_t size = m_count < SIZE ? static_cast<std::size_t>(m_count) : SIZE;
+            std::size_t rank = static_cast<std::size_t>(percentile / 100.0 * size + 0.5);
+            rank = std::min(std::max<std::size_t>(rank, 1), size);
+
+            std::copy(m_values.begin(), m_values.begin() + size, m_sorted.begin());
+            std::nth_element(m_sorted.begin(), m_sorted.begin() + (rank - 1), 
+                m_sorted.begin() + size);
+
+            m_cached_percentile = percentile;
+            m_cached_count = m_count;
+            m_cached_value = m_sorted[rank - 1];
+        }
+        return m_cached_value;
+    }
+
+private:
+    std::array<std::uint64_t, SIZE> m_values;   // ring, the oldest is overwritten
+    std::array<std::uint64_t, SIZE> m_sorted;   // scratch for finding a percentile
+    std::uint64_t m_count;
+    double m_cached_percentile;
+    std::uint64_t m_cached_count;               // m_count when the value was found
+    std::uint64_t m_cached_value;
+};
+
+#endif // HISTOGRAM_HPP
@@ -0,0 +1,181 @@
+/*
+The HTTP/2 framing, HPACK and flow control of a client connection, through
+nghttp2.
+*/
+
+#ifndef HTTP2_SESSION_HPP
+#define HTTP2_SESSION_HPP
+
+#include "http_errors.hpp"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+// Define HTTP_WITH_NGHTTP2 and link with -lnghttp2
+#include <nghttp2/nghttp2.h>
+
+// --------------------------------------------------------------------------------
+// Http2Session class: The HTTP/2 state of one connection, which carries many
+// requests at once as streams. nghttp2 does the framing, the HPACK header
+// compression and the flow control; the session is fed the bytes read from the
+// connection and collects the frames to write, so it does no I/O of its own.
+// Received data opens the windows again only once it is consumed, so a stream
+// whose body is not taken in stops the server sending on that stream alone,
+// without holding up the others.
+// --------------------------------------------------------------------------------
+
+class Http2Session
+{
+public:
+    static const std::uint32_t STREAM_WINDOW_SIZE = 1024 * 1024;
+    static const std::int32_t CONNECTION_WINDOW_SIZE = 16 * 1024 * 1024;
+
+    // The callbacks of the sessions, set up once by the setup function
+    class Callbacks
+    {
+    public:
+        template <typename Setup>
+        explicit Callbacks(Setup setup)
+        {
+            if (nghttp2_session_callbacks_new(&m_callbacks) != 0)
+                throw std::bad_alloc();
+            setup(m_callbacks);
+        }
+
+        ~Callbacks() {
+            nghttp2_session_callbacks_del(m_callbacks);
+        }
+
+        Callbacks(const Callbacks&) = delete;
+        Callbacks& operator=(const Callbacks&) = delete;
+
+        const nghttp2_session_callbacks* get() const { return m_callbacks; }
+
+    private:
+        nghttp2_session_callbacks* m_callbacks;
+    };
+
+    // The connection preface and settings are written with the first output
+    explicit Http2Session(const Callbacks& callbacks) : m_session(nullptr)
+    {
+        nghttp2_option* option = nullptr;
+        if (nghttp2_option_new(&option) != 0)
+            throw std::bad_alloc();
+        nghttp2_option_set_no_auto_window_update(option, 1);
+        int result = nghttp2_session_client_new2(&m_session, callbacks.get(), nullptr, option);
+        nghttp2_option_del(option);
+        if (result != 0)
+            throw std::bad_alloc();
+
+        // Servers push nothing, and may send this much per stream unconsumed
+        const nghttp2_settings_entry settings[] = {
+            { NGHTTP2_SETTINGS_ENABLE_PUSH, 0 },
+            { NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, STREAM_WINDOW_SIZE }
+        };
+        nghttp2_submit_settings(m_session, NGHTTP2_FLAG_NONE, settings,
+            sizeof(settings) / sizeof(settings[0]));
+        nghttp2_session_set_local_window_size(m_session, NGHTTP2_FLAG_NONE, 0,
+            CONNECTION_WINDOW_SIZE);
+    }
+
+    ~Http2Session() {
+        nghttp2_session_del(m_session);
+    }
+
+    Http2Session(const Http2Session&) = delete;
+    Http2Session& operator=(const Http2Session&) = delete;
+
+    // Whether another stream may be opened while streams are open: the server
+    // has not sent GOAWAY, and allows that many at once. Until its settings
+    // arrive 100 are assumed.
+    bool has_room(std::size_t streams) const
+    {
+        return nghttp2_session_check_request_allowed(m_session) != 0
+            && streams < get_max_streams();
+    }
+
+    std::size_t get_max_streams() const
+    {
+        return nghttp2_session_get_remote_settings(m_session,
+            NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+    }
+
+    // Neither side has anything more to say, after GOAWAY
+    bool is_done() {
+        return !nghttp2_session_want_read(m_session) && !nghttp2_session_want_write(m_session);
+    }
+
+    // Submits a request without a body, its stream's user data is set to
+    // stream_data. Returns the stream id; the HEADERS frame goes out with the
+    // next output. The fields are copied.
+    std::int32_t submit_request(const nghttp2_nv* fields, std::size_t count, std::int32_t weight,
+        void* stream_data, boost::system::error_code& ec)
+    {
+        nghttp2_priority_spec priority;
+        nghttp2_priority_spec_init(&priority, 0, weight, 0);
+
+        std::int32_t stream_id = nghttp2_submit_request(m_session, &priority, fields, count,
+            nullptr, stream_data);
+        if (stream_id < 0)
+            ec = http_errors::invalid_request;
+        return stream_id;
+    }
+
+    // Resets a stream that is still open, and detaches its user data so that
+    // no more of its callbacks are seen.
+    void reset_stream(std::int32_t stream_id)
+    {
+        nghttp2_session_set_stream_user_data(m_session, stream_id, nullptr);
+        nghttp2_submit_rst_stream(m_session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_CANCEL);
+    }
+
+    // Opens the windows again by size bytes of data received on a stream,
+    // only the connection's once the stream has closed. WINDOW_UPDATE frames
+    // go out with the next output.
+    void consume(std::int32_t stream_id, std::size_t size)
+    {
+        if (size > 0)
+            nghttp2_session_consume(m_session, stream_id, size);
+    }
+
+    // Processes the bytes read from the connection, invoking the callbacks.
+    // Sets ec if the server broke the protocol.
+    void receive(const char* data, std::size_t size, boost::system::error_code& ec)
+    {
+        ssize_t result = nghttp2_session_mem_recv(m_session,
+            reinterpret_cast<const std::uint8_t*>(data), size);
+        if (result < 0)
+            ec = http_errors::invalid_response;
+    }
+
+    // Appends the frames that are ready to be written to the output. It must
+    // not be collected into while a write of it is in progress.
+    void collect_output(boost::system::error_code& ec)
+    {
+        for (;;) {
+            const std::uint8_t* data = nullptr;
+            ssize_t size = nghttp2_session_mem_send(m_session, &data);
+            if (size < 0) {
+                ec = http_errors::invalid_response;
+                return;
+            }
+            if (size == 0) return;
+
+            std::memcpy(m_output.prepare(static_cast<std::size_t>(size)).data(), data,
+                static_cast<std::size_t>(size));
+            m_output.commit(static_cast<std::size_t>(size));
+        }
+    }
+
+    boost::asio::streambuf& get_output() { return m_output; }
+
+private:
+    nghttp2_session* m_session;
+    boost::asio::streambuf m_output;    // frames to write, kept between writes
+};
+
+#endif // HTTP2_SESSION_HPP
@@ -0,0 +1,96 @@
+/*
+HTTP error codes shared by the client and the server.
+*/
+
+#ifndef HTTP_ERRORS_HPP
+#define HTTP_ERRORS_HPP
+
+#include <boost/system/error_code.hpp>
+#include <string>
+
+// --------------------------------------------------------------------------------
+// Application error code definitions and registration with Boost
+// --------------------------------------------------------------------------------
+
+namespace http_errors
+{   
+    // Define error code integers for our custom error category.
+    enum http_error_codes
+    {
+        invalid_response = 1,   // when client cannot parse response from server
+        invalid_request = 2,    // when server cannot parse request from client
+        connect_timeout = 3,    // connection not established before the deadline
+        first_byte_timeout = 4, // no response within the deadline after sending
+        request_timeout = 5,    // request not complete before its deadline
+        invalid_content_encoding = 6, // response body cannot be decompressed
+        stream_reset = 7        // server reset the HTTP/2 stream of the request
+    };
+
+    // Define custom error_category
+    class http_errors_category : public boost::system::error_category
+    {
+    public:
+        // Must override pure virtual functions name() and message()
+        const char* name() const BOOST_SYSTEM_NOEXCEPT {
+            return "http_errors";
+        }
+
+        // Compare the error code integer and output a valid message
+        std::string message(int e) const {
+            switch (e) {
+            case invalid_response:
+                return "Server response cannot be parsed.";
+                break;
+            case invalid_request:
+                return "Client request cannot be parsed.";
+                break;
+            case connect_timeout:
+                return "Connecting to the server timed out.";
+                break;
+            case first_byte_timeout:
+                return "Waiting for the server response timed out.";
+                break;
+            case request_timeout:
+                return "Request timed out.";
+                break;
+            case invalid_content_encoding:
+                return "Response body cannot be decoded.";
+                break;
+            case stream_reset:
+                return "Server reset the stream.";
+                break;
+            default:
+                return "Unknown error.";
+                break;
+            }
+        }
+    };
+
+    // Utility function that instantiates a single static error category and
+    // returns it as reference. 
+    inline const boost::system::error_category& get_http_errors_category() {
+        static http_errors_category cat;
+        return cat;
+    }
+
+    // Overload the global make_error_code() free function to support
+    // creating error_code objects based on our enum and category.
+    inline boost::system::error_code make_error_code(http_error_codes e) {
+        return boost::system::error_code(
+            static_cast<int>(e), get_http_errors_category());
+    }
+}
+
+// Register our error codes enum with the Boost error code system.
+namespace boost
+{
+    namespace system 
+    {
+        template<>
+        struct is_error_code_enum <http_errors::http_error_codes> {
+            BOOST_STATIC_CONSTANT(bool, value = true);
+        };
+    }
+}
+
+#endif // HTTP_ERRORS_HPP
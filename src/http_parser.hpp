@@ -0,0 +1,309 @@
+/*
+Zero-copy parsers for the head of HTTP/1.x requests and responses.
+*/
+
+#ifndef HTTP_PARSER_HPP
+#define HTTP_PARSER_HPP
+
+#include <boost/utility/string_view.hpp>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// --------------------------------------------------------------------------------
+// HeadParser class: Parses the start line and header block of a HTTP message in
+// a single pass over the contiguous bytes of the receive buffer. Header names
+// and values are returned as spans pointing into that buffer, so parsing neither
+// copies nor allocates. Lines and separators are located with memchr, which the
+// C library implements with vector instructions. The start line is parsed by
+// ResponseHeadParser or RequestHeadParser. Which header fields are returned is
+// decided at compile time by a field policy, a type with a static is_kept(name).
+// --------------------------------------------------------------------------------
+
+struct HeaderField
+{
+    boost::string_view name;
+    boost::string_view value;
+};
+
+// The field policy that keeps every field
+struct AllFields
+{
+    static bool is_kept(boost::string_view) { return true; }
+};
+
+class HeadParser
+{
+public:
+    static const std::size_t MAX_HEAD_SIZE = 64 * 1024;
+    static const std::size_t RESERVED_FIELDS = 32;
+
+    enum class Result
+    {
+        complete,           // the whole head has been parsed
+        incomplete,         // more data is needed
+        invalid             // the data is not a valid message head
+    };
+
+    std::size_t get_head_size() const { return m_head_size; }
+    unsigned int get_version_minor() const { return m_version_minor; }
+    const std::vector<HeaderField>& get_fields() const { return m_fields; }
+
+protected:
+    HeadParser() {
+        m_fields.reserve(RESERVED_FIELDS);
+        reset_head();
+    }
+
+    void reset_head() {
+        m_scan_pos = 0;
+        m_head_size = 0;
+        m_version_minor = 0;
+        m_fields.clear(); // keeps capacity for the next message
+    }
+
+    // Parses the head at the start of data, the start line with
+    // parse_start_line(begin, end). If the result is incomplete, call again
+    // once more data has been appended; bytes already scanned are not scanned
+    // again. On success the spans point into data and stay valid as long as
+    // it is not modified. Fields the policy skips are validated all the same.
+    template <typename Fields = AllFields, typename ParseStartLine>
+    Result parse_head(const char* data, std::size_t size, ParseStartLine parse_start_line)
+    {
+        const char* head_end = find_end_of_head(data, size);
+        if (head_end == nullptr)
+            return size > MAX_HEAD_SIZE ? Result::invalid : Result::incomplete;
+
+        m_head_size = head_end - data;
+
+        const char* line_end = static_cast<const char*>(
+            std::memchr(data, '\n', head_end - data));
+        if (line_end == data || line_end[-1] != '\r'
+            || !parse_start_line(data, line_end - 1))
+            return Result::invalid;
+
+        // Each header line is "name: value\r\n", the head ends with an empty line
+        const char* pos = line_end + 1;
+        while (pos < head_end - 2)
+        {
+            line_end = static_cast<const char*>(std::memchr(pos, '\n', head_end - pos));
+            if (line_end[-1] != '\r' || !parse_field<Fields>(pos, line_end - 1))
+                return Result::invalid;
+
+            pos = line_end + 1;
+        }
+
+        return Result::complete;
+    }
+
+    // "HTTP/1.x", returns the position after it or null.
+    const char* parse_version(const char* begin, const char* end)
+    {
+        static const char prefix[] = "HTTP/1.";
+        const std::size_t prefix_len = sizeof(prefix) - 1;
+
+        if (end - begin < static_cast<std::ptrdiff_t>(prefix_len + 1)
+            || std::memcmp(begin, prefix, prefix_len) != 0
+            || !is_digit(begin[prefix_len]))
+            return nullptr;
+
+        m_version_minor = begin[prefix_len] - '0';
+        return begin + prefix_len + 1;
+    }
+
+    static bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool is_ows(char c) {
+        return c == ' ' || c == '\t';
+    }
+
+    // Field values and reason phrases may not hold a bare CR, which some
+    // recipients would take for a line end (RFC 9112 section 2.2)
+    static bool is_field_content(const char* begin, const char* end) {
+        return std::memchr(begin, '\r', end - begin) == nullptr;
+    }
+
+    // tchar from RFC 7230 section 3.2.6
+    static bool is_token_char(char c)
+    {
+        static const bool table[128] = {
+            0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+            0,1,0,1,1,1,1,1, 0,0,1,1,0,1,1,0, 1,1,1,1,1,1,1,1, 1,1,0,0,0,0,0,0,
+            0,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,0,0,0,1,1,
+            1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,0,1,0,1,0
+        };
+        unsigned char uc = static_cast<unsigned char>(c);
+        return uc < 128 && table[uc];
+    }
+
+private:
+    // Returns the position after "\r\n\r\n", or null if it is not in data yet.
+    const char* find_end_of_head(const char* data, std::size_t size)
+    {
+        const char* end = data + size;
+        const char* pos = data + m_scan_pos;
+
+        while ((pos = static_cast<const char*>(std::memchr(pos, '\n', end - pos))) != nullptr)
+        {
+            if (pos - data >= 3 && pos[-1] == '\r' && pos[-2] == '\n' && pos[-3] == '\r')
+                return pos + 1;
+            ++pos;
+        }
+
+        m_scan_pos = size;
+        return nullptr;
+    }
+
+    template <typename Fields>
+    bool parse_field(const char* begin, const char* end)
+    {
+        const char* colon = static_cast<const char*>(std::memchr(begin, ':', end - begin));
+        if (colon == nullptr || colon == begin)
+            return false;
+
+        // Field names are tokens, whitespace before the colon is not allowed.
+        for (const char* pos = begin; pos < colon; ++pos)
+            if (!is_token_char(*pos))
+                return false;
+
+        // Strip optional whitespace around the value
+        const char* value_begin = colon + 1;
+        const char* value_end = end;
+        while (value_begin < value_end && is_ows(*value_begin))
+            ++value_begin;
+        while (value_end > value_begin && is_ows(value_end[-1]))
+            --value_end;
+        if (!is_field_content(value_begin, value_end))
+            return false;
+
+        boost::string_view name(begin, colon - begin);
+        if (Fields::is_kept(name))
+            m_fields.push_back(HeaderField{ name,
+                boost::string_view(value_begin, value_end - value_begin) });
+        return true;
+    }
+
+private:
+    std::size_t m_scan_pos;             // bytes already searched for end of head
+    std::size_t m_head_size;            // including the final empty line
+
+    unsigned int m_version_minor;       // HTTP/1.x
+    std::vector<HeaderField> m_fields;
+};
+
+// --------------------------------------------------------------------------------
+// ResponseHeadParser class: Parses the status line and headers of a response,
+// returning the fields that the policy of the call keeps. The same policy has
+// to be used for every call on one head.
+// --------------------------------------------------------------------------------
+
+class ResponseHeadParser : public HeadParser
+{
+public:
+    ResponseHeadParser() {
+        reset();
+    }
+
+    void reset() {
+        reset_head();
+        m_status_code = 0;
+        m_status_message.clear();
+    }
+
+    template <typename Fields = AllFields>
+    Result parse(const char* data, std::size_t size) {
+        return parse_head<Fields>(data, size, [this](const char* begin, const char* end) {
+            return parse_status_line(begin, end);
+        });
+    }
+
+    unsigned int get_status_code() const { return m_status_code; }
+    boost::string_view get_status_message() const { return m_status_message; }
+
+private:
+    // "HTTP/1.1 200 OK", the reason phrase may be empty.
+    bool parse_status_line(const char* begin, const char* end)
+    {
+        const char* pos = parse_version(begin, end);
+        if (pos == nullptr || end - pos < 4 || pos[0] != ' ')
+            return false;
+
+        ++pos;
+        if (!is_digit(pos[0]) || !is_digit(pos[1]) || !is_digit(pos[2]))
+            return false;
+        m_status_code = (pos[0] - '0') * 100 + (pos[1] - '0') * 10 + (pos[2] - '0');
+
+        pos += 3;
+        if (pos < end) {
+            if (*pos != ' ')
+                return false;
+            ++pos;
+        }
+        if (!is_field_content(pos, end))
+            return false;
+        m_status_message = boost::string_view(pos, end - pos);
+        return true;
+    }
+
+private:
+    unsigned int m_status_code;
+    boost::string_view m_status_message;
+};
+
+// --------------------------------------------------------------------------------
+// RequestHeadParser class: Parses the request line and headers of a request.
+// --------------------------------------------------------------------------------
+
+class RequestHeadParser : public HeadParser
+{
+public:
+    RequestHeadParser() {
+        reset();
+    }
+
+    void reset() {
+        reset_head();
+        m_method.clear();
+        m_target.clear();
+    }
+
+    Result parse(const char* data, std::size_t size) {
+        return parse_head(data, size, [this](const char* begin, const char* end) {
+            return parse_request_line(begin, end);
+        });
+    }
+
+    boost::string_view get_method() const { return m_method; }
+    boost::string_view get_target() const { return m_target; }
+
+private:
+    // "GET /index.html HTTP/1.1", the method is a token and the target has no
+    // whitespace.
+    bool parse_request_line(const char* begin, const char* end)
+    {
+        const char* pos = begin;
+        while (pos < end && is_token_char(*pos))
+            ++pos;
+        if (pos == begin || pos == end || *pos != ' ')
+            return false;
+        m_method = boost::string_view(begin, pos - begin);
+
+        const char* target = ++pos;
+        while (pos < end && static_cast<unsigned char>(*pos) > ' ' && *pos != 0x7f)
+            ++pos;
+        if (pos == target || pos == end || *pos != ' ')
+            return false;
+        m_target = boost::string_view(target, pos - target);
+
+        ++pos;
+        return parse_version(pos, end) == end;
+    }
+
+private:
+    boost::string_view m_method;
+    boost::string_view m_target;
+};
+
+#endif // HTTP_PARSER_HPP
@@ -0,0 +1,363 @@
+/*
+Admission control for requests: a global and a per-origin in-flight cap, with
+fair queueing of the requests over the caps.
+*/
+
+#ifndef REQUEST_SCHEDULER_HPP
+#define REQUEST_SCHEDULER_HPP
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Requests of a higher priority class are admitted before any of a lower one
+enum class RequestPriority
+{
+    high,
+    normal,
+    low
+};
+
+// --------------------------------------------------------------------------------
+// RequestScheduler class: Limits the requests in flight, in total and per origin
+// (host:port). A request over a limit waits in its origin's FIFO queue for its
+// priority class. Queued requests are admitted as others finish, higher classes
+// first. Within a class, origins take turns by deficit round robin: in each
+// turn an origin may send as many requests as its weight. This keeps one busy
+// origin from holding up the rest. Entries are intrusive and owned by the
+// caller, so queueing a request does not allocate. Its methods may be called
+// from any thread.
+// --------------------------------------------------------------------------------
+
+class RequestScheduler
+{
+    static const unsigned int PRIORITY_COUNT = 3;
+    static const std::size_t MAX_IDLE_ORIGINS = 1024;   // state kept for origins without requests
+
+    // Links of a circular list, the list's head is a Link of its own
+    struct Link
+    {
+        Link() : prev(this), next(this)
+        {}
+
+        Link(const Link&) = delete;
+        Link& operator=(const Link&) = delete;
+
+        bool is_linked() const { return next != this; }
+
+        void link_before(Link& other) {
+            prev = other.prev;
+            next = &other;
+            other.prev->next = this;
+            other.prev = this;
+        }
+
+        void unlink() {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = this;
+        }
+
+        Link* prev;
+        Link* next;
+    };
+
+    struct Origin;
+
+    // Links an origin into the turns of one priority class
+    struct TurnLink : Link
+    {
+        Origin* origin;
+    };
+
+    struct Origin
+    {
+        Origin() : in_flight(0), queued(0), max_in_flight(0), weight(1), is_configured(false)
+        {
+            for (unsigned int i = 0; i < PRIORITY_COUNT; ++i) {
+                deficits[i] = 0;
+                turns[i].origin = this;
+            }
+        }
+
+        std::size_t get_limit(std::size_t default_limit) const {
+            return is_configured ? max_in_flight : default_limit;
+        }
+
+        Link queues[PRIORITY_COUNT];            // waiting entries, oldest first
+        TurnLink turns[PRIORITY_COUNT];         // in the turns while its queue is not empty
+        unsigned int deficits[PRIORITY_COUNT];  // requests left in the current turn
+        std::size_t in_flight;
+        std::size_t queued;
+        std::size_t max_in_flight;              // if configured, zero for no limit
+        unsigned int weight;
+        bool is_configured;                     // limits set for this origin
+    };
+
+public:
+    // A request, on_admitted is invoked once it leaves the queue. It runs on
+    // the thread of the request that made room, outside the lock.
+    class Entry : private Link
+    {
+        friend class RequestScheduler;
+
+    public:
+        explicit Entry(std::function<void()> on_admitted) :
+            m_priority(RequestPriority::normal),
+            m_is_queued(false),
+            m_origin(nullptr),
+            m_on_admitted(std::move(on_admitted))
+        {}
+
+        void set_priority(RequestPriority priority) { m_priority = priority; }
+        RequestPriority get_priority() const { return m_priority; }
+
+    private:
+        RequestPriority m_priority;
+        bool m_is_queued;                   // else linked only while being admitted
+        Origin* m_origin;                   // while admitted or queued
+        std::function<void()> m_on_admitted;
+    };
+
+    RequestScheduler() :
+        m_is_enabled(false),
+        m_max_in_flight(0),
+        m_max_in_flight_per_origin(0),
+        m_in_flight(0),
+        m_queued(0)
+    {
+        for (unsigned int i = 0; i < PRIORITY_COUNT; ++i)
+            m_turn_counts[i] = 0;
+    }
+
+    RequestScheduler(const RequestScheduler&) = delete;
+    RequestScheduler& operator=(const RequestScheduler&) = delete;
+
+    // Until a limit is set, requests go out without taking the lock
+    bool is_enabled() const { return m_is_enabled.load(std::memory_order_acquire); }
+
+    // Zero for no limit
+    void set_max_in_flight(std::size_t max_in_flight)
+    {
+        std::unique_lock<std::mutex> lock(m_mux);
+        m_max_in_flight = max_in_flight;
+        enable();
+        dispatch_and_notify(lock);
+    }
+
+    void set_max_in_flight_per_origin(std::size_t max_in_flight)
+    {
+        std::unique_lock<std::mutex> lock(m_mux);
+        m_max_in_flight_per_origin = max_in_flight;
+        enable();
+        dispatch_and_notify(lock);
+    }
+
+    // Overrides the default limit for one origin, and sets how many of its
+    // requests are admitted per turn.
+    void set_origin_limits(const std::string& key, std::size_t max_in_flight, unsigned int weight)
+    {
+        assert(weight > 0);
+
+        std::unique_lock<std::mutex> lock(m_mux);
+        Origin& origin = m_origins[key];
+        origin.max_in_flight = max_in_flight;
+        origin.weight = weight;
+        origin.is_configured = true;
+        enable();
+        dispatch_and_notify(lock);
+    }
+
+    // Admits the entry for the origin key and returns true if it is within
+    // the limits. Otherwise queues it and returns false, on_admitted is then
+    // invoked later.
+    bool admit(Entry& entry, const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        assert(!entry.m_origin);
+
+        if (m_origins.size() >= MAX_IDLE_ORIGINS && m_origins.find(key) == m_origins.end())
+            remove_idle_origins();
+        Origin& origin = m_origins[key];
+        entry.m_origin = &origin;
+
+        // Other origins with a queue are at their limits, else they would
+        // have been admitted, so taking a free place does not jump them.
+        if (origin.queued == 0 && has_room(origin)) {
+            ++origin.in_flight;
+            ++m_in_flight;
+            return true;
+        }
+
+        unsigned int priority = static_cast<unsigned int>(entry.m_priority);
+        if (!origin.queues[priority].is_linked()) {
+            origin.turns[priority].link_before(m_turns[priority]);
+            ++m_turn_counts[priority];
+        }
+        entry.link_before(origin.queues[priority]);
+        entry.m_is_queued = true;
+        ++origin.queued;
+        ++m_queued;
+        return false;
+    }
+
+    // Takes a queued entry out of its queue. Returns false if it is not
+    // queued, it may have been admitted meanwhile.
+    bool remove(Entry& entry)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        if (!entry.m_is_queued) return false;
+
+        Origin& origin = *entry.m_origin;
+        unsigned int priority = static_cast<unsigned int>(entry.m_priority);
+        entry.unlink();
+        entry.m_is_queued = false;
+        entry.m_origin = nullptr;
+        --origin.queued;
+        --m_queued;
+        if (!origin.queues[priority].is_linked())
+            leave_turns(origin, priority);
+        return true;
+    }
+
+    // Ends an admitted entry, letting queued ones in
+    void release(Entry& entry)
+    {
+        std::unique_lock<std::mutex> lock(m_mux);
+        assert(entry.m_origin && !entry.is_linked());
+
+        --entry.m_origin->in_flight;
+        --m_in_flight;
+        entry.m_origin = nullptr;
+        dispatch_and_notify(lock);
+    }
+
+    std::size_t get_in_flight() const {
+        std::lock_guard<std::mutex> lock(m_mux);
+        return m_in_flight;
+    }
+
+    std::size_t get_queued() const {
+        std::lock_guard<std::mutex> lock(m_mux);
+        return m_queued;
+    }
+
+private:
+    void enable() {
+        m_is_enabled.store(true, std::memory_order_release);
+    }
+
+    bool has_room(const Origin& origin) const
+    {
+        if (m_max_in_flight > 0 && m_in_flight >= m_max_in_flight)
+            return false;
+        std::size_t limit = origin.get_limit(m_max_in_flight_per_origin);
+        return limit == 0 || origin.in_flight < limit;
+    }
+
+    bool is_full() const {
+        return m_max_in_flight > 0 && m_in_flight >= m_max_in_flight;
+    }
+
+    // Admits queued entries while there is room, then invokes on_admitted
+    // with the lock released.
+    void dispatch_and_notify(std::unique_lock<std::mutex>& lock)
+    {
+        Link admitted;
+        for (unsigned int priority = 0; priority < PRIORITY_COUNT && !is_full(); ++priority)
+            dispatch(priority, admitted);
+        if (!admitted.is_linked()) return;
+
+        // The entries are owned by their requests, which may be finished and
+        // reused as soon as they run, so each is unlinked first.
+        lock.unlock();
+        while (admitted.is_linked()) {
+            Entry& entry = static_cast<Entry&>(*admitted.next);
+            entry.unlink();
+            entry.m_on_admitted();
+        }
+    }
+
+    // Deficit round robin over the origins queued in a priority class. The
+    // origin at the front of the turns is the one whose turn it is. One at
+    // its own limit is passed over and loses the rest of its turn.
+    void dispatch(unsigned int priority, Link& admitted)
+    {
+        Link& turns = m_turns[priority];
+        std::size_t passed = 0;            // origins passed over in a row
+
+        while (turns.is_linked() && !is_full() && passed < m_turn_counts[priority])
+        {
+            Origin& origin = *static_cast<TurnLink*>(turns.next)->origin;
+            unsigned int& deficit = origin.deficits[priority];
+
+            if (!has_room(origin)) {
+                deficit = 0;
+                rotate(turns);
+                ++passed;
+                continue;
+            }
+            passed = 0;
+
+            if (deficit == 0)
+                deficit = origin.weight;    // its turn starts
+
+            Entry& entry = static_cast<Entry&>(*origin.queues[priority].next);
+            entry.unlink();
+            entry.m_is_queued = false;
+            entry.link_before(admitted);
+            --origin.queued;
+            --m_queued;
+            ++origin.in_flight;
+            ++m_in_flight;
+            --deficit;
+
+            if (!origin.queues[priority].is_linked())
+                leave_turns(origin, priority);
+            else if (deficit == 0)
+                rotate(turns);
+        }
+    }
+
+    void leave_turns(Origin& origin, unsigned int priority)
+    {
+        origin.turns[priority].unlink();
+        origin.deficits[priority] = 0;
+        --m_turn_counts[priority];
+    }
+
+    static void rotate(Link& turns)
+    {
+        Link& front = *turns.next;
+        front.unlink();
+        front.link_before(turns);
+    }
+
+    void remove_idle_origins()
+    {
+        for (auto it = m_origins.begin(); it != m_origins.end(); ) {
+            const Origin& origin = it->second;
+            if (origin.in_flight == 0 && origin.queued == 0 && !origin.is_configured)
+                it = m_origins.erase(it);
+            else
+                ++it;
+        }
+    }
+
+private:
+    mutable std::mutex m_mux;
+    std::atomic<bool> m_is_enabled;
+    std::size_t m_max_in_flight;                // zero for no limit
+    std::size_t m_max_in_flight_per_origin;     // default for the origins
+    std::size_t m_in_flight;
+    std::size_t m_queued;
+    std::map<std::string, Origin> m_origins;    // by host:port
+    Link m_turns[PRIORITY_COUNT];               // origins with a queue, by class
+    std::size_t m_turn_counts[PRIORITY_COUNT];
+};
+
+#endif // REQUEST_SCHEDULER_HPP
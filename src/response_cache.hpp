@@ -0,0 +1,285 @@
+/*
+In-process cache of GET responses, revalidated with ETag and Last-Modified.
+*/
+
+#ifndef RESPONSE_CACHE_HPP
+#define RESPONSE_CACHE_HPP
+
+#include "header_table.hpp"
+
+#include <boost/utility/string_view.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// --------------------------------------------------------------------------------
+// CachedResponse struct: A response as stored, with its body decoded. It is not
+// changed once stored, so it is shared by the requests it is served to.
+// --------------------------------------------------------------------------------
+
+struct CachedResponse
+{
+    CachedResponse() : status_code(0)
+    {}
+
+    // Bytes counted against the cache's bound
+    std::size_t get_size() const
+    {
+        std::size_t size = sizeof(CachedResponse) + status_message.size() + body.size()
+            + etag.size() + last_modified.size();
+        for (HeaderField field : headers)
+            size += field.name.size() + field.value.size();
+        return size;
+    }
+
+    unsigned int status_code;
+    std::string status_message;
+    HeaderTable headers;
+    std::string body;
+    std::string etag;                   // validators, empty if the server sent none
+    std::string last_modified;
+};
+
+// --------------------------------------------------------------------------------
+// ResponseCache class: The responses of a HTTPClient, keyed by host:port, URI
+// and the request headers, and bounded by their size in bytes. The least
+// recently used are evicted first. A response is fresh for its Cache-Control
+// max-age; once stale it is revalidated with a conditional request, and served
+// again if the server answers 304 Not Modified. Shared by the I/O threads,
+// lookups copy out a reference under the lock. A bound of zero, the default,
+// disables it.
+// --------------------------------------------------------------------------------
+
+class ResponseCache
+{
+public:
+    ResponseCache() : m_max_bytes(0), m_bytes(0)
+    {}
+
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    void set_max_bytes(std::size_t max_bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        m_max_bytes.store(max_bytes, std::memory_order_relaxed);
+        evict(max_bytes);
+    }
+
+    bool is_enabled() const { return m_max_bytes.load(std::memory_order_relaxed) > 0; }
+
+    // The response stored for the key and until when it is fresh, or null
+    std::shared_ptr<const CachedResponse> find(const std::string& key,
+        std::chrono::steady_clock::time_point& expires)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        auto it = m_entries.find(key);
+        if (it == m_entries.end())
+            return nullptr;
+
+        m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+        expires = it->second.expires;
+        return it->second.response;
+    }
+
+    // Stores a response in place of the one for the key, evicting others to
+    // make room
+    void store(const std::string& key, std::shared_ptr<const CachedResponse> response,
+        std::chrono::steady_clock::time_point expires)
+    {
+        std::size_t size = response->get_size() + key.size();
+
+        std::lock_guard<std::mutex> lock(m_mux);
+        std::size_t max_bytes = m_max_bytes.load(std::memory_order_relaxed);
+        if (size > max_bytes) {
+            erase(key);
+            return;
+        }
+
+        auto it = m_entries.find(key);
+        if (it == m_entries.end()) {
+            m_lru.push_front(key);
+            it = m_entries.emplace(key, Entry()).first;
+            it->second.lru = m_lru.begin();
+        }
+        else {
+            m_bytes -= it->second.size;
+            m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+        }
+        it->second.response = std::move(response);
+        it->second.expires = expires;
+        it->second.size = size;
+        m_bytes += size;
+
+        evict(max_bytes);
+    }
+
+    // Makes a revalidated response fresh again, if it is still the one stored
+    void refresh(const std::string& key, const std::shared_ptr<const CachedResponse>& response,
+        std::chrono::steady_clock::time_point expires)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        auto it = m_entries.find(key);
+        if (it != m_entries.end() && it->second.response == response)
+            it->second.expires = expires;
+    }
+
+    // Whether a response to a GET request may be stored: a 200 that is not
+    // no-store or private, sets no cookie, and does not vary on request
+    // headers other than the Accept-Encoding, as its body is stored decoded.
+    // The lifetime is its max-age less its Age, zero without one or with
+    // no-cache. A response that is never fresh is only worth storing with a
+    // validator.
+    static bool is_storable(unsigned int status_code, const HeaderTable& headers,
+        std::chrono::steady_clock::duration& lifetime)
+    {
+        if (status_code != 200 || headers.contains(KnownHeader::set_cookie))
+            return false;
+
+        boost::string_view vary;
+        if (headers.find(KnownHeader::vary, vary) && !iequals(trim(vary), "accept-encoding"))
+            return false;
+
+        bool is_no_store = false;
+        lifetime = get_lifetime(headers, is_no_store);
+        if (is_no_store)
+            return false;
+
+        return lifetime > std::chrono::steady_clock::duration::zero()
+            || headers.contains(KnownHeader::etag)
+            || headers.contains(KnownHeader::last_modified);
+    }
+
+    // The Cache-Control max-age less the Age, zero if absent or no-cache is
+    // given. Sets is_no_store for no-store, and for private as the cache is
+    // shared by every request of the client.
+    static std::chrono::steady_clock::duration get_lifetime(const HeaderTable& headers,
+        bool& is_no_store)
+    {
+        is_no_store = false;
+        boost::string_view cache_control;
+        if (!headers.find(KnownHeader::cache_control, cache_control))
+            return std::chrono::steady_clock::duration::zero();
+
+        long max_age = 0;
+        bool is_no_cache = false;
+        while (!cache_control.empty())
+        {
+            std::size_t end = std::min(cache_control.find(','), cache_control.size());
+            boost::string_view directive = trim(cache_control.substr(0, end));
+            cache_control.remove_prefix(std::min(end + 1, cache_control.size()));
+
+            std::size_t equals = std::min(directive.find('='), directive.size());
+            boost::string_view name = trim(directive.substr(0, equals));
+            boost::string_view value = directive.substr(std::min(equals + 1, directive.size()));
+            if (!value.empty() && value.front() == '"')
+                value = value.substr(1, value.size() > 1 ? value.size() - 2 : 0);
+
+            if (iequals(name, "no-store") || iequals(name, "private"))
+                is_no_store = true;
+            else if (iequals(name, "no-cache"))
+                is_no_cache = true;
+            else if (iequals(name, "max-age"))
+                max_age = parse_seconds(value);
+        }
+
+        boost::string_view age;
+        if (headers.find(KnownHeader::age, age))
+            max_age -= parse_seconds(age);
+
+        if (is_no_cache || max_age <= 0)
+            return std::chrono::steady_clock::duration::zero();
+        return std::chrono::seconds(max_age);
+    }
+
+    // Whether rendered header lines carry an Authorization or Cookie header
+    static bool has_credentials(boost::string_view lines)
+    {
+        while (!lines.empty())
+        {
+            std::size_t end = std::min(lines.find("\r\n"), lines.size());
+            boost::string_view name = lines.substr(0, std::min(lines.find(':'), end));
+            if (iequals(name, "Authorization") || iequals(name, "Cookie"))
+                return true;
+            lines.remove_prefix(std::min(end + 2, lines.size()));
+        }
+        return false;
+    }
+
+private:
+    struct Entry
+    {
+        Entry() : size(0)
+        {}
+
+        std::shared_ptr<const CachedResponse> response;
+        std::chrono::steady_clock::time_point expires;
+        std::size_t size;
+        std::list<std::string>::iterator lru;
+    };
+
+    void evict(std::size_t max_bytes)
+    {
+        while (m_bytes > max_bytes && !m_lru.empty())
+            erase(m_lru.back());
+    }
+
+    void erase(const std::string& key)
+    {
+        auto it = m_entries.find(key);
+        if (it == m_entries.end()) return;
+
+        m_bytes -= it->second.size;
+        std::list<std::string>::iterator lru = it->second.lru;
+        m_entries.erase(it);
+        m_lru.erase(lru);
+    }
+
+    static long parse_seconds(boost::string_view value)
+    {
+        long seconds = 0;
+        for (char c : trim(value)) {
+            if (!std::isdigit(static_cast<unsigned char>(c)))
+                break;
+            seconds = std::min(seconds * 10 + (c - '0'), 100L * 365 * 24 * 3600);
+        }
+        return seconds;
+    }
+
+    static boost::string_view trim(boost::string_view value)
+    {
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+            value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+            value.remove_suffix(1);
+        return value;
+    }
+
+    static bool iequals(boost::string_view a, boost::string_view b)
+    {
+        if (a.size() != b.size())
+            return false;
+        for (std::size_t i = 0; i < a.size(); ++i)
+            if (std::tolower(static_cast<unsigned char>(a[i]))
+                != std::tolower(static_cast<unsigned char>(b[i])))
+                return false;
+        return true;
+    }
+
+private:
+    std::atomic<std::size_t> m_max_bytes;
+    std::size_t m_bytes;                // of the entries and their keys
+    std::list<std::string> m_lru;       // keys, the most recently used first
+    std::unordered_map<std::string, Entry> m_entries;
+    std::mutex m_mux;
+};
+
+#endif // RESPONSE_CACHE_HPP
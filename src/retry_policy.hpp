@@ -0,0 +1,202 @@
+/*
+Retries of failed requests: which failures are retried, backoff with jitter,
+and a budget limiting how many retries are made.
+*/
+
+#ifndef RETRY_POLICY_HPP
+#define RETRY_POLICY_HPP
+
+#include "http_errors.hpp"
+
+#include <boost/asio/error.hpp>
+#include <boost/system/error_code.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+#if defined(HTTP_WITH_OPENSSL)
+#include <boost/asio/ssl/error.hpp>
+#endif
+
+// --------------------------------------------------------------------------------
+// RetryPolicy struct: How often a request that failed before its response is
+// issued again, and how long it waits in between. The waits grow exponentially
+// from the initial backoff up to the maximum, and each is drawn at random below
+// that limit (full jitter), so that clients that failed together do not retry
+// together. No retries by default.
+// --------------------------------------------------------------------------------
+
+struct RetryPolicy
+{
+    RetryPolicy(unsigned int max_retries = 0,
+        std::chrono::steady_clock::duration initial_backoff = std::chrono::milliseconds(50),
+        std::chrono::steady_clock::duration max_backoff = std::chrono::seconds(2)) :
+        max_retries(max_retries),
+        initial_backoff(initial_backoff),
+        max_backoff(max_backoff)
+    {}
+
+    // The longest wait before retry number retry, counted from zero
+    std::chrono::steady_clock::duration get_backoff_limit(unsigned int retry) const
+    {
+        std::chrono::steady_clock::duration limit = initial_backoff;
+        for (unsigned int i = 0; i < retry && limit < max_backoff; ++i)
+            limit *= 2;
+        return std::min(limit, max_backoff);
+    }
+
+    // The connection was closed under the request, as servers do with idle
+    // connections
+    static bool is_dropped(const boost::system::error_code& ec)
+    {
+        namespace error = boost::asio::error;
+
+        return ec == error::eof
+            || ec == error::connection_reset
+            || ec == error::broken_pipe
+#if defined(HTTP_WITH_OPENSSL)
+            || ec == boost::asio::ssl::error::stream_truncated
+#endif
+            ;
+    }
+
+    // Failures of the connection or of the server that a new attempt may not
+    // meet: refused or dropped connections, and the connect and first byte
+    // deadlines. Cancellation, the request's own deadline and responses that
+    // cannot be parsed are final.
+    static bool is_retryable(const boost::system::error_code& ec)
+    {
+        namespace error = boost::asio::error;
+
+        return is_dropped(ec)
+            || ec == error::connection_refused
+            || ec == error::connection_aborted
+            || ec == error::timed_out
+            || ec == error::host_unreachable
+            || ec == error::network_unreachable
+            || ec == error::network_down
+            || ec == error::network_reset
+            || ec == error::host_not_found_try_again
+            || ec == http_errors::connect_timeout
+            || ec == http_errors::first_byte_timeout
+            || ec == http_errors::stream_reset;
+    }
+
+    unsigned int max_retries;
+    std::chrono::steady_clock::duration initial_backoff;
+    std::chrono::steady_clock::duration max_backoff;
+};
+
+// --------------------------------------------------------------------------------
+// HedgePolicy struct: When a duplicate of a request is sent. If the response has
+// not started once the wait for it exceeds the given percentile of the recent
+// waits, e.g. 95, a second request goes to another endpoint. It is not sent
+// earlier than the minimum delay. Zero percentile for no hedging, the default.
+// --------------------------------------------------------------------------------
+
+struct HedgePolicy
+{
+    HedgePolicy(double percentile = 0.0,
+        std::chrono::steady_clock::duration min_delay = std::chrono::milliseconds(1)) :
+        percentile(percentile),
+        min_delay(min_delay)
+    {}
+
+    bool is_enabled() const { return percentile > 0.0; }
+
+    double percentile;
+    std::chrono::steady_clock::duration min_delay;
+};
+
+// --------------------------------------------------------------------------------
+// RetryBudget class: Limits the retries of one I/O thread to a ratio of the
+// requests it finishes, plus a few per second that are always allowed. Each
+// request finished earns the ratio of a retry, up to a reserve of 100, and each
+// retry spends one. When a server is down the retries thus add at most the
+// ratio to its load, instead of multiplying it. It also draws the random
+// backoffs. The limits may be set from any thread; the rest must be used on the
+// I/O thread.
+// --------------------------------------------------------------------------------
+
+class RetryBudget
+{
+    static const std::int64_t UNIT = 1000;                 // one retry, in thousandths
+    static const std::int64_t MAX_BALANCE = 100 * UNIT;
+    static const unsigned int DEFAULT_RATIO = 200;         // thousandths of a retry per request
+    static const unsigned int DEFAULT_MIN_PER_SECOND = 10;
+
+public:
+    RetryBudget() :
+        m_ratio(DEFAULT_RATIO),
+        m_min_per_second(DEFAULT_MIN_PER_SECOND),
+        m_balance(0),
+        m_reserve(DEFAULT_MIN_PER_SECOND * UNIT),
+        m_refilled(std::chrono::steady_clock::now()),
+        m_random(static_cast<std::minstd_rand::result_type>(
+            m_refilled.time_since_epoch().count() ^ reinterpret_cast<std::uintptr_t>(this)))
+    {}
+
+    RetryBudget(const RetryBudget&) = delete;
+    RetryBudget& operator=(const RetryBudget&) = delete;
+
+    // Retries earned per request, e.g. 0.2, and those always allowed per second
+    void set_limits(double ratio, unsigned int min_per_second)
+    {
+        m_ratio.store(static_cast<unsigned int>(std::max(ratio, 0.0) * UNIT + 0.5),
+            std::memory_order_relaxed);
+        m_min_per_second.store(min_per_second, std::memory_order_relaxed);
+    }
+
+    void record_request()
+    {
+        m_balance += m_ratio.load(std::memory_order_relaxed);
+        if (m_balance > MAX_BALANCE)
+            m_balance = MAX_BALANCE;
+    }
+
+    // Takes a retry from the budget. Returns false if none is left.
+    bool try_spend()
+    {
+        if (m_balance >= UNIT) {
+            m_balance -= UNIT;
+            return true;
+        }
+
+        // The reserve refills at the rate of the retries always allowed
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::int64_t min_per_second = m_min_per_second.load(std::memory_order_relaxed);
+        std::int64_t elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            now - m_refilled).count();
+        m_refilled = now;
+        m_reserve = std::min(m_reserve + elapsed_us * min_per_second * UNIT / 1000000,
+            min_per_second * UNIT);
+
+        if (m_reserve >= UNIT) {
+            m_reserve -= UNIT;
+            return true;
+        }
+        return false;
+    }
+
+    // A wait drawn uniformly between zero and the limit
+    std::chrono::steady_clock::duration draw_backoff(std::chrono::steady_clock::duration limit)
+    {
+        if (limit <= std::chrono::steady_clock::duration::zero())
+            return std::chrono::steady_clock::duration::zero();
+
+        std::uniform_int_distribution<std::chrono::steady_clock::rep> distribution(0, limit.count());
+        return std::chrono::steady_clock::duration(distribution(m_random));
+    }
+
+private:
+    std::atomic<unsigned int> m_ratio;              // thousandths of a retry per request
+    std::atomic<unsigned int> m_min_per_second;
+    std::int64_t m_balance;                         // earned by requests, in thousandths
+    std::int64_t m_reserve;                         // of the retries always allowed
+    std::chrono::steady_clock::time_point m_refilled;
+    std::minstd_rand m_random;
+};
+
+#endif // RETRY_POLICY_HPP
@@ -0,0 +1,990 @@
+/*
+HTTP Server for serving GET requests, the companion of the client.
+*/
+
+#include <boost/predef.h> // for identifying the OS
+
+// If the OS is Windows Server 2003 or earlier, enable
+// cancelling of I/O operations.
+#ifdef BOOST_OS_WINDOWS
+#define __WIN32_WINNT 0x501
+#if __WIN32_WINNT <= 0x502
+
+// Disable the usage of the I/O completion port framework as
+// it causes problems when cancelling asynchronous operations.
+#define BOOST_ASIO_DISABLE_IOCP
+
+// Enable cancelling asynchronous operations
+#define BOOST_ENABLE_CANCELIO
+#endif
+#endif
+
+#include <utility> // before Asio, its awaitable.hpp uses std::exchange
+#include <boost/asio.hpp>
+#include <boost/utility/string_view.hpp>
+#include <thread>
+#include <memory>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <cstdlib>
+
+#if BOOST_OS_LINUX
+#include <sys/resource.h>
+#endif
+
+#include "http_errors.hpp"
+#include "http_parser.hpp"
+#include "header_table.hpp"
+#include "chunked_decoder.hpp"
+#include "handler_alloc.hpp"
+
+using namespace boost;
+
+// --------------------------------------------------------------------------------
+// ServerRequest class: A request received by the server, as seen by the request
+// handlers. The connection reuses it for every request it receives.
+// --------------------------------------------------------------------------------
+
+class ServerRequest
+{
+    friend class ServerConnection;
+
+public:
+    ServerRequest()
+    {
+        reset();
+    }
+
+    boost::string_view get_method() const { return m_method; }
+    boost::string_view get_target() const { return m_target; }
+    unsigned int get_version_minor() const { return m_version_minor; }
+    const HeaderTable& get_headers() const { return m_headers; }
+
+    // The target without the query, e.g. "/search" for "/search?q=asio"
+    boost::string_view get_path() const {
+        return boost::string_view(m_target).substr(m_path_begin, m_path_size);
+    }
+
+    boost::string_view get_query() const {
+        std::size_t query_begin = m_path_begin + m_path_size;
+        if (query_begin >= m_target.size())
+            return boost::string_view();
+        return boost::string_view(m_target).substr(query_begin + 1);
+    }
+
+    boost::string_view get_body() const {
+        return boost::string_view(static_cast<const char*>(m_body.data().data()),
+            m_body.size());
+    }
+
+private:
+    void reset() {
+        m_method.clear();
+        m_target.clear();
+        m_path_begin = 0;
+        m_path_size = 0;
+        m_version_minor = 1;
+        m_headers.clear();
+        m_body.consume(m_body.size());
+    }
+
+    // Locates the path in an origin-form ("/path?query") or absolute-form
+    // ("http://host/path?query") target.
+    void set_target(boost::string_view target)
+    {
+        m_target.assign(target.data(), target.size());
+
+        std::size_t begin = 0;
+        std::size_t scheme_end = target.find("://");
+        if (target.size() > 0 && target[0] != '/' && scheme_end != boost::string_view::npos) {
+            begin = target.find('/', scheme_end + 3);
+            if (begin == boost::string_view::npos)
+                begin = target.size();
+        }
+
+        std::size_t end = target.find('?', begin);
+        if (end == boost::string_view::npos)
+            end = target.size();
+
+        m_path_begin = begin;
+        m_path_size = end - begin;
+    }
+
+private:
+    std::string m_method;
+    std::string m_target;
+    std::size_t m_path_begin;
+    std::size_t m_path_size;
+    unsigned int m_version_minor;       // HTTP/1.x
+    HeaderTable m_headers;
+    asio::streambuf m_body;
+};
+
+// --------------------------------------------------------------------------------
+// ServerResponse class: The response a request handler fills in. The server
+// adds Content-Length and, when the connection is closed, Connection: close.
+// --------------------------------------------------------------------------------
+
+class ServerResponse
+{
+    friend class ServerConnection;
+
+public:
+    ServerResponse()
+    {
+        reset();
+    }
+
+    void set_status(unsigned int status_code) {
+        set_status(status_code, reason_phrase(status_code));
+    }
+
+    void set_status(unsigned int status_code, boost::string_view reason) {
+        m_status_code = status_code;
+        m_reason.assign(reason.data(), reason.size());
+    }
+
+    void add_header(boost::string_view name, boost::string_view value) {
+        m_headers.append(name.data(), name.size());
+        m_headers += ": ";
+        m_headers.append(value.data(), value.size());
+        m_headers += "\r\n";
+    }
+
+    void set_body(boost::string_view body) {
+        m_body.assign(body.data(), body.size());
+    }
+
+    void append_body(boost::string_view body) {
+        m_body.append(body.data(), body.size());
+    }
+
+    // Closes the connection once the response has been sent
+    void set_close() { m_is_close = true; }
+
+    unsigned int get_status_code() const { return m_status_code; }
+
+    static const char* reason_phrase(unsigned int status_code)
+    {
+        switch (status_code) {
+        case 100: return "Continue";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        case 505: return "HTTP Version Not Supported";
+        default: return "Unknown";
+        }
+    }
+
+private:
+    void reset() {
+        m_status_code = 200;
+        m_reason.assign("OK");
+        m_headers.clear();
+        m_body.clear();
+        m_is_close = false;
+    }
+
+private:
+    unsigned int m_status_code;
+    std::string m_reason;
+    std::string m_headers;              // rendered header lines
+    std::string m_body;
+    bool m_is_close;
+};
+
+// --------------------------------------------------------------------------------
+// Router class: Maps request paths to handlers or to static content. A path
+// ending with '*' matches every path starting with the part before it, the
+// longest such prefix wins; "/echo/*" matches "/echo/" and "/echo/a/b".
+// Static content is rendered once when it is added and sent without copying.
+//
+// Routes are added before the server starts. The router is then only read, so
+// the I/O threads share it without locking.
+// --------------------------------------------------------------------------------
+
+typedef std::function<void(const ServerRequest& request, ServerResponse& response)>
+    RequestHandler;
+
+class Router
+{
+public:
+    struct Route
+    {
+        std::string path;
+        RequestHandler handler;         // empty for static content
+        std::string static_head;        // status line and headers, without the final CRLF
+        std::string static_body;
+
+        bool is_static() const { return !handler; }
+    };
+
+    void add_handler(const std::string& path, RequestHandler handler)
+    {
+        Route route;
+        route.path = path;
+        route.handler = std::move(handler);
+        add(std::move(route));
+    }
+
+    void add_static(const std::string& path, boost::string_view body,
+        boost::string_view content_type = "text/plain")
+    {
+        Route route;
+        route.path = path;
+        route.static_body.assign(body.data(), body.size());
+
+        route.static_head = "HTTP/1.1 200 OK\r\nServer: asio-http-server\r\nContent-Type: ";
+        route.static_head.append(content_type.data(), content_type.size());
+        route.static_head += "\r\nContent-Length: ";
+        route.static_head += std::to_string(body.size());
+        route.static_head += "\r\n";
+
+        add(std::move(route));
+    }
+
+    // Serves the contents of a file, read once now. Returns false if the file
+    // cannot be read.
+    bool add_static_file(const std::string& path, const std::string& file_name,
+        boost::string_view content_type = "application/octet-stream")
+    {
+        std::ifstream file(file_name, std::ios::binary);
+        if (!file)
+            return false;
+
+        std::ostringstream contents;
+        contents << file.rdbuf();
+        add_static(path, contents.str(), content_type);
+        return true;
+    }
+
+    // Returns the route for a path, or null.
+    const Route* find(boost::string_view path) const
+    {
+        auto exact = std::lower_bound(m_exact.begin(), m_exact.end(), path,
+            [](const Route& route, boost::string_view path) {
+                return boost::string_view(route.path) < path;
+            });
+        if (exact != m_exact.end() && exact->path == path)
+            return &*exact;
+
+        // Longest prefix first
+        for (const Route& route : m_prefixes)
+            if (path.starts_with(route.path))
+                return &route;
+
+        return nullptr;
+    }
+
+private:
+    void add(Route route)
+    {
+        bool is_prefix = !route.path.empty() && route.path.back() == '*';
+        if (is_prefix)
+            route.path.pop_back();
+        std::vector<Route>& routes = is_prefix ? m_prefixes : m_exact;
+
+        // A route added again replaces the earlier one
+        auto it = std::find_if(routes.begin(), routes.end(),
+            [&route](const Route& other) { return other.path == route.path; });
+        if (it != routes.end()) {
+            *it = std::move(route);
+            return;
+        }
+
+        routes.push_back(std::move(route));
+        if (is_prefix)
+            std::sort(routes.begin(), routes.end(), [](const Route& a, const Route& b) {
+                return a.path.size() > b.path.size();
+            });
+        else
+            std::sort(routes.begin(), routes.end(), [](const Route& a, const Route& b) {
+                return a.path < b.path;
+            });
+    }
+
+private:
+    std::vector<Route> m_exact;         // sorted by path
+    std::vector<Route> m_prefixes;      // sorted by length, longest first
+};
+
+// --------------------------------------------------------------------------------
+// ServerConnection class: A client connection. Requests are handled in the order
+// they arrive; the responses to the pipelined requests already received are
+// collected and sent with one gathered write. The connection is kept alive
+// until the client asks to close it, an invalid request arrives, or it has been
+// idle for too long.
+// --------------------------------------------------------------------------------
+
+class ServerConnection : public std::enable_shared_from_this<ServerConnection>
+{
+    static const std::size_t RECV_CHUNK_SIZE = 4096;
+    static const std::size_t MAX_BODY_SIZE = 1024 * 1024;
+    static const std::size_t MAX_OUTPUT_SIZE = 256 * 1024;  // written before handling more
+
+    // What the connection is reading
+    enum class State
+    {
+        head,
+        content_length_body,
+        chunked_body
+    };
+
+    // A part of the output. Static parts point at router memory, the others
+    // are offsets into m_out_data, which may be reallocated while it grows.
+    struct OutputPiece
+    {
+        const char* static_data;
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    // Refers to the write buffers instead of copying them into the operation
+    struct WriteBuffers
+    {
+        typedef asio::const_buffer value_type;
+        typedef std::vector<asio::const_buffer>::const_iterator const_iterator;
+
+        const_iterator begin() const { return buffers->begin(); }
+        const_iterator end() const { return buffers->end(); }
+
+        const std::vector<asio::const_buffer>* buffers;
+    };
+
+public:
+    ServerConnection(asio::io_service& ios, const Router& router,
+        std::chrono::steady_clock::duration idle_timeout) :
+        m_sock(ios),
+        m_idle_timer(ios),
+        m_router(router),
+        m_idle_timeout(idle_timeout),
+        m_state(State::head),
+        m_body_remaining(0),
+        m_out_size(0),
+        m_is_keep_alive(true),
+        m_is_closing(false)
+    {}
+
+    asio::ip::tcp::socket& get_socket() { return m_sock; }
+
+    // Starts reading requests once the connection has been accepted
+    void start()
+    {
+        boost::system::error_code ignored_ec;
+        m_sock.set_option(asio::ip::tcp::no_delay(true), ignored_ec);
+        read();
+    }
+
+private:
+    void read()
+    {
+        // Close the connection if the client sends nothing for too long
+        m_idle_timer.expires_from_now(m_idle_timeout);
+        auto self = shared_from_this();
+        m_idle_timer.async_wait(make_alloc_handler(m_timer_handler_memory,
+            [self](const boost::system::error_code& ec) {
+                // The timer may have been set again after it expired
+                if (ec == asio::error::operation_aborted
+                    || self->m_idle_timer.expires_at() > std::chrono::steady_clock::now())
+                    return;
+                self->close();
+            }));
+
+        m_sock.async_read_some(m_recv_buf.prepare(RECV_CHUNK_SIZE),
+            make_alloc_handler(m_handler_memory,
+            [self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                self->on_read(ec, bytes_transferred);
+            }));
+    }
+
+    void on_read(const boost::system::error_code& ec, std::size_t bytes_transferred)
+    {
+        m_idle_timer.cancel();
+
+        // Closed by the client, or by the idle timer
+        if (ec.value() != 0) {
+            close();
+            return;
+        }
+
+        m_recv_buf.commit(bytes_transferred);
+        process();
+    }
+
+    // Handles the requests received so far, then writes their responses or
+    // reads more requests.
+    void process()
+    {
+        while (!m_is_closing && m_out_size < MAX_OUTPUT_SIZE) {
+            if (!handle_next())
+                break;
+        }
+
+        if (m_out_size > 0) {
+            write();
+            return;
+        }
+
+        if (m_is_closing) {
+            close();
+            return;
+        }
+
+        read();
+    }
+
+    // Handles the request at the front of the receive buffer. Returns false
+    // if more data is needed.
+    bool handle_next()
+    {
+        if (m_state == State::head) {
+            const char* data = static_cast<const char*>(m_recv_buf.data().data());
+            HeadParser::Result result = m_parser.parse(data, m_recv_buf.size());
+
+            if (result == HeadParser::Result::incomplete)
+                return false;
+
+            if (result == HeadParser::Result::invalid || m_parser.get_version_minor() > 1) {
+                on_request_error(http_errors::invalid_request,
+                    result == HeadParser::Result::invalid && m_recv_buf.size() > HeadParser::MAX_HEAD_SIZE
+                        ? 431 : 400);
+                return false;
+            }
+
+            // Copy the request out of the receive buffer, which is consumed next
+            m_request.reset();
+            m_request.m_method.assign(m_parser.get_method().data(), m_parser.get_method().size());
+            m_request.set_target(m_parser.get_target());
+            m_request.m_version_minor = m_parser.get_version_minor();
+            for (const HeaderField& field : m_parser.get_fields())
+                m_request.m_headers.add(field.name, field.value);
+
+            m_recv_buf.consume(m_parser.get_head_size());
+            m_parser.reset();
+
+            if (!frame_request_body())
+                return false;
+        }
+
+        if (m_state == State::content_length_body) {
+            std::size_t size = std::min(m_recv_buf.size(), m_body_remaining);
+            move_to_body(size);
+            m_body_remaining -= size;
+            if (m_body_remaining > 0)
+                return false;
+        }
+        else if (m_state == State::chunked_body) {
+            boost::system::error_code ec;
+            const char* data = static_cast<const char*>(m_recv_buf.data().data());
+            std::size_t consumed = m_chunked_decoder.decode(data, m_recv_buf.size(),
+                m_request.m_body, ec);
+            m_recv_buf.consume(consumed);
+
+            if (ec.value() != 0) {
+                on_request_error(ec, 400);
+                return false;
+            }
+            if (m_request.m_body.size() > MAX_BODY_SIZE) {
+                on_request_error(http_errors::invalid_request, 413);
+                return false;
+            }
+            if (!m_chunked_decoder.is_done())
+                return false;
+        }
+
+        m_state = State::head;
+        dispatch();
+        return true;
+    }
+
+    // Determines how the request body is delimited (RFC 7230 section 3.3.3)
+    // and whether the connection stays open. Returns false on an error.
+    bool frame_request_body()
+    {
+        const HeaderTable& headers = m_request.get_headers();
+
+        // HTTP/1.1 connections persist unless closed, HTTP/1.0 ones only on request
+        boost::string_view connection;
+        bool has_connection = headers.find(KnownHeader::connection, connection);
+        if (m_request.get_version_minor() >= 1)
+            m_is_keep_alive = !(has_connection && HeaderTable::iequals_trimmed(connection, "close"));
+        else
+            m_is_keep_alive = has_connection && HeaderTable::iequals_trimmed(connection, "keep-alive");
+
+        // The final coding is the last one of the last Transfer-Encoding header
+        boost::string_view transfer_encoding;
+        std::size_t transfer_encodings = 0;
+        bool is_content_length_valid = false;
+        bool has_transfer_encoding = headers.find_transfer_encoding(transfer_encoding, 
+            transfer_encodings);
+        bool has_content_length = headers.find_content_length(m_body_remaining, 
+            is_content_length_valid);
+
+        // A request with both, or not chunked last, could be read differently 
+        // by a proxy in front of the server, so it is rejected.
+        if (has_transfer_encoding) {
+            if (has_content_length || !HeaderTable::is_chunked(transfer_encoding)) {
+                on_request_error(http_errors::invalid_request, 400);
+                return false;
+            }
+            m_chunked_decoder.reset();
+            m_state = State::chunked_body;
+        }
+        else if (has_content_length) {
+            if (!is_content_length_valid) {
+                on_request_error(http_errors::invalid_request, 400);
+                return false;
+            }
+            if (m_body_remaining > MAX_BODY_SIZE) {
+                on_request_error(http_errors::invalid_request, 413);
+                return false;
+            }
+            if (m_body_remaining > 0)
+                m_state = State::content_length_body;
+        }
+
+        // The client waits for the go-ahead before sending the body
+        boost::string_view expect;
+        if (m_state != State::head && m_request.get_version_minor() >= 1
+            && headers.find("Expect", expect) && HeaderTable::iequals_trimmed(expect, "100-continue"))
+            queue_static("HTTP/1.1 100 Continue\r\n\r\n");
+
+        return true;
+    }
+
+    // Moves body bytes from the receive buffer to the request
+    void move_to_body(std::size_t size)
+    {
+        asio::streambuf& body = m_request.m_body;
+        asio::buffer_copy(body.prepare(size), m_recv_buf.data(), size);
+        body.commit(size);
+        m_recv_buf.consume(size);
+    }
+
+    // Routes the request and queues its response
+    void dispatch()
+    {
+        const Router::Route* route = m_router.find(m_request.get_path());
+        boost::string_view method = m_request.get_method();
+        bool is_head = method == "HEAD";
+
+        if (route != nullptr && route->is_static()) {
+            if (method != "GET" && !is_head) {
+                m_response.reset();
+                m_response.set_status(405);
+                m_response.add_header("Allow", "GET, HEAD");
+                queue_response(false);
+                return;
+            }
+
+            queue_static(route->static_head);
+            if (!m_is_keep_alive)
+                queue_static("Connection: close\r\n");
+            else if (m_request.get_version_minor() == 0)
+                queue_static("Connection: keep-alive\r\n");
+            queue_static("\r\n");
+            if (!is_head)
+                queue_static(route->static_body);
+
+            if (!m_is_keep_alive)
+                m_is_closing = true;
+            return;
+        }
+
+        m_response.reset();
+        if (route == nullptr) {
+            m_response.set_status(404);
+            m_response.add_header("Content-Type", "text/plain");
+            m_response.set_body("Not Found\n");
+        }
+        else {
+            route->handler(m_request, m_response);
+        }
+        queue_response(is_head);
+    }
+
+    // Renders the response filled in by a handler
+    void queue_response(bool is_head)
+    {
+        if (m_response.m_is_close)
+            m_is_keep_alive = false;
+
+        queue("HTTP/1.1 ");
+        queue(std::to_string(m_response.m_status_code));
+        queue(" ");
+        queue(m_response.m_reason);
+        queue("\r\nServer: asio-http-server\r\n");
+        queue(m_response.m_headers);
+
+        // 1xx, 204 and 304 responses have no body and no Content-Length
+        unsigned int status_code = m_response.m_status_code;
+        bool has_body = !(status_code / 100 == 1 || status_code == 204 || status_code == 304);
+        if (has_body) {
+            queue("Content-Length: ");
+            queue(std::to_string(m_response.m_body.size()));
+            queue("\r\n");
+        }
+
+        if (!m_is_keep_alive)
+            queue("Connection: close\r\n");
+        else if (m_request.get_version_minor() == 0)
+            queue("Connection: keep-alive\r\n");
+        queue("\r\n");
+
+        if (has_body && !is_head)
+            queue(m_response.m_body);
+
+        if (!m_is_keep_alive)
+            m_is_closing = true;
+    }
+
+    // Answers a request that cannot be handled and closes the connection, as
+    // the rest of the received data cannot be trusted.
+    void on_request_error(const boost::system::error_code& ec, unsigned int status_code)
+    {
+        m_response.reset();
+        m_response.set_status(status_code);
+        m_response.add_header("Content-Type", "text/plain");
+        m_response.set_body(ec.message());
+        m_response.append_body("\n");
+        m_response.set_close();
+
+        m_request.m_version_minor = 1;
+        m_state = State::head;
+        queue_response(false);
+    }
+
+    // Queues bytes that live as long as the router, they are not copied
+    void queue_static(boost::string_view data)
+    {
+        m_pieces.push_back(OutputPiece{ data.data(), 0, data.size() });
+        m_out_size += data.size();
+    }
+
+    // Queues a copy of the bytes
+    void queue(boost::string_view data)
+    {
+        // Consecutive copies form one piece
+        if (!m_pieces.empty() && m_pieces.back().static_data == nullptr)
+            m_pieces.back().size += data.size();
+        else
+            m_pieces.push_back(OutputPiece{ nullptr, m_out_data.size(), data.size() });
+
+        m_out_data.append(data.data(), data.size());
+        m_out_size += data.size();
+    }
+
+    void write()
+    {
+        m_write_bufs.clear();
+        for (const OutputPiece& piece : m_pieces) {
+            const char* data = piece.static_data ? piece.static_data
+                : m_out_data.data() + piece.offset;
+            m_write_bufs.push_back(asio::buffer(data, piece.size));
+        }
+
+        auto self = shared_from_this();
+        asio::async_write(m_sock, WriteBuffers{ &m_write_bufs },
+            make_alloc_handler(m_handler_memory,
+            [self](const boost::system::error_code& ec, std::size_t) {
+                self->on_write(ec);
+            }));
+    }
+
+    void on_write(const boost::system::error_code& ec)
+    {
+        m_pieces.clear();
+        m_out_data.clear();
+        m_out_size = 0;
+
+        if (ec.value() != 0 || m_is_closing) {
+            close();
+            return;
+        }
+
+        // More pipelined requests may be waiting in the receive buffer
+        process();
+    }
+
+    void close()
+    {
+        m_is_closing = true;
+        m_idle_timer.cancel();
+
+        if (!m_sock.is_open())
+            return;
+
+        // Send what has been written before the FIN, then close
+        boost::system::error_code ignored_ec;
+        m_sock.shutdown(asio::ip::tcp::socket::shutdown_both, ignored_ec);
+        m_sock.close(ignored_ec);
+    }
+
+private:
+    asio::ip::tcp::socket m_sock;
+    asio::steady_timer m_idle_timer;
+    const Router& m_router;
+    std::chrono::steady_clock::duration m_idle_timeout;
+
+    // Request being received
+    asio::streambuf m_recv_buf;
+    RequestHeadParser m_parser;
+    State m_state;
+    std::size_t m_body_remaining;       // Content-Length bytes still to read
+    ChunkedDecoder m_chunked_decoder;
+    ServerRequest m_request;
+    ServerResponse m_response;
+
+    // Responses waiting to be written
+    std::vector<OutputPiece> m_pieces;
+    std::string m_out_data;
+    std::size_t m_out_size;
+    std::vector<asio::const_buffer> m_write_bufs;
+
+    bool m_is_keep_alive;               // the current request keeps the connection
+    bool m_is_closing;                  // no more requests are handled
+
+    // Memory for the read or write in progress, and for the idle timer
+    HandlerMemory m_handler_memory;
+    HandlerMemory m_timer_handler_memory;
+};
+
+// --------------------------------------------------------------------------------
+// HTTPServer class: Runs N threads, each with its own io_service and its own
+// acceptor. The acceptors listen on the same port with SO_REUSEPORT, so the
+// kernel spreads incoming connections across them and a connection is served
+// by the thread that accepted it, without locking. Where SO_REUSEPORT is not
+// available the first thread accepts for all of them, round-robin.
+// --------------------------------------------------------------------------------
+
+class HTTPServer
+{
+    static const unsigned int DEFAULT_IDLE_TIMEOUT_SEC = 60;
+    static const unsigned int ACCEPT_RETRY_MSEC = 100;
+
+public:
+    HTTPServer(const Router& router, unsigned int num_threads = 1) :
+        m_router(router),
+        m_idle_timeout(std::chrono::seconds(DEFAULT_IDLE_TIMEOUT_SEC)),
+        m_next_worker(0)
+    {
+        assert(num_threads > 0);
+
+        for (unsigned int i = 0; i < num_threads; ++i)
+            m_workers.emplace_back(new Worker());
+    }
+
+    // Connections idle for longer are closed
+    void set_idle_timeout(std::chrono::steady_clock::duration idle_timeout) {
+        m_idle_timeout = idle_timeout;
+    }
+
+    // Starts listening on the port and serving connections
+    void start(unsigned short port)
+    {
+        asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+
+#ifdef SO_REUSEPORT
+        for (auto& worker : m_workers)
+            open_acceptor(*worker, endpoint);
+#else
+        open_acceptor(*m_workers[0], endpoint);
+#endif
+
+        for (auto& worker : m_workers) {
+            if (worker->acceptor.is_open())
+                accept(*worker);
+
+            Worker* w = worker.get();
+            worker->thread.reset(new std::thread([w]() {
+                w->ios.run();
+            }));
+        }
+    }
+
+    // Stops accepting and serving, in-progress requests are dropped.
+    void stop()
+    {
+        for (auto& worker : m_workers)
+            worker->ios.stop();
+
+        for (auto& worker : m_workers)
+            if (worker->thread)
+                worker->thread->join();
+    }
+
+    unsigned int get_num_threads() const {
+        return static_cast<unsigned int>(m_workers.size());
+    }
+
+private:
+    // An event loop and its acceptor
+    struct Worker
+    {
+        // Only this worker's thread runs the io_service
+        Worker() : ios(1), acceptor(ios), retry_timer(ios)
+        {}
+
+        asio::io_service ios;
+        asio::ip::tcp::acceptor acceptor;
+        asio::steady_timer retry_timer;         // accepting again after an error
+        std::unique_ptr<std::thread> thread;    // runs io_service event loop
+    };
+
+#ifdef SO_REUSEPORT
+    typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
+    void open_acceptor(Worker& worker, const asio::ip::tcp::endpoint& endpoint)
+    {
+        worker.acceptor.open(endpoint.protocol());
+        worker.acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        worker.acceptor.set_option(reuse_port(true));
+#endif
+        worker.acceptor.bind(endpoint);
+        worker.acceptor.listen(asio::socket_base::max_listen_connections);
+    }
+
+    void accept(Worker& worker)
+    {
+#ifdef SO_REUSEPORT
+        Worker& owner = worker;
+#else
+        // With one acceptor, connections are spread over the threads here
+        Worker& owner = *m_workers[m_next_worker++ % m_workers.size()];
+#endif
+
+        std::shared_ptr<ServerConnection> conn =
+            std::make_shared<ServerConnection>(owner.ios, m_router, m_idle_timeout);
+
+        worker.acceptor.async_accept(conn->get_socket(),
+            [this, &worker, &owner, conn](const boost::system::error_code& ec) {
+                if (ec == asio::error::operation_aborted) return; // stopped
+
+                if (ec.value() != 0) {
+                    // Out of descriptors, for example. Try again shortly
+                    // rather than spinning.
+                    worker.retry_timer.expires_from_now(
+                        std::chrono::milliseconds(ACCEPT_RETRY_MSEC));
+                    worker.retry_timer.async_wait([this, &worker](const boost::system::error_code& ec) {
+                        if (ec.value() == 0)
+                            accept(worker);
+                    });
+                    return;
+                }
+
+                // The connection runs on its own thread
+                if (&owner == &worker)
+                    conn->start();
+                else
+                    owner.ios.post([conn]() { conn->start(); });
+
+                accept(worker);
+            });
+    }
+
+private:
+    const Router& m_router;
+    std::chrono::steady_clock::duration m_idle_timeout;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    unsigned int m_next_worker;                 // only used by the accepting thread
+};
+
+const unsigned int HTTPServer::DEFAULT_IDLE_TIMEOUT_SEC;
+const unsigned int HTTPServer::ACCEPT_RETRY_MSEC;
+
+// --------------------------------------------------------------------------------
+// Raises the limit on open descriptors to the hard limit, so that the server
+// can hold tens of thousands of connections.
+// --------------------------------------------------------------------------------
+
+void raise_open_file_limit()
+{
+#if BOOST_OS_LINUX
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+// --------------------------------------------------------------------------------
+// main: server [port] [threads]
+// --------------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    try 
+    {
+        unsigned short port = argc > 1 ? static_cast<unsigned short>(std::atoi(argv[1])) : 8080;
+        unsigned int num_threads = argc > 2 ? std::atoi(argv[2])
+            : std::max(1u, std::thread::hardware_concurrency());
+
+        raise_open_file_limit();
+
+        Router router;
+        router.add_static("/", "Hello from asio-http-server\n");
+        router.add_static("/index.html",
+            "<html><body><h1>asio-http-server</h1></body></html>\n", "text/html");
+
+        // Echoes the request back
+        router.add_handler("/echo/*", [](const ServerRequest& request, ServerResponse& response) {
+            response.add_header("Content-Type", "text/plain");
+            response.append_body(request.get_method());
+            response.append_body(" ");
+            response.append_body(request.get_target());
+            response.append_body("\n");
+            for (const HeaderField& field : request.get_headers()) {
+                response.append_body(field.name);
+                response.append_body(": ");
+                response.append_body(field.value);
+                response.append_body("\n");
+            }
+            response.append_body("\n");
+            response.append_body(request.get_body());
+        });
+
+        HTTPServer server(router, num_threads);
+        server.start(port);
+        std::cout << "Listening on port " << port << " with "
+            << server.get_num_threads() << " threads" << std::endl;
+
+        // Run until interrupted
+        asio::io_service signal_ios;
+        asio::signal_set signals(signal_ios, SIGINT, SIGTERM);
+        signals.async_wait([&server](const boost::system::error_code&, int) {
+            server.stop();
+        });
+        signal_ios.run();
+    }
+    catch (boost::system::system_error& e)
+    {
+        std::cerr << "Error occured. Error code = " << e.code()
+            << ". Message: " << e.what() << std::endl;
+        
+        return e.code().value();
+    }
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+Options of the client's TCP sockets: Nagle's algorithm, buffer sizes, delayed
+acknowledgements, busy polling and TCP Fast Open.
+*/
+
+#ifndef SOCKET_OPTIONS_HPP
+#define SOCKET_OPTIONS_HPP
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/system/error_code.hpp>
+#include <ostream>
+
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+// --------------------------------------------------------------------------------
+// SocketOptions struct: How the sockets of new connections are set up; what is
+// left at its default keeps the OS default. The buffer sizes and Fast Open are
+// set before connecting, as the receive buffer decides the window scale sent in
+// the SYN; the rest once connected. The kernel may clamp the buffer sizes, and
+// raising the busy poll time above net.core.busy_read needs CAP_NET_ADMIN. The
+// options are hints: one the OS does not support or refuses is left out, and
+// the connection goes ahead without it.
+// --------------------------------------------------------------------------------
+
+struct SocketOptions
+{
+    SocketOptions() :
+        is_no_delay(false),
+        receive_buffer_size(0),
+        send_buffer_size(0),
+        is_quick_ack(false),
+        busy_poll_us(0),
+        is_fast_open(false)
+    {}
+
+    // Before connect(), the socket is open
+    void apply_unconnected(boost::asio::ip::tcp::socket& sock) const
+    {
+        boost::system::error_code ignored_ec;
+        if (receive_buffer_size > 0)
+            sock.set_option(boost::asio::socket_base::receive_buffer_size(
+                receive_buffer_size), ignored_ec);
+        if (send_buffer_size > 0)
+            sock.set_option(boost::asio::socket_base::send_buffer_size(
+                send_buffer_size), ignored_ec);
+
+#if defined(TCP_FASTOPEN_CONNECT)
+        // connect() then completes at once, the SYN goes out with the first
+        // write and carries it if the server's cookie is known
+        if (is_fast_open)
+            set_int(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+#endif
+    }
+
+    void apply_connected(boost::asio::ip::tcp::socket& sock) const
+    {
+        boost::system::error_code ignored_ec;
+        if (is_no_delay)
+            sock.set_option(boost::asio::ip::tcp::no_delay(true), ignored_ec);
+
+#if defined(SO_BUSY_POLL)
+        if (busy_poll_us > 0)
+            set_int(sock, SOL_SOCKET, SO_BUSY_POLL, static_cast<int>(busy_poll_us));
+#endif
+        apply_quick_ack(sock);
+    }
+
+    // The kernel falls back to delayed ACKs on its own, so quick ACKs are
+    // asked for again whenever a response is awaited
+    void apply_quick_ack(boost::asio::ip::tcp::socket& sock) const
+    {
+#if defined(TCP_QUICKACK)
+        if (is_quick_ack)
+            set_int(sock, IPPROTO_TCP, TCP_QUICKACK, 1);
+#else
+        (void)sock;
+#endif
+    }
+
+    // The options set, for reports
+    void write(std::ostream& out) const
+    {
+        bool is_default = true;
+        if (is_no_delay) { out << "nodelay "; is_default = false; }
+        if (receive_buffer_size > 0) { out << "rcvbuf=" << receive_buffer_size << ' '; is_default = false; }
+        if (send_buffer_size > 0) { out << "sndbuf=" << send_buffer_size << ' '; is_default = false; }
+        if (is_quick_ack) { out << "quickack "; is_default = false; }
+        if (busy_poll_us > 0) { out << "busy-poll=" << busy_poll_us << ' '; is_default = false; }
+        if (is_fast_open) { out << "fastopen "; is_default = false; }
+        if (is_default)
+            out << "defaults";
+    }
+
+    bool is_no_delay;                   // TCP_NODELAY, sends small writes at once
+    int receive_buffer_size;            // SO_RCVBUF in bytes, zero for the default
+    int send_buffer_size;               // SO_SNDBUF in bytes, zero for the default
+    bool is_quick_ack;                  // TCP_QUICKACK, Linux only
+    unsigned int busy_poll_us;          // SO_BUSY_POLL, Linux only
+    bool is_fast_open;                  // TCP_FASTOPEN_CONNECT, Linux only
+
+private:
+#if defined(TCP_FASTOPEN_CONNECT) || defined(SO_BUSY_POLL) || defined(TCP_QUICKACK)
+    static void set_int(boost::asio::ip::tcp::socket& sock, int level, int name, int value) {
+        ::setsockopt(sock.native_handle(), level, name, &value, sizeof(value));
+    }
+#endif
+};
+
+#endif // SOCKET_OPTIONS_HPP
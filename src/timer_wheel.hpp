@@ -0,0 +1,232 @@
+/*
+Hierarchical timer wheel for large numbers of deadlines.
+*/
+
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// --------------------------------------------------------------------------------
+// TimerWheel class: Keeps deadlines, counted in ticks, in four levels of 64 slots
+// each, as in the classic Linux kernel timers. The first level holds the next 64
+// ticks one slot per tick, each further level covers 64 times the span of the
+// one below. Scheduling and cancelling unlink and link an entry in O(1), and
+// entries of a higher level are moved down once when their slot comes around.
+// Entries are intrusive and owned by the caller, so the wheel never allocates.
+// A single thread must own the wheel and its entries.
+// --------------------------------------------------------------------------------
+
+class TimerWheel
+{
+    static const unsigned int SLOT_BITS = 6;
+    static const std::size_t SLOT_COUNT = 1 << SLOT_BITS;
+    static const std::uint64_t SLOT_MASK = SLOT_COUNT - 1;
+    static const unsigned int LEVEL_COUNT = 4;
+
+    // Links of a circular list, a slot is the list's head
+    struct Link
+    {
+        Link() : prev(this), next(this)
+        {}
+
+        Link(const Link&) = delete;
+        Link& operator=(const Link&) = delete;
+
+        bool is_linked() const { return next != this; }
+
+        void link_before(Link& other) {
+            prev = other.prev;
+            next = &other;
+            other.prev->next = this;
+            other.prev = this;
+        }
+
+        void unlink() {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = this;
+        }
+
+        Link* prev;
+        Link* next;
+    };
+
+public:
+    // A deadline, on_expired is invoked by advance() once its tick has passed.
+    class Entry : private Link
+    {
+        friend class TimerWheel;
+
+    public:
+        explicit Entry(std::function<void()> on_expired) :
+            m_expiry(0),
+            m_on_expired(std::move(on_expired))
+        {}
+
+        // Owners cancel entries before destroying them. This only keeps the 
+        // lists intact when an owner is torn down with the wheel.
+        ~Entry() {
+            if (is_linked())
+                unlink();
+        }
+
+        bool is_scheduled() const { return is_linked(); }
+        std::uint64_t get_expiry() const { return m_expiry; }
+
+    private:
+        std::uint64_t m_expiry;
+        std::function<void()> m_on_expired;
+    };
+
+    TimerWheel() : m_current(0), m_size(0)
+    {}
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    ~TimerWheel() {
+        // Entries may outlive the wheel, leave them unlinked
+        for (auto& level : m_slots)
+            for (auto& slot : level)
+                while (slot.is_linked())
+                    slot.next->unlink();
+    }
+
+    std::uint64_t get_current() const { return m_current; }
+    bool is_empty() const { return m_size == 0; }
+
+    // Schedules, or moves, the entry to expire at tick. Ticks that have
+    // passed expire at the next advance().
+    void schedule(Entry& entry, std::uint64_t tick)
+    {
+        if (entry.is_linked())
+            entry.unlink();
+        else
+            ++m_size;
+
+        entry.m_expiry = tick;
+        insert(entry, m_current + 1);
+    }
+
+    void cancel(Entry& entry)
+    {
+        if (!entry.is_linked()) return;
+
+        entry.unlink();
+        --m_size;
+    }
+
+    // Expires the entries due up to and including tick. They may schedule or
+    // cancel entries from on_expired.
+    void advance(std::uint64_t tick)
+    {
+        while (m_current < tick)
+        {
+            if (m_size == 0) {
+                m_current = tick; // nothing to move down or expire
+                return;
+            }
+
+            ++m_current;
+
+            // At the start of each span of a level, the matching slot of the
+            // level above is moved down.
+            for (unsigned int level = 1; level < LEVEL_COUNT
+                && ((m_current >> (SLOT_BITS * (level - 1))) & SLOT_MASK) == 0; ++level)
+                cascade(level);
+
+            expire(m_slots[0][m_current & SLOT_MASK]);
+        }
+    }
+
+    // The earliest tick at which advance() may have something to do, for
+    // sleeping until then. It is the next occupied slot of the first level,
+    // or the next time the second level moves down.
+    std::uint64_t get_next_tick() const
+    {
+        std::uint64_t block_end = (m_current | SLOT_MASK) + 1;
+        for (std::uint64_t tick = m_current + 1; tick < block_end; ++tick)
+            if (m_slots[0][tick & SLOT_MASK].is_linked())
+                return tick;
+        return block_end;
+    }
+
+private:
+    // Links the entry into the slot for its expiry, or for the earliest tick
+    // still to be processed if that has passed.
+    void insert(Entry& entry, std::uint64_t earliest)
+    {
+        std::uint64_t expiry = std::max(entry.m_expiry, earliest);
+        std::uint64_t delta = expiry - m_current;
+
+        unsigned int level = 0;
+        while (level + 1 < LEVEL_COUNT && delta >= (std::uint64_t(1) << (SLOT_BITS * (level + 1))))
+            ++level;
+
+        // Beyond the span of the wheel, parked in the furthest slot and
+        // placed again when that slot comes around.
+        if (delta >= (std::uint64_t(1) << (SLOT_BITS * LEVEL_COUNT)))
+            expiry = m_current + (std::uint64_t(1) << (SLOT_BITS * LEVEL_COUNT)) - 1;
+
+        std::size_t slot = static_cast<std::size_t>((expiry >> (SLOT_BITS * level)) & SLOT_MASK);
+        entry.link_before(m_slots[level][slot]);
+    }
+
+    void cascade(unsigned int level)
+    {
+        Link& slot = m_slots[level][(m_current >> (SLOT_BITS * level)) & SLOT_MASK];
+
+        // Detached first, entries can land in the same slot again
+        Link pending;
+        take_all(slot, pending);
+        while (pending.is_linked()) {
+            Entry& entry = static_cast<Entry&>(*pending.next);
+            entry.unlink();
+            insert(entry, m_current); // the current tick is expired next
+        }
+    }
+
+    void expire(Link& slot)
+    {
+        // on_expired may cancel or schedule any entry, including those not
+        // yet expired in this list, so they are taken one at a time.
+        Link pending;
+        take_all(slot, pending);
+        while (pending.is_linked()) {
+            Entry& entry = static_cast<Entry&>(*pending.next);
+            entry.unlink();
+            --m_size;
+
+            if (entry.m_expiry > m_current) {
+                ++m_size; // parked beyond the span of the wheel
+                insert(entry, m_current + 1);
+                continue;
+            }
+            entry.m_on_expired();
+        }
+    }
+
+    static void take_all(Link& from, Link& to)
+    {
+        assert(!to.is_linked());
+        if (!from.is_linked()) return;
+
+        to.next = from.next;
+        to.prev = from.prev;
+        to.next->prev = &to;
+        to.prev->next = &to;
+        from.prev = from.next = &from;
+    }
+
+private:
+    Link m_slots[LEVEL_COUNT][SLOT_COUNT];
+    std::uint64_t m_current;            // the last tick advanced to
+    std::size_t m_size;                 // entries scheduled
+};
+
+#endif // TIMER_WHEEL_HPP
@@ -0,0 +1,195 @@
+/*
+Tests of the response cache against a server run in the same process. Build
+from the repository root and run:
+
+    g++ -std=c++11 -Isrc tests/response_cache_test.cpp -o response_cache_test -lpthread
+    ./response_cache_test
+
+It exits with 0 when every check passes.
+*/
+
+#define HTTP_CLIENT_NO_MAIN
+#include "../src/client.cpp"
+
+#include <future>
+#include <map>
+
+namespace {
+
+// --------------------------------------------------------------------------------
+// TestServer class: Answers every request on a thread of its own, and counts
+// the requests per path. Each response is fresh for a minute, the path picks
+// what else it carries:
+//   /variant   the body is the value of the X-Variant request header
+//   /cookie    sets a cookie
+//   /private   is Cache-Control: private
+//   anything   the body is the path
+// --------------------------------------------------------------------------------
+
+class TestServer
+{
+public:
+    TestServer() : m_acceptor(m_ios, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0))
+    {
+        m_port = m_acceptor.local_endpoint().port();
+        std::thread([this]() { accept(); }).detach();
+    }
+
+    unsigned int get_port() const { return m_port; }
+
+    unsigned int get_count(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(m_mux);
+        return m_counts[path];
+    }
+
+private:
+    void accept()
+    {
+        for (;;) {
+            std::shared_ptr<asio::ip::tcp::socket> socket(new asio::ip::tcp::socket(m_ios));
+            boost::system::error_code ec;
+            m_acceptor.accept(*socket, ec);
+            if (ec) return;
+            std::thread([this, socket]() { serve(*socket); }).detach();
+        }
+    }
+
+    void serve(asio::ip::tcp::socket& socket)
+    {
+        asio::streambuf buf;
+        boost::system::error_code ec;
+        for (;;) {
+            std::size_t size = asio::read_until(socket, buf, "\r\n\r\n", ec);
+            if (ec) return;
+
+            std::string head(asio::buffers_begin(buf.data()),
+                asio::buffers_begin(buf.data()) + size);
+            buf.consume(size);
+
+            std::size_t begin = head.find(' ') + 1;
+            std::string path = head.substr(begin, head.find(' ', begin) - begin);
+            {
+                std::lock_guard<std::mutex> lock(m_mux);
+                ++m_counts[path];
+            }
+
+            std::string body = path;
+            std::string headers = "Cache-Control: max-age=60\r\n";
+            if (path == "/variant")
+                body = get_header(head, "X-Variant");
+            else if (path == "/cookie")
+                headers += "Set-Cookie: session=1\r\n";
+            else if (path == "/private")
+                headers = "Cache-Control: private, max-age=60\r\n";
+
+            std::string response = "HTTP/1.1 200 OK\r\n" + headers + "Content-Length: "
+                + std::to_string(body.size()) + "\r\n\r\n" + body;
+            asio::write(socket, asio::buffer(response), ec);
+            if (ec) return;
+        }
+    }
+
+    static std::string get_header(const std::string& head, const std::string& name)
+    {
+        std::size_t begin = head.find("\r\n" + name + ": ");
+        if (begin == std::string::npos) return std::string();
+        begin += name.size() + 4;
+        return head.substr(begin, head.find("\r\n", begin) - begin);
+    }
+
+    asio::io_service m_ios;
+    asio::ip::tcp::acceptor m_acceptor;
+    unsigned int m_port;
+    std::map<std::string, unsigned int> m_counts;
+    std::mutex m_mux;
+};
+
+unsigned int g_failures = 0;
+
+void check(bool condition, const char* what)
+{
+    if (!condition) {
+        std::cout << "FAILED: " << what << "\n";
+        ++g_failures;
+    }
+}
+
+// Sends a GET request and waits for its response body
+std::string get(HTTPClient& client, const TestServer& server, const std::string& uri,
+    const std::map<std::string, std::string>& headers = std::map<std::string, std::string>())
+{
+    std::shared_ptr<HTTPRequest> request = client.create_request(0);
+    request->set_host("127.0.0.1");
+    request->set_port(server.get_port());
+    request->set_uri(uri);
+    for (const auto& header : headers)
+        request->add_header(header.first, header.second);
+
+    std::promise<std::string> body;
+    request->set_callback([&body](const HTTPRequest&, const HTTPResponse& response,
+        const boost::system::error_code& ec)
+    {
+        std::ostringstream out;
+        if (ec)
+            out << "error: " << ec.message();
+        else
+            out << response.get_response().rdbuf();
+        body.set_value(out.str());
+    });
+    request->execute();
+    return body.get_future().get();
+}
+
+void test_headers_are_part_of_the_key(HTTPClient& client, TestServer& server)
+{
+    check(get(client, server, "/variant", {{"X-Variant", "a"}}) == "a", "first variant sent");
+    check(get(client, server, "/variant", {{"X-Variant", "b"}}) == "b",
+        "a request that differs in a header does not share the entry");
+    check(get(client, server, "/variant", {{"X-Variant", "a"}}) == "a", "first variant cached");
+    check(get(client, server, "/variant", {{"X-Variant", "b"}}) == "b", "second variant cached");
+    check(server.get_count("/variant") == 2, "one request sent per variant");
+}
+
+void test_credentials_are_not_cached(HTTPClient& client, TestServer& server)
+{
+    get(client, server, "/auth", {{"Authorization", "Bearer x"}});
+    get(client, server, "/auth", {{"Authorization", "Bearer x"}});
+    check(server.get_count("/auth") == 2, "requests with Authorization are not cached");
+
+    get(client, server, "/auth");
+    get(client, server, "/auth", {{"Cookie", "session=1"}});
+    check(server.get_count("/auth") == 4, "requests with Cookie are not served from the cache");
+}
+
+void test_private_responses_are_not_stored(HTTPClient& client, TestServer& server)
+{
+    get(client, server, "/cookie");
+    get(client, server, "/cookie");
+    check(server.get_count("/cookie") == 2, "responses with Set-Cookie are not stored");
+
+    get(client, server, "/private");
+    get(client, server, "/private");
+    check(server.get_count("/private") == 2, "Cache-Control: private responses are not stored");
+
+    get(client, server, "/public");
+    get(client, server, "/public");
+    check(server.get_count("/public") == 1, "other fresh responses are stored");
+}
+
+}
+
+int main()
+{
+    TestServer server;
+    HTTPClient client;
+    client.set_response_cache(1 << 20);
+
+    test_headers_are_part_of_the_key(client, server);
+    test_credentials_are_not_cached(client, server);
+    test_private_responses_are_not_stored(client, server);
+
+    client.close();
+    std::cout << (g_failures ? "FAILED\n" : "OK\n");
+    return g_failures ? 1 : 0;
+}